@@ -1,7 +1,15 @@
 // Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
 // SPDX-License-Identifier: Unlicense
+#include "Allocator.h"
+#include "Colors.h"
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <stdexcept>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef _MSC_VER
 #define NOMINMAX
@@ -9,52 +17,241 @@
 struct IUnknown; // workaround for old Win SDK header failures when using /permissive-
 #include <windows.h>
 #else
-#include <stdio.h>
 #include <sys/mman.h>
 #endif
 
-// Super trivial "allocator" that just never frees memory :)
-// Get chunks of memory (32MB each) from OS via VirtualAlloc/mmap,
-// allocate by bumping a pointer, and never do any deallocation.
-// We are a command line tool, the OS will free up the memory on exit.
+// Replaces global operator new/delete:
+// - inside an ArenaScope, memory comes from the current arena; delete of it does nothing.
+// - otherwise it's regular malloc/free, with a small header to keep track of heap size.
+//
+// All arena memory comes in 32MB chunks from one big range of reserved address
+// space, so operator delete can tell arena memory apart just by its address, without
+// touching it (the arena might have released it already).
 
-const size_t kBlockSize = 32 * 1024 * 1024;
-static void* s_CurBlock = nullptr;
-static size_t s_CurBlockUsed = 0;
-static size_t s_CurBlockSize = 0;
+const size_t kChunkSize = 32 * 1024 * 1024;
+const size_t kMaxChunks = 8192; // 256GB of address space
+const size_t kMaxArenaAllocation = kChunkSize / 4; // larger ones go to the heap, and get freed normally
+const size_t kAlignment = 16;
 
+static std::atomic<char*> s_ArenaRange(nullptr);
+static bool s_ArenaRangeFailed = false;
+static std::mutex s_ChunkMutex;
+static size_t s_ChunksUsed = 0; // chunks handed out from start of the range so far
+static uint32_t s_FreeChunks[kMaxChunks];
+static size_t s_FreeChunkCount = 0;
 
-void* operator new(size_t count)
+static thread_local Arena* s_CurrentArena = nullptr;
+
+static std::atomic<size_t> s_HeapUsed(0);
+static std::atomic<size_t> s_HeapPeak(0);
+static std::atomic<size_t> s_HeapAllocations(0);
+static std::atomic<size_t> s_ArenaAllocations(0);
+
+struct ArenaStats
 {
-    // allocate new chunk of memory if needed
-    if (s_CurBlock == nullptr || s_CurBlockUsed + count > s_CurBlockSize)
+    const char* name;
+    size_t peak;
+    int count;
+};
+const int kMaxArenaStats = 32;
+static ArenaStats s_ArenaStats[kMaxArenaStats];
+static int s_ArenaStatsCount = 0;
+
+
+static void* HeapAllocate(size_t size)
+{
+    char* block = (char*)malloc(size + kAlignment);
+    if (block == nullptr)
     {
-        s_CurBlockSize = std::max(kBlockSize, count);
+        printf("ERROR: failed to allocate %zu bytes\n", size);
+        throw std::bad_alloc();
+    }
+    *(size_t*)block = size;
+    s_HeapAllocations.fetch_add(1, std::memory_order_relaxed);
+    size_t used = s_HeapUsed.fetch_add(size, std::memory_order_relaxed) + size;
+    size_t peak = s_HeapPeak.load(std::memory_order_relaxed);
+    while (used > peak && !s_HeapPeak.compare_exchange_weak(peak, used, std::memory_order_relaxed))
+        ;
+    return block + kAlignment;
+}
+
+static void HeapFree(void* p)
+{
+    char* block = (char*)p - kAlignment;
+    s_HeapUsed.fetch_sub(*(size_t*)block, std::memory_order_relaxed);
+    free(block);
+}
+
+static bool IsArenaMemory(const void* p)
+{
+    const char* range = s_ArenaRange.load(std::memory_order_relaxed);
+    return range != nullptr && p >= range && p < range + kChunkSize * kMaxChunks;
+}
+
+// called with s_ChunkMutex locked
+static char* ReserveArenaRange()
+{
+    char* range = s_ArenaRange.load(std::memory_order_relaxed);
+    if (range != nullptr || s_ArenaRangeFailed)
+        return range;
 #ifdef _MSC_VER
-        s_CurBlock = VirtualAlloc(NULL, s_CurBlockSize, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
-        if (s_CurBlock == nullptr)
-        {
-            DWORD err = GetLastError();
-            printf("ERROR: failed to allocate %zu bytes via VirtualAlloc, error %i\n", count, err);
-            throw std::bad_alloc();
-            return nullptr;
-        }
+    range = (char*)VirtualAlloc(NULL, kChunkSize * kMaxChunks, MEM_RESERVE, PAGE_NOACCESS);
 #else
-        s_CurBlock = mmap(0, s_CurBlockSize, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, 0, 0);
-        if (s_CurBlock == nullptr)
-        {
-            printf("ERROR: failed to allocate %zu bytes via mmap\n", count);
-            throw std::bad_alloc();
-        }
+    void* res = mmap(0, kChunkSize * kMaxChunks, PROT_NONE, MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    range = res != MAP_FAILED ? (char*)res : nullptr;
 #endif
-        s_CurBlockUsed = 0;
+    if (range == nullptr)
+        s_ArenaRangeFailed = true; // arenas will just use the heap then
+    s_ArenaRange.store(range, std::memory_order_relaxed);
+    return range;
+}
+
+static char* AcquireChunk()
+{
+    std::lock_guard<std::mutex> lock(s_ChunkMutex);
+    char* range = ReserveArenaRange();
+    if (range == nullptr)
+        return nullptr;
+    size_t index;
+    if (s_FreeChunkCount != 0)
+        index = s_FreeChunks[--s_FreeChunkCount];
+    else if (s_ChunksUsed < kMaxChunks)
+        index = s_ChunksUsed++;
+    else
+        return nullptr;
+    char* chunk = range + index * kChunkSize;
+#ifdef _MSC_VER
+    if (VirtualAlloc(chunk, kChunkSize, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+#else
+    if (mprotect(chunk, kChunkSize, PROT_READ | PROT_WRITE) != 0)
+#endif
+    {
+        s_FreeChunks[s_FreeChunkCount++] = (uint32_t)index;
+        return nullptr;
     }
+    return chunk;
+}
+
+static void ReleaseChunk(char* chunk)
+{
+    // give the memory back to the OS, but keep the address space reserved
+#ifdef _MSC_VER
+    VirtualFree(chunk, kChunkSize, MEM_DECOMMIT);
+#else
+    mmap(chunk, kChunkSize, PROT_NONE, MAP_FIXED | MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+#endif
+    std::lock_guard<std::mutex> lock(s_ChunkMutex);
+    s_FreeChunks[s_FreeChunkCount++] = (uint32_t)((chunk - s_ArenaRange.load(std::memory_order_relaxed)) / kChunkSize);
+}
+
+static ArenaStats* FindArenaStats(const char* name)
+{
+    for (int i = 0; i != s_ArenaStatsCount; ++i)
+        if (strcmp(s_ArenaStats[i].name, name) == 0)
+            return &s_ArenaStats[i];
+    if (s_ArenaStatsCount == kMaxArenaStats)
+        return nullptr;
+    ArenaStats* stats = &s_ArenaStats[s_ArenaStatsCount++];
+    stats->name = name;
+    stats->peak = 0;
+    stats->count = 0;
+    return stats;
+}
 
-    void* res = (char*)s_CurBlock + s_CurBlockUsed;
-    s_CurBlockUsed += count;
+
+Arena::Arena(const char* name)
+: m_Name(name)
+{
+    std::lock_guard<std::mutex> lock(s_ChunkMutex);
+    if (ArenaStats* stats = FindArenaStats(name))
+        ++stats->count;
+}
+
+Arena::~Arena()
+{
+    Reset();
+}
+
+void* Arena::Allocate(size_t size)
+{
+    size = std::max((size + kAlignment - 1) & ~(kAlignment - 1), kAlignment);
+    if (size > kMaxArenaAllocation)
+        return HeapAllocate(size);
+    if (m_Chunk == nullptr || m_ChunkUsed + size > kChunkSize)
+    {
+        char* chunk = AcquireChunk();
+        if (chunk == nullptr)
+            return HeapAllocate(size);
+        *(char**)chunk = m_Chunk;
+        m_Chunk = chunk;
+        m_ChunkUsed = kAlignment;
+    }
+    void* res = m_Chunk + m_ChunkUsed;
+    ++m_Allocations;
+    m_ChunkUsed += size;
+    m_Used += size;
+    m_Peak = std::max(m_Peak, m_Used);
     return res;
 }
 
-void operator delete(void * p) throw()
+void Arena::Reset()
+{
+    while (m_Chunk != nullptr)
+    {
+        char* prev = *(char**)m_Chunk;
+        ReleaseChunk(m_Chunk);
+        m_Chunk = prev;
+    }
+    m_ChunkUsed = 0;
+    m_Used = 0;
+    s_ArenaAllocations.fetch_add(m_Allocations, std::memory_order_relaxed);
+    m_Allocations = 0;
+
+    std::lock_guard<std::mutex> lock(s_ChunkMutex);
+    if (ArenaStats* stats = FindArenaStats(m_Name))
+        stats->peak = std::max(stats->peak, m_Peak);
+}
+
+ArenaScope::ArenaScope(Arena* arena)
+: m_Prev(s_CurrentArena)
+{
+    s_CurrentArena = arena;
+}
+
+ArenaScope::~ArenaScope()
+{
+    s_CurrentArena = m_Prev;
+}
+
+size_t memstats::GetAllocationCount()
+{
+    return s_HeapAllocations.load(std::memory_order_relaxed) + s_ArenaAllocations.load(std::memory_order_relaxed);
+}
+
+void memstats::Print()
+{
+    printf("%sMemory usage peaks:%s\n", col::kYellow, col::kReset);
+    printf("  %-12s %s%8.1f%s MB\n", "heap", col::kBold, s_HeapPeak.load() / (1024.0 * 1024.0), col::kReset);
+    std::lock_guard<std::mutex> lock(s_ChunkMutex);
+    for (int i = 0; i != s_ArenaStatsCount; ++i)
+    {
+        const ArenaStats& stats = s_ArenaStats[i];
+        printf("  %-12s %s%8.1f%s MB (%i arenas)\n", stats.name, col::kBold, stats.peak / (1024.0 * 1024.0), col::kReset, stats.count);
+    }
+}
+
+
+void* operator new(size_t count)
+{
+    Arena* arena = s_CurrentArena;
+    if (arena != nullptr)
+        return arena->Allocate(count);
+    return HeapAllocate(count);
+}
+
+void operator delete(void* p) throw()
 {
+    if (p == nullptr || IsArenaMemory(p))
+        return;
+    HeapFree(p);
 }
@@ -0,0 +1,55 @@
+// Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
+// SPDX-License-Identifier: Unlicense
+#pragma once
+#include <stddef.h>
+
+// Memory arena: allocations are made by bumping a pointer inside big chunks
+// of memory, individual deletes do nothing, and all the memory is given back
+// at once with Reset() (or when the arena is destroyed).
+//
+// While an ArenaScope is active, all operator new allocations of the current
+// thread come from its arena, so a whole phase of work (parsing one file, one
+// analysis pass, one report) can allocate temporary stuff quickly and release it
+// in bulk. Anything that should outlive the arena has to be allocated outside
+// of the scope. An arena is only ever used by one thread at a time.
+class Arena
+{
+public:
+    explicit Arena(const char* name);
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* Allocate(size_t size);
+    void Reset();
+
+    const char* GetName() const { return m_Name; }
+
+private:
+    const char* m_Name;
+    char* m_Chunk = nullptr; // current chunk; chunks are linked through their first bytes
+    size_t m_ChunkUsed = 0;
+    size_t m_Used = 0;
+    size_t m_Peak = 0;
+    size_t m_Allocations = 0;
+};
+
+class ArenaScope
+{
+public:
+    explicit ArenaScope(Arena* arena);
+    ~ArenaScope();
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+private:
+    Arena* m_Prev;
+};
+
+namespace memstats
+{
+    // Peak memory usage per arena name (largest one of all arenas with the same
+    // name), and of regular heap allocations.
+    void Print();
+    // Total count of allocations made so far; arena ones are counted when the arena is reset.
+    size_t GetAllocationCount();
+}
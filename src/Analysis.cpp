@@ -6,13 +6,26 @@ struct IUnknown; // workaround for old Win SDK header failures when using /permi
 #endif
 
 #include "Analysis.h"
+#include "Allocator.h"
 #include "Colors.h"
+#include "MappedFile.h"
+#include "Parallel.h"
+#include "Timing.h"
 #include "Utils.h"
 #include "external/llvm-Demangle/include/Demangle.h"
 #include "external/inih/cpp/INIReader.h"
 #include "external/cute_files.h"
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <errno.h>
+#include <functional>
+#include <limits.h>
+#include <memory>
+#include <mutex>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -25,217 +38,715 @@ struct Config
     int functionCount = 30;
     int headerCount = 10;
     int headerChainCount = 5;
+    int directoryCount = 0;
+    int criticalPathCount = 10;
+    int idleGapCount = 5;
 
     int minFileTime = 10;
 
     int maxName = 70;
 
     bool onlyRootHeaders = true;
+
+    int directoryDepth = 2;
 };
 
-struct pair_hash
+// printf into a string
+static void Print(std::string& out, const char* format, ...)
 {
-    template <class T1, class T2>
-    std::size_t operator () (const std::pair<T1,T2>& p) const
+    char buffer[1024];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if (len < (int)sizeof(buffer))
     {
-        auto h1 = std::hash<T1>{}(p.first);
-        auto h2 = std::hash<T2>{}(p.second);
-        return h1 + 0x9e3779b9 + (h2<<6) + (h2>>2);
+        out.append(buffer, len);
+        return;
     }
-};
+    size_t pos = out.size();
+    out.resize(pos + len + 1);
+    va_start(args, format);
+    vsnprintf(&out[pos], len + 1, format, args);
+    va_end(args);
+    out.resize(pos + len);
+}
 
+static void AppendJsonString(std::string& out, const std::string& str)
+{
+    out += '"';
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20)
+            Print(out, "\\u%04x", c);
+        else
+            out += c;
+    }
+    out += '"';
+}
 
-struct Analysis
+static void AppendCsvString(std::string& out, const std::string& str)
 {
-    Analysis(const BuildEvents& events_, BuildNames& buildNames_, FILE* out_)
-    : events(events_)
-    , buildNames(buildNames_)
-    , buildNamesDone(buildNames_.size(), 0)
-    , out(out_)
+    out += '"';
+    for (char c : str)
     {
-        buildNamesDone.resize(buildNames.size());
-        functions.reserve(256);
-        instantiations.reserve(256);
-        parseFiles.reserve(64);
-        codegenFiles.reserve(64);
-        headerMap.reserve(256);
+        if (c == '"')
+            out += '"';
+        out += c;
     }
+    out += '"';
+}
 
-    const BuildEvents& events;
-    BuildNames& buildNames;
-    IndexedVector<char, DetailIndex> buildNamesDone;
+// One item of a report section in json or csv output; names are never truncated there.
+struct ReportRecord
+{
+    std::string name;
+    std::string file; // not written when empty
+    int64_t us = 0;
+    int count = -1; // not written when negative
+    std::vector<std::string> includedVia;
+    std::vector<std::pair<const char*, int64_t>> parts; // named parts of the time, in microseconds
+};
 
-    FILE* out;
+// List of records of one report section. Json output is an object with a list for each
+// section; csv output is one table of all the records, with section name in the first column.
+// Text output does not use records.
+class ReportRecords
+{
+public:
+    ReportRecords(std::string& out, ReportFormat format, const char* section)
+    : m_Out(out), m_Format(format), m_Section(section)
+    {
+        if (m_Format == ReportFormat::kJson)
+        {
+            if (!m_Out.empty())
+                m_Out += ",\n";
+            Print(m_Out, "\"%s\": [", m_Section);
+        }
+    }
+    ~ReportRecords()
+    {
+        if (m_Format == ReportFormat::kJson)
+            m_Out += m_Count ? "\n]" : "]";
+    }
+    ReportRecords(const ReportRecords&) = delete;
+    ReportRecords& operator=(const ReportRecords&) = delete;
 
-    const std::string& GetBuildName(DetailIndex index)
+    void Add(const ReportRecord& r)
     {
-        auto& name = buildNames[index];
-        if (!buildNamesDone[index])
+        assert(m_Format != ReportFormat::kText);
+        if (m_Format == ReportFormat::kJson)
         {
-            name = utils::GetNicePath(name);
-            // don't report the clang trace .json file, instead get the object file at the same location if it's there
-            if (utils::EndsWith(name, ".json"))
+            m_Out += m_Count ? ",\n  {\"name\": " : "\n  {\"name\": ";
+            AppendJsonString(m_Out, r.name);
+            if (!r.file.empty())
             {
-                std::string candidate = name.substr(0, name.length()-4) + "o";
-                if (cf_file_exists(candidate.c_str()))
-                    name = candidate;
-                else
+                m_Out += ", \"file\": ";
+                AppendJsonString(m_Out, r.file);
+            }
+            Print(m_Out, ", \"us\": %lld", (long long)r.us);
+            if (r.count >= 0)
+                Print(m_Out, ", \"count\": %i", r.count);
+            if (!r.includedVia.empty())
+            {
+                m_Out += ", \"includedVia\": [";
+                for (size_t i = 0; i != r.includedVia.size(); ++i)
                 {
-                    candidate += "bj";
-                    if (cf_file_exists(candidate.c_str()))
-                        name = candidate;
+                    if (i != 0)
+                        m_Out += ", ";
+                    AppendJsonString(m_Out, r.includedVia[i]);
                 }
+                m_Out += "]";
+            }
+            if (!r.parts.empty())
+            {
+                m_Out += ", \"parts\": {";
+                for (size_t i = 0; i != r.parts.size(); ++i)
+                    Print(m_Out, "%s\"%s\": %lld", i != 0 ? ", " : "", r.parts[i].first, (long long)r.parts[i].second);
+                m_Out += "}";
             }
-            buildNamesDone[index] = 1;
+            m_Out += "}";
         }
-        return name;
+        else
+        {
+            Print(m_Out, "%s,", m_Section);
+            AppendCsvString(m_Out, r.name);
+            m_Out += ',';
+            AppendCsvString(m_Out, r.file);
+            Print(m_Out, ",%lld,", (long long)r.us);
+            if (r.count >= 0)
+                Print(m_Out, "%i", r.count);
+            m_Out += ',';
+            std::string chain;
+            for (size_t i = 0; i != r.includedVia.size(); ++i)
+            {
+                if (i != 0)
+                    chain += " > ";
+                chain += r.includedVia[i];
+            }
+            AppendCsvString(m_Out, chain);
+            m_Out += ',';
+            std::string parts;
+            for (size_t i = 0; i != r.parts.size(); ++i)
+                Print(parts, "%s%s=%lld", i != 0 ? ";" : "", r.parts[i].first, (long long)r.parts[i].second);
+            AppendCsvString(m_Out, parts);
+            m_Out += '\n';
+        }
+        ++m_Count;
     }
 
-    void ProcessEvent(EventIndex eventIndex);
-    int largestDetailIndex = 0;
-    void EndAnalysis();
-
-    void FindExpensiveHeaders();
-    void ReadConfig();
+    static const char* CsvHeader() { return "section,name,file,us,count,includedVia,parts\n"; }
 
-    DetailIndex FindPath(EventIndex eventIndex) const;
+private:
+    std::string& m_Out;
+    ReportFormat m_Format;
+    const char* m_Section;
+    int m_Count = 0;
+};
 
-    struct InstantiateEntry
+// First (at most) count items in the given order, sorted. Only count items are kept
+// around while going through the input, instead of sorting all of it.
+template<typename T, typename Iter, typename Before>
+static std::vector<T> TopK(Iter begin, Iter end, int count, Before before)
+{
+    std::vector<T> heap; // the item that goes last is on top
+    if (count <= 0)
+        return heap;
+    heap.reserve(count);
+    for (Iter it = begin; it != end; ++it)
     {
-        int count = 0;
-        int64_t us = 0;
-    };
-    struct FileEntry
+        if (heap.size() < (size_t)count)
+        {
+            heap.push_back(*it);
+            std::push_heap(heap.begin(), heap.end(), before);
+        }
+        else if (before(*it, heap.front()))
+        {
+            std::pop_heap(heap.begin(), heap.end(), before);
+            heap.back() = *it;
+            std::push_heap(heap.begin(), heap.end(), before);
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end(), before);
+    return heap;
+}
+
+// names are prepared (demangled, collapsed etc.) on several threads, in jobs of this many
+static const size_t kNamesPerJob = 256;
+
+struct pair_hash
+{
+    template <class T1, class T2>
+    std::size_t operator () (const std::pair<T1,T2>& p) const
     {
-        DetailIndex file;
-        int64_t us;
-    };
-    struct IncludeChain
+        auto h1 = std::hash<T1>{}(p.first);
+        auto h2 = std::hash<T2>{}(p.second);
+        return h1 + 0x9e3779b9 + (h2<<6) + (h2>>2);
+    }
+};
+
+
+struct InstantiateEntry
+{
+    int count = 0;
+    int64_t us = 0;
+};
+struct FileEntry
+{
+    DetailIndex file;
+    int64_t us;
+};
+// Chain of includes leading to a header is stored as the ParseFile event of the header;
+// the files are found by walking up the ParseFile parents, once the chain is kept among
+// the most expensive ones of the header (or has the same time as one of those), and
+// stored with it. Chains loaded from an analysis part file have no event, just the files.
+struct IncludeChain
+{
+    EventIndex event;
+    int64_t us = 0;
+    std::vector<DetailIndex> files;
+};
+struct IncludeEntry
+{
+    int64_t us = 0;
+    int count = 0;
+    bool root = false;
+    std::vector<IncludeChain> includePaths; // only the most expensive ones, as a heap
+};
+
+struct CompileEntry
+{
+    DetailIndex file;
+    int64_t ts;
+    int64_t dur;
+};
+
+typedef std::pair<DetailIndex, DetailIndex> IndexPair;
+
+// Report order: most expensive first, then by name index, so that the order does not
+// depend on hash table iteration order.
+static bool FileEntryBefore(const FileEntry& a, const FileEntry& b)
+{
+    if (a.us != b.us)
+        return a.us > b.us;
+    return a.file < b.file;
+}
+// of (name, InstantiateEntry) pairs
+struct InstantiationBefore
+{
+    template<typename T, typename U>
+    bool operator()(const T& a, const U& b) const
     {
-        std::vector<DetailIndex> files;
-        int64_t us = 0;
-    };
-    struct IncludeEntry
+        return std::tie(a.second.us, a.second.count, a.first) > std::tie(b.second.us, b.second.count, b.first);
+    }
+};
+// of ((name, objfile), time) pairs
+struct FunctionBefore
+{
+    template<typename T, typename U>
+    bool operator()(const T& a, const U& b) const
     {
-        int64_t us = 0;
-        int count = 0;
-        bool root = false;
-        std::vector<IncludeChain> includePaths;
-    };
+        if (a.second != b.second)
+            return a.second > b.second;
+        return a.first < b.first;
+    }
+};
 
-    std::unordered_map<DetailIndex, std::string> collapsedNames;
-    const std::string &GetCollapsedName(EventIndex idx);
-    void EmitCollapsedTemplates();
-    void EmitCollapsedTemplateOpt();
-    void EmitCollapsedInfo(
-        const std::unordered_map<std::string, InstantiateEntry> &collapsed,
-        const char *header_string);
+// Times of one compile unit. Template time is of outermost instantiations only, and
+// header time of headers directly included by the unit, so that nested ones don't
+// get counted twice; both are part of frontend time.
+struct UnitTotals
+{
+    int64_t frontendUs = 0;
+    int64_t backendUs = 0;
+    int64_t templateUs = 0;
+    int64_t headerUs = 0;
+
+    void Add(const UnitTotals& o)
+    {
+        frontendUs += o.frontendUs;
+        backendUs += o.backendUs;
+        templateUs += o.templateUs;
+        headerUs += o.headerUs;
+    }
+};
 
+// Data gathered from the events. Ranges of events are processed in parallel, each
+// into its own EventAggregates, and then these are added up in event order.
+struct EventAggregates
+{
     // key is (name,objfile), value is milliseconds
-    typedef std::pair<DetailIndex, DetailIndex> IndexPair;
     std::unordered_map<IndexPair, int64_t, pair_hash> functions;
-    std::unordered_map<EventIndex, InstantiateEntry> instantiations;
+    // key is template name
+    std::unordered_map<DetailIndex, InstantiateEntry> instantiations;
     std::vector<FileEntry> parseFiles;
     std::vector<FileEntry> codegenFiles;
     int64_t totalParseUs = 0;
     int64_t totalCodegenUs = 0;
     int totalParseCount = 0;
 
-    std::unordered_map<std::string, IncludeEntry> headerMap;
-    std::vector<std::pair<std::string, int64_t>> expensiveHeaders;
+    // key is the header name, see Analysis::GetHeaderIndex
+    std::unordered_map<DetailIndex, IncludeEntry> headerMap;
+
+    // key is the compile unit path (see BuildEvents::paths)
+    std::unordered_map<DetailIndex, UnitTotals> units;
+
+    // ExecuteCompiler events, in event order; their times are only comparable between
+    // files with absoluteTimes
+    std::vector<CompileEntry> compiles;
+    bool absoluteTimes = false;
+
+    // instantiations that were not inside another one with the same collapsed name; key is
+    // a template name with that collapsed name, found after all the events are processed
+    std::unordered_map<DetailIndex, InstantiateEntry> templateSets;
+
+    // events come in compile unit order, so most of the time it's the same unit as last time
+    DetailIndex lastUnitPath{ -1 };
+    UnitTotals* lastUnit = nullptr;
+    UnitTotals& Unit(DetailIndex path)
+    {
+        if (path != lastUnitPath || !lastUnit)
+        {
+            lastUnit = &units[path];
+            lastUnitPath = path;
+        }
+        return *lastUnit;
+    }
+};
+
+struct Analysis
+{
+    Analysis(const BuildEvents& events_, const BuildNames& buildNames_, FILE* out_, ReportFormat format_ = ReportFormat::kText)
+    : events(events_)
+    , buildNames(buildNames_)
+    , out(out_)
+    , format(format_)
+    {
+        for (auto& cache : nameCache)
+            cache.reset(new std::atomic<const std::string*>[buildNames_.size()]());
+    }
+
+    const BuildEvents& events;
+    const BuildNames& buildNames;
+
+    FILE* out;
+    ReportFormat format;
+
+    // Event processing and report sections run on several threads, and each job uses
+    // its own arena for temporary data.
+    //
+    // Names derived from build names, cached for each DetailIndex so each one is only
+    // computed once. Caches are filled lazily from any thread; the names are computed
+    // outside of the lock, and stored in their own arena.
+    enum NameKind
+    {
+        kNiceName, // path relative to current dir, object file instead of trace file
+        kDemangledName,
+        kCollapsedName, // template arguments replaced with $
+        kCollapsedDemangledName,
+        kNameKindCount
+    };
+    std::unique_ptr<std::atomic<const std::string*>[]> nameCache[kNameKindCount];
+    std::mutex namesMutex;
+    Arena namesArena{"names"};
+
+    const std::string& GetCachedName(NameKind kind, DetailIndex index);
+    std::string ComputeName(NameKind kind, DetailIndex index);
+    const std::string& GetBuildName(DetailIndex index) { return GetCachedName(kNiceName, index); }
+    const std::string& GetDemangledName(DetailIndex index) { return GetCachedName(kDemangledName, index); }
+    // computes names of the given kind on several threads (duplicates in the list are fine)
+    void PrepareNames(NameKind kind, std::vector<DetailIndex>& names);
+
+    void ProcessEvents();
+    void ProcessEventRange(EventIndex begin, EventIndex end, EventAggregates& res);
+    void ProcessParseFile(EventIndex eventIndex, EventAggregates& res);
+    void AddAggregates(const EventAggregates& other);
+
+    // Names that are headers, with the same nice path, share one index; this returns
+    // that index, or -1 if the name is not a header. Found for all ParseFile names by
+    // FindHeaders before processing the events.
+    std::vector<int> headerIndices;
+    void FindHeaders();
+    DetailIndex GetHeaderIndex(DetailIndex index) const { return DetailIndex(headerIndices[index.idx]); }
+
+    void AddIncludeChain(IncludeEntry& e, IncludeChain chain);
+    // chains with the same time are ordered by their files, which have to be stored in them
+    bool IncludeChainBefore(const IncludeChain& a, const IncludeChain& b);
+    void GetIncludeChainFiles(const IncludeChain& chain, std::vector<DetailIndex>& files);
+    void StoreIncludeChainFiles(IncludeChain& chain);
+    void EndAnalysis();
+
+    void EmitTimeSummary(std::string& out);
+    void EmitParseFiles(std::string& out);
+    void EmitCodegenFiles(std::string& out);
+    void EmitTemplates(std::string& out);
+    void EmitFunctions(std::string& out);
+    void EmitExpensiveHeaders(std::string& out);
+    void EmitDirectories(std::string& out);
+    void EmitSchedule(std::string& out);
+    void EmitExpensiveHeaderRecords(std::string& out, const std::vector<std::pair<DetailIndex, int64_t>>& expensiveHeaders);
+
+    std::vector<std::pair<DetailIndex, int64_t>> FindExpensiveHeaders(const std::unordered_map<DetailIndex, IncludeEntry>& headerMap, int count);
+    void ReadConfig();
+
+    // Collapsed names of instantiation events as small integers, for each DetailIndex
+    // (-1 for names not used by instantiations); equal collapsed names get the same id.
+    std::vector<int> collapsedIds;
+    std::vector<DetailIndex> collapsedIdNames; // a name with each id
+    void FindCollapsedIds(size_t namesPerJob);
+    void FindTemplateSets();
+
+    void GetCollapsedTemplates(std::unordered_map<std::string, InstantiateEntry>& collapsed);
+    void GetCollapsedFunctions(std::unordered_map<std::string, InstantiateEntry>& collapsed);
+    void EmitCollapsedTemplates(std::string& out);
+    void EmitCollapsedTemplateOpt(std::string& out);
+    void EmitCollapsedInfo(
+        std::string& out,
+        const std::unordered_map<std::string, InstantiateEntry> &collapsed,
+        const char *header_string,
+        const char *section);
+
+    EventAggregates agg;
 
     Config config;
+
+    void WritePart(std::string& data);
 };
 
-DetailIndex Analysis::FindPath(EventIndex eventIndex) const
+void Analysis::AddAggregates(const EventAggregates& other)
 {
-    while(eventIndex >= EventIndex())
+    for (const auto& fn : other.functions)
+        agg.functions[fn.first] += fn.second;
+    for (const auto& inst : other.instantiations)
+    {
+        auto& e = agg.instantiations[inst.first];
+        e.count += inst.second.count;
+        e.us += inst.second.us;
+    }
+    agg.parseFiles.insert(agg.parseFiles.end(), other.parseFiles.begin(), other.parseFiles.end());
+    agg.codegenFiles.insert(agg.codegenFiles.end(), other.codegenFiles.begin(), other.codegenFiles.end());
+    agg.totalParseUs += other.totalParseUs;
+    agg.totalCodegenUs += other.totalCodegenUs;
+    agg.totalParseCount += other.totalParseCount;
+    for (const auto& kvp : other.headerMap)
+    {
+        IncludeEntry& e = agg.headerMap[kvp.first];
+        e.us += kvp.second.us;
+        e.count += kvp.second.count;
+        e.root |= kvp.second.root;
+        for (const IncludeChain& chain : kvp.second.includePaths)
+            AddIncludeChain(e, chain);
+    }
+    for (const auto& kvp : other.units)
+        agg.units[kvp.first].Add(kvp.second);
+    agg.compiles.insert(agg.compiles.end(), other.compiles.begin(), other.compiles.end());
+    for (const auto& kvp : other.templateSets)
     {
-        const BuildEvent& ev = events[eventIndex];
-        if (ev.type == BuildEventType::kCompiler || ev.type == BuildEventType::kFrontend || ev.type == BuildEventType::kBackend || ev.type == BuildEventType::kOptModule)
-            if (ev.detailIndex != DetailIndex())
-                return ev.detailIndex;
-        eventIndex = ev.parent;
+        auto& e = agg.templateSets[kvp.first];
+        e.count += kvp.second.count;
+        e.us += kvp.second.us;
     }
-    return DetailIndex();
 }
 
-void Analysis::ProcessEvent(EventIndex eventIndex)
+// events of one type within [begin,end) range of event indices
+static std::pair<const EventIndex*, const EventIndex*> EventsOfTypeInRange(const BuildEvents& events, BuildEventType type, EventIndex begin, EventIndex end)
+{
+    const std::vector<EventIndex>& list = events.OfType(type);
+    const EventIndex* first = std::lower_bound(list.data(), list.data() + list.size(), begin);
+    const EventIndex* last = std::lower_bound(first, list.data() + list.size(), end);
+    return std::make_pair(first, last);
+}
+
+void Analysis::ProcessEvents()
 {
-    const BuildEvent& event = events[eventIndex];
-    largestDetailIndex = (std::max)(largestDetailIndex, event.detailIndex.idx);
+    FindHeaders();
+
+    // split events into ranges that are processed in parallel; results are
+    // added up in range order so that they don't depend on the thread count
+    const int kMinEventsPerRange = 64 * 1024;
+    const int eventCount = (int)events.size();
+    const int rangeCount = std::max(1, std::min(parallel::GetThreadCount() * 4, eventCount / kMinEventsPerRange));
+
+    struct RangeData
+    {
+        Arena arena{"aggregate"};
+        EventAggregates data;
+    };
+    std::vector<std::unique_ptr<RangeData>> ranges;
+    for (int i = 0; i != rangeCount; ++i)
+        ranges.emplace_back(new RangeData());
 
-    if (event.type == BuildEventType::kOptFunction)
+    parallel::ForEach(rangeCount, [&](size_t index)
     {
-        auto funKey = std::make_pair(event.detailIndex, FindPath(eventIndex));
-        functions[funKey] += event.dur;
+        RangeData& range = *ranges[index];
+        ArenaScope scope(&range.arena);
+        EventIndex begin(int(int64_t(eventCount) * index / rangeCount));
+        EventIndex end(int(int64_t(eventCount) * (index + 1) / rangeCount));
+        ProcessEventRange(begin, end, range.data);
+    });
+
+    for (const auto& range : ranges)
+        AddAggregates(range->data);
+    agg.absoluteTimes = events.absoluteTimes;
+
+    {
+        timing::Scope timingScope(timing::kPrepareNames);
+        FindCollapsedIds(kNamesPerJob);
     }
+    FindTemplateSets();
+}
+
+void Analysis::ProcessEventRange(EventIndex begin, EventIndex end, EventAggregates& res)
+{
+    auto range = EventsOfTypeInRange(events, BuildEventType::kCompiler, begin, end);
+    for (const EventIndex* it = range.first; it != range.second; ++it)
+        res.compiles.push_back(CompileEntry{ events.paths[*it], events.ts[*it], events.durs[*it] });
 
-    if (event.type == BuildEventType::kInstantiateClass || event.type == BuildEventType::kInstantiateFunction)
+    range = EventsOfTypeInRange(events, BuildEventType::kOptFunction, begin, end);
+    for (const EventIndex* it = range.first; it != range.second; ++it)
     {
-        auto& e = instantiations[eventIndex];
-        ++e.count;
-        e.us += event.dur;
+        EventIndex eventIndex = *it;
+        auto funKey = std::make_pair(events.details[eventIndex], events.paths[eventIndex]);
+        res.functions[funKey] += events.durs[eventIndex];
     }
 
-    if (event.type == BuildEventType::kFrontend)
+    for (BuildEventType type : { BuildEventType::kInstantiateClass, BuildEventType::kInstantiateFunction })
     {
-        totalParseUs += event.dur;
-        ++totalParseCount;
-        if (event.dur >= config.minFileTime * 1000)
+        range = EventsOfTypeInRange(events, type, begin, end);
+        for (const EventIndex* it = range.first; it != range.second; ++it)
         {
-            FileEntry fe;
-            fe.file = FindPath(eventIndex);
-            fe.us = event.dur;
-            parseFiles.emplace_back(fe);
+            auto& e = res.instantiations[events.details[*it]];
+            ++e.count;
+            e.us += events.durs[*it];
+
+            EventIndex parent = events.parents[*it];
+            if (parent.idx < 0 || (events.types[parent] != BuildEventType::kInstantiateClass && events.types[parent] != BuildEventType::kInstantiateFunction))
+                res.Unit(events.paths[*it]).templateUs += events.durs[*it];
         }
     }
-    if (event.type == BuildEventType::kBackend)
+
+    range = EventsOfTypeInRange(events, BuildEventType::kFrontend, begin, end);
+    for (const EventIndex* it = range.first; it != range.second; ++it)
     {
-        totalCodegenUs += event.dur;
-        if (event.dur >= config.minFileTime * 1000)
+        int64_t dur = events.durs[*it];
+        res.totalParseUs += dur;
+        ++res.totalParseCount;
+        res.Unit(events.paths[*it]).frontendUs += dur;
+        if (dur >= config.minFileTime * 1000)
         {
             FileEntry fe;
-            fe.file = FindPath(eventIndex);
-            fe.us = event.dur;
-            codegenFiles.emplace_back(fe);
+            fe.file = events.paths[*it];
+            fe.us = dur;
+            res.parseFiles.emplace_back(fe);
         }
     }
-    if (event.type == BuildEventType::kParseFile)
+
+    range = EventsOfTypeInRange(events, BuildEventType::kBackend, begin, end);
+    for (const EventIndex* it = range.first; it != range.second; ++it)
     {
-        std::string path = GetBuildName(event.detailIndex);
-        if (utils::IsHeader(path))
+        int64_t dur = events.durs[*it];
+        res.totalCodegenUs += dur;
+        res.Unit(events.paths[*it]).backendUs += dur;
+        if (dur >= config.minFileTime * 1000)
         {
-            IncludeEntry& e = headerMap[path];
-            e.us += event.dur;
-            ++e.count;
+            FileEntry fe;
+            fe.file = events.paths[*it];
+            fe.us = dur;
+            res.codegenFiles.emplace_back(fe);
+        }
+    }
 
-            // record chain of ParseFile entries leading up to this one
-            IncludeChain chain;
-            chain.us = event.dur;
-            EventIndex parseIndex = event.parent;
-            bool hasHeaderBefore = false;
-            bool hasNonHeaderBefore = false;
-            while(parseIndex.idx >= 0)
-            {
-                const BuildEvent& ev2 = events[parseIndex];
-                if (ev2.type != BuildEventType::kParseFile)
-                    break;
-                std::string ev2path = GetBuildName(ev2.detailIndex);
-                chain.files.push_back(ev2.detailIndex);
-                bool isHeader = utils::IsHeader(ev2path);
-                hasHeaderBefore |= isHeader;
-                hasNonHeaderBefore |= !isHeader;
-                parseIndex = ev2.parent;
-            }
+    range = EventsOfTypeInRange(events, BuildEventType::kParseFile, begin, end);
+    for (const EventIndex* it = range.first; it != range.second; ++it)
+        ProcessParseFile(*it, res);
+}
 
-            // only add top-level source path if there was no non-header file down below
-            // the include chain (the top-level might be lump/unity file)
-            if (!hasNonHeaderBefore)
-                chain.files.push_back(FindPath(eventIndex));
-            e.root |= !hasHeaderBefore;
-            e.includePaths.push_back(chain);
-        }
+void Analysis::ProcessParseFile(EventIndex eventIndex, EventAggregates& res)
+{
+    DetailIndex header = GetHeaderIndex(events.details[eventIndex]);
+    if (header.idx < 0)
+        return;
+
+    const int64_t dur = events.durs[eventIndex];
+    IncludeEntry& e = res.headerMap[header];
+    e.us += dur;
+    ++e.count;
+
+    bool hasHeaderBefore = false;
+    for (EventIndex p = events.parents[eventIndex]; p.idx >= 0 && events.types[p] == BuildEventType::kParseFile; p = events.parents[p])
+        hasHeaderBefore |= GetHeaderIndex(events.details[p]).idx >= 0;
+    e.root |= !hasHeaderBefore;
+    if (!hasHeaderBefore)
+        res.Unit(events.paths[eventIndex]).headerUs += dur;
+
+    IncludeChain chain;
+    chain.event = eventIndex;
+    chain.us = dur;
+    AddIncludeChain(e, chain);
+}
+
+void Analysis::GetIncludeChainFiles(const IncludeChain& chain, std::vector<DetailIndex>& files)
+{
+    if (chain.event.idx < 0 || !chain.files.empty())
+    {
+        files = chain.files;
+        return;
+    }
+
+    // chain of ParseFile entries leading up to the header
+    files.clear();
+    bool hasNonHeaderBefore = false;
+    for (EventIndex p = events.parents[chain.event]; p.idx >= 0 && events.types[p] == BuildEventType::kParseFile; p = events.parents[p])
+    {
+        DetailIndex detail = events.details[p];
+        files.push_back(detail);
+        hasNonHeaderBefore |= GetHeaderIndex(detail).idx < 0;
+    }
+
+    // only add top-level source path if there was no non-header file down below
+    // the include chain (the top-level might be lump/unity file)
+    if (!hasNonHeaderBefore)
+        files.push_back(events.paths[chain.event]);
+}
+
+void Analysis::StoreIncludeChainFiles(IncludeChain& chain)
+{
+    if (chain.files.empty())
+        GetIncludeChainFiles(chain, chain.files);
+}
+
+bool Analysis::IncludeChainBefore(const IncludeChain& a, const IncludeChain& b)
+{
+    if (a.us != b.us)
+        return a.us > b.us;
+    assert(!a.files.empty() && !b.files.empty());
+    return a.files < b.files;
+}
+
+void Analysis::AddIncludeChain(IncludeEntry& e, IncludeChain chain)
+{
+    // keep only as many chains as get reported (plus one, to know whether there are more);
+    // the heap has the cheapest of these on top
+    const size_t maxChains = (size_t)std::max(1, config.headerChainCount + 1);
+    auto cmp = [&](const IncludeChain& a, const IncludeChain& b) { return IncludeChainBefore(a, b); };
+    std::vector<IncludeChain>& chains = e.includePaths;
+    if (chains.size() < maxChains)
+    {
+        StoreIncludeChainFiles(chain);
+        chains.push_back(std::move(chain));
+        std::push_heap(chains.begin(), chains.end(), cmp);
+    }
+    else if (chain.us >= chains.front().us)
+    {
+        // cheaper chains (most of them) are dropped without finding their files
+        StoreIncludeChainFiles(chain);
+        if (!IncludeChainBefore(chain, chains.front()))
+            return;
+        std::pop_heap(chains.begin(), chains.end(), cmp);
+        chains.back() = std::move(chain);
+        std::push_heap(chains.begin(), chains.end(), cmp);
+    }
+}
+
+// Nice paths of ParseFile names (and whether they are headers) are found up front on
+// several threads, so that event processing only has to look up the header index.
+void Analysis::FindHeaders()
+{
+    timing::Scope timingScope(timing::kPrepareNames);
+    headerIndices.assign(buildNames.size(), -1);
+    std::vector<DetailIndex> fileNames;
+    {
+        std::vector<uint8_t> used(buildNames.size());
+        for (EventIndex ev : events.OfType(BuildEventType::kParseFile))
+            used[events.details[ev].idx] = 1;
+        for (size_t i = 0, n = used.size(); i != n; ++i)
+            if (used[i])
+                fileNames.push_back(DetailIndex(int(i)));
+    }
+    std::vector<uint8_t> isHeader(fileNames.size());
+    parallel::ForEach((fileNames.size() + kNamesPerJob - 1) / kNamesPerJob, [&](size_t job)
+    {
+        Arena jobArena("paths");
+        ArenaScope scope(&jobArena);
+        for (size_t i = job * kNamesPerJob, n = std::min(fileNames.size(), i + kNamesPerJob); i != n; ++i)
+            isHeader[i] = utils::IsHeader(GetBuildName(fileNames[i]));
+    });
+
+    // the first of the names with the same nice path is the index of all of them
+    std::unordered_map<std::string, int> pathToIndex;
+    for (size_t i = 0, n = fileNames.size(); i != n; ++i)
+    {
+        if (!isHeader[i])
+            continue;
+        auto res = pathToIndex.insert(std::make_pair(GetBuildName(fileNames[i]), fileNames[i].idx));
+        headerIndices[fileNames[i].idx] = res.first->second;
     }
 }
 
@@ -289,30 +800,95 @@ std::string collapseName(const std::string &elt)
     return retval;
 }
 
-const std::string &Analysis::GetCollapsedName(EventIndex idx)
+const std::string& Analysis::GetCachedName(NameKind kind, DetailIndex index)
+{
+    std::atomic<const std::string*>& slot = nameCache[kind][index.idx];
+    const std::string* name = slot.load(std::memory_order_acquire);
+    if (name)
+        return *name;
+
+    std::string value = ComputeName(kind, index);
+    std::lock_guard<std::mutex> lock(namesMutex);
+    name = slot.load(std::memory_order_relaxed);
+    if (!name)
+    {
+        ArenaScope scope(&namesArena); // cached names are kept for the whole analysis
+        name = new std::string(value);
+        slot.store(name, std::memory_order_release);
+    }
+    return *name;
+}
+
+std::string Analysis::ComputeName(NameKind kind, DetailIndex index)
+{
+    switch (kind)
+    {
+    case kNiceName:
+    {
+        std::string name = utils::GetNicePath(buildNames.GetName(index), buildNames.GetLength(index));
+        // don't report the clang trace .json file, instead get the object file at the same location if it's there
+        if (utils::EndsWith(name, ".json"))
+        {
+            std::string candidate = name.substr(0, name.length()-4) + "o";
+            if (cf_file_exists(candidate.c_str()))
+                name = candidate;
+            else
+            {
+                candidate += "bj";
+                if (cf_file_exists(candidate.c_str()))
+                    name = candidate;
+            }
+        }
+        return name;
+    }
+    case kDemangledName:
+        return llvm::demangle(GetBuildName(index));
+    case kCollapsedName:
+        return collapseName(GetBuildName(index));
+    case kCollapsedDemangledName:
+        return collapseName(GetDemangledName(index));
+    default:
+        assert(false);
+        return std::string();
+    }
+}
+
+void Analysis::PrepareNames(NameKind kind, std::vector<DetailIndex>& names)
 {
-    DetailIndex detail = events[idx].detailIndex;
-    std::string &name = collapsedNames[detail];
-    if(name.empty())
-        name = collapseName(GetBuildName(detail));
-    return name;
+    timing::Scope timingScope(timing::kPrepareNames);
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    parallel::ForEach((names.size() + kNamesPerJob - 1) / kNamesPerJob, [&](size_t job)
+    {
+        Arena jobArena("demangle");
+        ArenaScope scope(&jobArena);
+        for (size_t i = job * kNamesPerJob, n = std::min(names.size(), i + kNamesPerJob); i != n; ++i)
+            GetCachedName(kind, names[i]);
+    });
 }
 
 void Analysis::EmitCollapsedInfo(
+    std::string& out,
     const std::unordered_map<std::string, InstantiateEntry> &collapsed,
-    const char *header_string)
+    const char *header_string,
+    const char *section)
 {
-    std::vector<std::pair<std::string, InstantiateEntry>> sorted_collapsed;
-    sorted_collapsed.resize(std::min<size_t>(config.templateCount, collapsed.size()));
-    auto cmp = [](const auto &lhs, const auto &rhs) {
-        return std::tie(lhs.second.us, lhs.second.count, lhs.first) > std::tie(rhs.second.us, rhs.second.count, rhs.first);
-    };
-    std::partial_sort_copy(
-        collapsed.begin(), collapsed.end(),
-        sorted_collapsed.begin(), sorted_collapsed.end(),
-        cmp);
+    std::vector<std::pair<std::string, InstantiateEntry>> sorted_collapsed = TopK<std::pair<std::string, InstantiateEntry>>(collapsed.begin(), collapsed.end(), config.templateCount, InstantiationBefore());
 
-    fprintf(out, "%s%s**** %s%s:\n", col::kBold, col::kMagenta, header_string, col::kReset);
+    if (format != ReportFormat::kText)
+    {
+        ReportRecords records(out, format, section);
+        for (const auto &elt : sorted_collapsed)
+        {
+            ReportRecord r;
+            r.name = elt.first;
+            r.us = elt.second.us;
+            r.count = elt.second.count;
+            records.Add(r);
+        }
+        return;
+    }
+    Print(out, "%s%s**** %s%s:\n", col::kBold, col::kMagenta, header_string, col::kReset);
     for (const auto &elt : sorted_collapsed)
     {
         std::string dname = elt.first;
@@ -320,240 +896,710 @@ void Analysis::EmitCollapsedInfo(
             dname = dname.substr(0, config.maxName - 2) + "...";
         int ms = int(elt.second.us / 1000);
         int avg = int(ms / elt.second.count);
-        fprintf(out, "%s%6i%s ms: %s (%i times, avg %i ms)\n", col::kBold, ms, col::kReset, dname.c_str(), elt.second.count, avg);
+        Print(out, "%s%6i%s ms: %s (%i times, avg %i ms)\n", col::kBold, ms, col::kReset, dname.c_str(), elt.second.count, avg);
     }
-    fprintf(out, "\n");
+    Print(out, "\n");
 }
-void Analysis::EmitCollapsedTemplates()
+void Analysis::FindCollapsedIds(size_t namesPerJob)
 {
-    std::unordered_map<std::string, InstantiateEntry> collapsed;
-    for (const auto& inst : instantiations)
+    std::vector<DetailIndex> names;
+    for (BuildEventType instType : { BuildEventType::kInstantiateClass, BuildEventType::kInstantiateFunction })
+        for (EventIndex inst : events.OfType(instType))
+            names.push_back(events.details[inst]);
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    parallel::ForEach((names.size() + namesPerJob - 1) / namesPerJob, [&](size_t job)
     {
-        const std::string &name = GetCollapsedName(inst.first);
-        auto &stats = collapsed[name];
+        Arena jobArena("demangle");
+        ArenaScope scope(&jobArena);
+        for (size_t i = job * namesPerJob, n = std::min(names.size(), i + namesPerJob); i != n; ++i)
+            GetCachedName(kCollapsedName, names[i]);
+    });
 
-        bool recursive = false;
-        EventIndex p = events[inst.first].parent;
-        while (p != EventIndex(-1))
-        {
-            auto &event = events[p];
-            if (event.type == BuildEventType::kInstantiateClass || event.type == BuildEventType::kInstantiateFunction)
-            {
-                const std::string &ancestor_name = GetCollapsedName(p);
-                if (ancestor_name == name)
-                {
-                    recursive = true;
-                    break;
-                }
-            }
-            p = event.parent;
-        }
-        if (!recursive)
+    collapsedIds.assign(buildNames.size(), -1);
+    collapsedIdNames.clear();
+    Arena idsArena("analysis");
+    ArenaScope scope(&idsArena);
+    std::unordered_map<std::string, int> nameToId;
+    for (DetailIndex name : names)
+    {
+        auto res = nameToId.insert(std::make_pair(GetCachedName(kCollapsedName, name), (int)collapsedIdNames.size()));
+        if (res.second)
         {
-            stats.us += inst.second.us;
-            stats.count += inst.second.count;
+            ArenaScope heapScope(nullptr);
+            collapsedIdNames.push_back(name);
         }
+        collapsedIds[name.idx] = res.first->second;
     }
-    EmitCollapsedInfo(collapsed, "Template sets that took longest to instantiate");
 }
 
-void Analysis::EmitCollapsedTemplateOpt()
+void Analysis::FindTemplateSets()
 {
-    std::unordered_map<std::string, InstantiateEntry> collapsed;
-    for (const auto& fn : functions)
+    // Walk down the event tree once, counting how many instantiations of each collapsed
+    // name are open at the current event. An instantiation inside another one with the
+    // same collapsed name is recursive, and its time is already counted by the outer one.
+    std::vector<InstantiateEntry> stats(collapsedIdNames.size());
+    std::vector<int> openCount(collapsedIdNames.size(), 0);
+    struct Visit
     {
-        auto &stats = collapsed[collapseName(llvm::demangle(GetBuildName(fn.first.first)))];
-        ++stats.count;
-        stats.us += fn.second;
-    }
-    EmitCollapsedInfo(collapsed, "Function sets that took longest to compile / optimize");
-}
-
-void Analysis::EndAnalysis()
-{
-    if (totalParseUs || totalCodegenUs)
+        EventIndex ev;
+        const EventIndex* nextChild;
+        int id;
+    };
+    std::vector<Visit> stack;
+    auto enter = [&](EventIndex ev)
     {
-        fprintf(out, "%s%s**** Time summary%s:\n", col::kBold, col::kMagenta, col::kReset);
-        fprintf(out, "Compilation (%i times):\n", totalParseCount);
-        fprintf(out, "  Parsing (frontend):        %s%7.1f%s s\n", col::kBold, totalParseUs / 1000000.0, col::kReset);
-        fprintf(out, "  Codegen & opts (backend):  %s%7.1f%s s\n", col::kBold, totalCodegenUs / 1000000.0, col::kReset);
-        fprintf(out, "\n");
+        BuildEventType type = events.types[ev];
+        int id = -1;
+        if (type == BuildEventType::kInstantiateClass || type == BuildEventType::kInstantiateFunction)
+        {
+            id = collapsedIds[events.details[ev].idx];
+            if (openCount[id]++ == 0)
+            {
+                stats[id].us += events.durs[ev];
+                stats[id].count += 1;
+            }
+        }
+        stack.push_back(Visit{ ev, events.GetChildren(ev).begin(), id });
+    };
+    for (int i = 0, n = (int)events.size(); i != n; ++i)
+    {
+        if (events.parents[EventIndex(i)].idx != -1)
+            continue;
+        enter(EventIndex(i));
+        while (!stack.empty())
+        {
+            Visit& top = stack.back();
+            if (top.nextChild != events.GetChildren(top.ev).end())
+            {
+                enter(*top.nextChild++);
+                continue;
+            }
+            if (top.id != -1)
+                --openCount[top.id];
+            stack.pop_back();
+        }
+    }
+
+    for (size_t id = 0; id != stats.size(); ++id)
+        agg.templateSets[collapsedIdNames[id]] = stats[id];
+}
+
+void Analysis::GetCollapsedTemplates(std::unordered_map<std::string, InstantiateEntry>& collapsed)
+{
+    // merged analysis parts can have several names of one collapsed name
+    for (const auto& kvp : agg.templateSets)
+    {
+        auto& e = collapsed[GetCachedName(kCollapsedName, kvp.first)];
+        e.count += kvp.second.count;
+        e.us += kvp.second.us;
     }
+}
 
-    if (!parseFiles.empty())
+void Analysis::GetCollapsedFunctions(std::unordered_map<std::string, InstantiateEntry>& collapsed)
+{
+    for (const auto& fn : agg.functions)
     {
-        std::vector<int> indices;
-        indices.resize(parseFiles.size());
-        for (size_t i = 0; i < indices.size(); ++i)
-            indices[i] = int(i);
-        std::sort(indices.begin(), indices.end(), [&](int indexA, int indexB) {
-            const auto& a = parseFiles[indexA];
-            const auto& b = parseFiles[indexB];
-            if (a.us != b.us)
-                return a.us > b.us;
-            return a.file < b.file;
-            });
-        fprintf(out, "%s%s**** Files that took longest to parse (compiler frontend)%s:\n", col::kBold, col::kMagenta, col::kReset);
-        for (size_t i = 0, n = std::min<size_t>(config.fileParseCount, indices.size()); i != n; ++i)
-        {
-            const auto& e = parseFiles[indices[i]];
-            fprintf(out, "%s%6i%s ms: %s\n", col::kBold, int(e.us/1000), col::kReset, GetBuildName(e.file).c_str());
-        }
-        fprintf(out, "\n");
-    }
-    if (!codegenFiles.empty())
-    {
-        std::vector<int> indices;
-        indices.resize(codegenFiles.size());
-        for (size_t i = 0; i < indices.size(); ++i)
-            indices[i] = int(i);
-        std::sort(indices.begin(), indices.end(), [&](int indexA, int indexB) {
-            const auto& a = codegenFiles[indexA];
-            const auto& b = codegenFiles[indexB];
-            if (a.us != b.us)
-                return a.us > b.us;
-            return a.file < b.file;
-            });
-        fprintf(out, "%s%s**** Files that took longest to codegen (compiler backend)%s:\n", col::kBold, col::kMagenta, col::kReset);
-        for (size_t i = 0, n = std::min<size_t>(config.fileCodegenCount, indices.size()); i != n; ++i)
+        auto &stats = collapsed[GetCachedName(kCollapsedDemangledName, fn.first.first)];
+        ++stats.count;
+        stats.us += fn.second;
+    }
+}
+
+void Analysis::EmitCollapsedTemplates(std::string& out)
+{
+    std::unordered_map<std::string, InstantiateEntry> collapsed;
+    GetCollapsedTemplates(collapsed);
+    EmitCollapsedInfo(out, collapsed, "Template sets that took longest to instantiate", "templateSets");
+}
+
+void Analysis::EmitCollapsedTemplateOpt(std::string& out)
+{
+    std::unordered_map<std::string, InstantiateEntry> collapsed;
+    GetCollapsedFunctions(collapsed);
+    EmitCollapsedInfo(out, collapsed, "Function sets that took longest to compile / optimize", "functionSets");
+}
+
+void Analysis::EndAnalysis()
+{
+    typedef void (Analysis::*SectionFunc)(std::string& out);
+    static const SectionFunc kSections[] =
+    {
+        &Analysis::EmitTimeSummary,
+        &Analysis::EmitParseFiles,
+        &Analysis::EmitCodegenFiles,
+        &Analysis::EmitTemplates,
+        &Analysis::EmitFunctions,
+        &Analysis::EmitExpensiveHeaders,
+        &Analysis::EmitDirectories,
+        &Analysis::EmitSchedule,
+    };
+    const size_t kSectionCount = sizeof(kSections) / sizeof(kSections[0]);
+
+    // all function names are demangled & collapsed for the collapsed functions report,
+    // and all instantiation names collapsed for the template sets one; do that up front
+    // in parallel instead of inside those sections
+    std::vector<DetailIndex> functionNames;
+    functionNames.reserve(agg.functions.size());
+    for (const auto& fn : agg.functions)
+        functionNames.push_back(fn.first.first);
+    PrepareNames(kCollapsedDemangledName, functionNames);
+
+    // sections are produced in parallel into their own text buffers, each with
+    // a scratch arena for temporary data, and then written out in order
+    struct Section
+    {
+        Arena arena{"report"};
+        std::string text;
+    };
+    std::vector<std::unique_ptr<Section>> sections;
+    for (size_t i = 0; i != kSectionCount; ++i)
+        sections.emplace_back(new Section());
+    static_assert(kSectionCount == timing::kReportSchedule - timing::kReportTimeSummary + 1, "report sections should match timing phases");
+    timing::Scope timingScope(timing::kReports);
+    parallel::ForEach(kSectionCount, [&](size_t index)
+    {
+        timing::Scope sectionTimingScope(timing::Phase(timing::kReportTimeSummary + index));
+        Section& section = *sections[index];
+        ArenaScope scope(&section.arena);
+        (this->*kSections[index])(section.text);
+    });
+    // json output is one object with a list for each section; csv output one table
+    bool first = true;
+    if (format == ReportFormat::kJson)
+        fputs("{\n", out);
+    else if (format == ReportFormat::kCsv)
+        fputs(ReportRecords::CsvHeader(), out);
+    for (const auto& section : sections)
+    {
+        if (section->text.empty())
+            continue;
+        if (format == ReportFormat::kJson && !first)
+            fputs(",\n", out);
+        fwrite(section->text.data(), 1, section->text.size(), out);
+        first = false;
+    }
+    if (format == ReportFormat::kJson)
+        fputs("\n}\n", out);
+}
+
+void Analysis::EmitTimeSummary(std::string& out)
+{
+    if (agg.totalParseUs || agg.totalCodegenUs)
+    {
+        if (format != ReportFormat::kText)
         {
-            const auto& e = codegenFiles[indices[i]];
-            fprintf(out, "%s%6i%s ms: %s\n", col::kBold, int(e.us/1000), col::kReset, GetBuildName(e.file).c_str());
+            ReportRecords records(out, format, "timeSummary");
+            ReportRecord r;
+            r.name = "parse";
+            r.us = agg.totalParseUs;
+            r.count = agg.totalParseCount;
+            records.Add(r);
+            r.name = "codegen";
+            r.us = agg.totalCodegenUs;
+            records.Add(r);
+            return;
         }
-        fprintf(out, "\n");
+        Print(out, "%s%s**** Time summary%s:\n", col::kBold, col::kMagenta, col::kReset);
+        Print(out, "Compilation (%i times):\n", agg.totalParseCount);
+        Print(out, "  Parsing (frontend):        %s%7.1f%s s\n", col::kBold, agg.totalParseUs / 1000000.0, col::kReset);
+        Print(out, "  Codegen & opts (backend):  %s%7.1f%s s\n", col::kBold, agg.totalCodegenUs / 1000000.0, col::kReset);
+        Print(out, "\n");
     }
+}
 
-    if (!instantiations.empty())
+void Analysis::EmitParseFiles(std::string& out)
+{
+    if (!agg.parseFiles.empty())
     {
-        std::vector<std::pair<DetailIndex, InstantiateEntry>> instArray;
-        instArray.resize(largestDetailIndex+1);
-        for (const auto& inst : instantiations) //collapse the events
+        std::vector<FileEntry> top = TopK<FileEntry>(agg.parseFiles.begin(), agg.parseFiles.end(), config.fileParseCount, FileEntryBefore);
+        if (format != ReportFormat::kText)
+        {
+            ReportRecords records(out, format, "parseFiles");
+            for (const auto& e : top)
+            {
+                ReportRecord r;
+                r.name = GetBuildName(e.file);
+                r.us = e.us;
+                records.Add(r);
+            }
+            return;
+        }
+        Print(out, "%s%s**** Files that took longest to parse (compiler frontend)%s:\n", col::kBold, col::kMagenta, col::kReset);
+        for (const auto& e : top)
         {
-            DetailIndex d = events[inst.first].detailIndex;
-            instArray[d.idx].first = d;
-            instArray[d.idx].second.us += inst.second.us;
-            instArray[d.idx].second.count += inst.second.count;
+            Print(out, "%s%6i%s ms: %s\n", col::kBold, int(e.us/1000), col::kReset, GetBuildName(e.file).c_str());
         }
-        size_t n = std::min<size_t>(config.templateCount, instArray.size());
-        auto cmp = [&](const auto&a, const auto &b) {
-            return
-                std::tie(a.second.us, a.second.count, a.first) >
-                std::tie(b.second.us, b.second.count, b.first);
-        };
-        std::partial_sort(instArray.begin(), instArray.begin()+n, instArray.end(), cmp);
-        fprintf(out, "%s%s**** Templates that took longest to instantiate%s:\n", col::kBold, col::kMagenta, col::kReset);
-        for (size_t i = 0; i != n; ++i)
+        Print(out, "\n");
+    }
+}
+
+void Analysis::EmitCodegenFiles(std::string& out)
+{
+    if (!agg.codegenFiles.empty())
+    {
+        std::vector<FileEntry> top = TopK<FileEntry>(agg.codegenFiles.begin(), agg.codegenFiles.end(), config.fileCodegenCount, FileEntryBefore);
+        if (format != ReportFormat::kText)
+        {
+            ReportRecords records(out, format, "codegenFiles");
+            for (const auto& e : top)
+            {
+                ReportRecord r;
+                r.name = GetBuildName(e.file);
+                r.us = e.us;
+                records.Add(r);
+            }
+            return;
+        }
+        Print(out, "%s%s**** Files that took longest to codegen (compiler backend)%s:\n", col::kBold, col::kMagenta, col::kReset);
+        for (const auto& e : top)
+        {
+            Print(out, "%s%6i%s ms: %s\n", col::kBold, int(e.us/1000), col::kReset, GetBuildName(e.file).c_str());
+        }
+        Print(out, "\n");
+    }
+}
+
+void Analysis::EmitTemplates(std::string& out)
+{
+    if (!agg.instantiations.empty())
+    {
+        std::vector<std::pair<DetailIndex, InstantiateEntry>> top = TopK<std::pair<DetailIndex, InstantiateEntry>>(agg.instantiations.begin(), agg.instantiations.end(), config.templateCount, InstantiationBefore());
+        if (format != ReportFormat::kText)
+        {
+            {
+                ReportRecords records(out, format, "templates");
+                for (const auto& e : top)
+                {
+                    ReportRecord r;
+                    r.name = GetDemangledName(e.first);
+                    r.us = e.second.us;
+                    r.count = e.second.count;
+                    records.Add(r);
+                }
+            }
+            EmitCollapsedTemplates(out);
+            return;
+        }
+        Print(out, "%s%s**** Templates that took longest to instantiate%s:\n", col::kBold, col::kMagenta, col::kReset);
+        for (const auto& e : top)
         {
-            const auto& e = instArray[i];
-            std::string dname = llvm::demangle(GetBuildName(e.first));
+            std::string dname = GetDemangledName(e.first);
             if (dname.size() > config.maxName)
                 dname = dname.substr(0, config.maxName-2) + "...";
             int ms = int(e.second.us / 1000);
             int avg = int(ms / e.second.count);
-            fprintf(out, "%s%6i%s ms: %s (%i times, avg %i ms)\n", col::kBold, ms, col::kReset, dname.c_str(), e.second.count, avg);
+            Print(out, "%s%6i%s ms: %s (%i times, avg %i ms)\n", col::kBold, ms, col::kReset, dname.c_str(), e.second.count, avg);
         }
-        fprintf(out, "\n");
+        Print(out, "\n");
 
-        EmitCollapsedTemplates();
+        EmitCollapsedTemplates(out);
     }
+}
 
-    if (!functions.empty())
+void Analysis::EmitFunctions(std::string& out)
+{
+    if (!agg.functions.empty())
     {
-        std::vector<std::pair<IndexPair, int64_t>> functionsArray;
-        std::vector<int> indices;
-        functionsArray.reserve(functions.size());
-        indices.reserve(functions.size());
-        for (const auto& fn : functions)
+        std::vector<std::pair<IndexPair, int64_t>> top = TopK<std::pair<IndexPair, int64_t>>(agg.functions.begin(), agg.functions.end(), config.functionCount, FunctionBefore());
+        if (format != ReportFormat::kText)
         {
-            functionsArray.emplace_back(fn);
-            indices.emplace_back((int)indices.size());
+            {
+                ReportRecords records(out, format, "functions");
+                for (const auto& e : top)
+                {
+                    ReportRecord r;
+                    r.name = GetDemangledName(e.first.first);
+                    r.file = GetBuildName(e.first.second);
+                    r.us = e.second;
+                    records.Add(r);
+                }
+            }
+            EmitCollapsedTemplateOpt(out);
+            return;
         }
-
-        std::sort(indices.begin(), indices.end(), [&](int indexA, int indexB) {
-            const auto& a = functionsArray[indexA];
-            const auto& b = functionsArray[indexB];
-            if (a.second != b.second)
-                return a.second > b.second;
-            return a.first < b.first;
-            });
-        fprintf(out, "%s%s**** Functions that took longest to compile%s:\n", col::kBold, col::kMagenta, col::kReset);
-        for (size_t i = 0, n = std::min<size_t>(config.functionCount, indices.size()); i != n; ++i)
+        Print(out, "%s%s**** Functions that took longest to compile%s:\n", col::kBold, col::kMagenta, col::kReset);
+        for (const auto& e : top)
         {
-            const auto& e = functionsArray[indices[i]];
-            std::string dname = llvm::demangle(GetBuildName(e.first.first));
+            std::string dname = GetDemangledName(e.first.first);
             if (dname.size() > config.maxName)
                 dname = dname.substr(0, config.maxName-2) + "...";
             int ms = int(e.second / 1000);
-            fprintf(out, "%s%6i%s ms: %s (%s)\n", col::kBold, ms, col::kReset, dname.c_str(), GetBuildName(e.first.second).c_str());
+            Print(out, "%s%6i%s ms: %s (%s)\n", col::kBold, ms, col::kReset, dname.c_str(), GetBuildName(e.first.second).c_str());
         }
-        fprintf(out, "\n");
-        EmitCollapsedTemplateOpt();
+        Print(out, "\n");
+        EmitCollapsedTemplateOpt(out);
     }
+}
 
-    FindExpensiveHeaders();
+void Analysis::EmitExpensiveHeaders(std::string& out)
+{
+    std::vector<std::pair<DetailIndex, int64_t>> expensiveHeaders = FindExpensiveHeaders(agg.headerMap, config.headerCount);
 
+    if (!expensiveHeaders.empty() && format != ReportFormat::kText)
+    {
+        EmitExpensiveHeaderRecords(out, expensiveHeaders);
+        return;
+    }
     if (!expensiveHeaders.empty())
     {
-        fprintf(out, "%s%s*** Expensive headers%s:\n", col::kBold, col::kMagenta, col::kReset);
+        Print(out, "%s%s*** Expensive headers%s:\n", col::kBold, col::kMagenta, col::kReset);
+        std::vector<DetailIndex> files;
         for (const auto& e : expensiveHeaders)
         {
-            const auto& es = headerMap[e.first];
+            const auto& es = agg.headerMap.find(e.first)->second;
             int ms = int(e.second / 1000);
             int avg = ms / es.count;
-            fprintf(out, "%s%i%s ms: %s%s%s (included %i times, avg %i ms), included via:\n", col::kBold, ms, col::kReset, col::kBold, e.first.c_str(), col::kReset, es.count, avg);
+            Print(out, "%s%i%s ms: %s%s%s (included %i times, avg %i ms), included via:\n", col::kBold, ms, col::kReset, col::kBold, GetBuildName(e.first).c_str(), col::kReset, es.count, avg);
             int pathCount = 0;
 
             auto sortedIncludeChains = es.includePaths;
-            std::sort(sortedIncludeChains.begin(), sortedIncludeChains.end(), [](const auto& a, const auto& b)
+            std::sort(sortedIncludeChains.begin(), sortedIncludeChains.end(), [&](const auto& a, const auto& b)
             {
-                if (a.us != b.us)
-                    return a.us > b.us;
-                return a.files < b.files;
+                return IncludeChainBefore(a, b);
             });
 
             for (const auto& chain : sortedIncludeChains)
             {
-                fprintf(out, "  ");
-                for (auto it = chain.files.rbegin(), itEnd = chain.files.rend(); it != itEnd; ++it)
+                Print(out, "  ");
+                GetIncludeChainFiles(chain, files);
+                for (auto it = files.rbegin(), itEnd = files.rend(); it != itEnd; ++it)
                 {
-                    fprintf(out, "%s ", utils::GetFilename(GetBuildName(*it)).c_str());
+                    Print(out, "%s ", utils::GetFilename(GetBuildName(*it)).c_str());
                 }
-                fprintf(out, " (%i ms)\n", int(chain.us/1000));
+                Print(out, " (%i ms)\n", int(chain.us/1000));
                 ++pathCount;
                 if (pathCount > config.headerChainCount)
                     break;
             }
             if (pathCount > config.headerChainCount)
             {
-                fprintf(out, "  ...\n");
+                Print(out, "  ...\n");
+            }
+            Print(out, "\n");
+        }
+    }
+}
+
+// headers, and (as a separate list) the same include chains of each that text output has
+void Analysis::EmitExpensiveHeaderRecords(std::string& out, const std::vector<std::pair<DetailIndex, int64_t>>& expensiveHeaders)
+{
+    {
+        ReportRecords records(out, format, "headers");
+        for (const auto& e : expensiveHeaders)
+        {
+            ReportRecord r;
+            r.name = GetBuildName(e.first);
+            r.us = e.second;
+            r.count = agg.headerMap.find(e.first)->second.count;
+            records.Add(r);
+        }
+    }
+    ReportRecords records(out, format, "headerChains");
+    std::vector<DetailIndex> files;
+    for (const auto& e : expensiveHeaders)
+    {
+        auto sortedIncludeChains = agg.headerMap.find(e.first)->second.includePaths;
+        std::sort(sortedIncludeChains.begin(), sortedIncludeChains.end(), [&](const auto& a, const auto& b)
+        {
+            return IncludeChainBefore(a, b);
+        });
+        int pathCount = 0;
+        for (const auto& chain : sortedIncludeChains)
+        {
+            ReportRecord r;
+            r.name = GetBuildName(e.first);
+            r.us = chain.us;
+            GetIncludeChainFiles(chain, files);
+            for (auto it = files.rbegin(), itEnd = files.rend(); it != itEnd; ++it)
+                r.includedVia.push_back(GetBuildName(*it));
+            records.Add(r);
+            if (++pathCount > config.headerChainCount)
+                break;
+        }
+    }
+}
+
+// Compile unit totals added up into a tree of directories, up to config.directoryDepth
+// levels; each level is sorted by frontend + backend time.
+void Analysis::EmitDirectories(std::string& out)
+{
+    if (config.directoryCount <= 0 || config.directoryDepth <= 0 || agg.units.empty())
+        return;
+
+    struct Directory
+    {
+        std::string path; // with trailing slash
+        UnitTotals totals;
+        int files = 0;
+        int depth = 0;
+        std::vector<int> children;
+        int64_t Us() const { return totals.frontendUs + totals.backendUs; }
+    };
+    std::vector<Directory> dirs;
+    std::unordered_map<std::string, int> pathToDir;
+    std::vector<int> roots;
+    for (const auto& unit : agg.units)
+    {
+        const std::string& path = GetBuildName(unit.first);
+        int parent = -1;
+        size_t slash = 0; // leading slash of absolute paths is part of the first directory
+        for (int depth = 1; depth <= config.directoryDepth; ++depth)
+        {
+            slash = path.find('/', slash + 1);
+            if (slash == std::string::npos)
+            {
+                if (depth != 1)
+                    break;
+                slash = 0; // file in current directory
+            }
+            std::string dirPath = slash == 0 ? std::string("./") : path.substr(0, slash + 1);
+            auto res = pathToDir.insert(std::make_pair(dirPath, (int)dirs.size()));
+            if (res.second)
+            {
+                dirs.emplace_back();
+                dirs.back().path = dirPath;
+                dirs.back().depth = depth;
+                (parent < 0 ? roots : dirs[parent].children).push_back(res.first->second);
+            }
+            Directory& dir = dirs[res.first->second];
+            dir.totals.Add(unit.second);
+            ++dir.files;
+            parent = res.first->second;
+            if (slash == 0)
+                break;
+        }
+    }
+
+    auto before = [&](int a, int b)
+    {
+        if (dirs[a].Us() != dirs[b].Us())
+            return dirs[a].Us() > dirs[b].Us();
+        return dirs[a].path < dirs[b].path;
+    };
+    // directories in report order: top ones of each level, each followed by its children
+    std::vector<int> ordered;
+    std::function<void(const std::vector<int>&)> addLevel = [&](const std::vector<int>& level)
+    {
+        for (int index : TopK<int>(level.begin(), level.end(), config.directoryCount, before))
+        {
+            ordered.push_back(index);
+            addLevel(dirs[index].children);
+        }
+    };
+    addLevel(roots);
+
+    if (format != ReportFormat::kText)
+    {
+        ReportRecords records(out, format, "directories");
+        for (int index : ordered)
+        {
+            const Directory& dir = dirs[index];
+            ReportRecord r;
+            r.name = dir.path;
+            r.us = dir.Us();
+            r.count = dir.files;
+            r.parts = { { "frontend", dir.totals.frontendUs }, { "backend", dir.totals.backendUs }, { "templates", dir.totals.templateUs }, { "headers", dir.totals.headerUs } };
+            records.Add(r);
+        }
+        return;
+    }
+    Print(out, "%s%s**** Directories that took longest to compile%s:\n", col::kBold, col::kMagenta, col::kReset);
+    for (int index : ordered)
+    {
+        const Directory& dir = dirs[index];
+        Print(out, "%s%6i%s ms: %*s%s (frontend %i ms, backend %i ms, templates %i ms, headers %i ms; %i files)\n",
+            col::kBold, int(dir.Us() / 1000), col::kReset, (dir.depth - 1) * 2, "", dir.path.c_str(),
+            int(dir.totals.frontendUs / 1000), int(dir.totals.backendUs / 1000), int(dir.totals.templateUs / 1000), int(dir.totals.headerUs / 1000), dir.files);
+    }
+    Print(out, "\n");
+}
+
+// When each compile (ExecuteCompiler event) ran, if the capture has them on one timeline:
+// how many compiles were running over time, gaps when none were, and the chain of compiles
+// that ends the build, going back from the last one to finish to the last one finished
+// before it started, and so on. Those are what held up the end of the build; if they
+// depend on each other (e.g. generated headers), that is the critical path of it.
+void Analysis::EmitSchedule(std::string& out)
+{
+    const std::vector<CompileEntry>& compiles = agg.compiles;
+    if (!agg.absoluteTimes || compiles.empty())
+        return;
+
+    int64_t buildStart = INT64_MAX, buildEnd = INT64_MIN, busyUs = 0;
+    std::vector<std::pair<int64_t, int>> points; // (time, +1 at start, -1 at end); ends sort first
+    points.reserve(compiles.size() * 2);
+    for (const CompileEntry& c : compiles)
+    {
+        int64_t start = c.ts, end = c.ts + c.dur;
+        buildStart = std::min(buildStart, start);
+        buildEnd = std::max(buildEnd, end);
+        busyUs += end - start;
+        points.emplace_back(start, 1);
+        points.emplace_back(end, -1);
+    }
+    std::sort(points.begin(), points.end());
+    const int64_t wallUs = std::max<int64_t>(buildEnd - buildStart, 1);
+
+    // sweep over the starts & ends, adding up compile time into fixed length steps
+    const int kSteps = 10;
+    const int64_t stepUs = (wallUs + kSteps - 1) / kSteps;
+    int64_t stepBusyUs[kSteps] = {};
+    std::vector<std::pair<int64_t, int64_t>> gaps; // (start, length)
+    int running = 0, maxRunning = 0;
+    int64_t prev = buildStart;
+    for (const auto& p : points)
+    {
+        if (running == 0 && p.first > prev)
+            gaps.emplace_back(prev - buildStart, p.first - prev);
+        for (int64_t t = prev; running != 0 && t < p.first; )
+        {
+            int step = int((t - buildStart) / stepUs);
+            int64_t stepEnd = std::min(buildStart + (step + 1) * stepUs, p.first);
+            stepBusyUs[step] += (stepEnd - t) * running;
+            t = stepEnd;
+        }
+        running += p.second;
+        maxRunning = std::max(maxRunning, running);
+        prev = p.first;
+    }
+    gaps = TopK<std::pair<int64_t, int64_t>>(gaps.begin(), gaps.end(), config.idleGapCount, [](const auto& a, const auto& b)
+    {
+        if (a.second != b.second)
+            return a.second > b.second;
+        return a.first < b.first;
+    });
+
+    std::vector<int> byEnd(compiles.size());
+    for (size_t i = 0; i != byEnd.size(); ++i)
+        byEnd[i] = (int)i;
+    auto endOf = [&](int i) { return compiles[i].ts + compiles[i].dur; };
+    std::sort(byEnd.begin(), byEnd.end(), [&](int a, int b)
+    {
+        if (endOf(a) != endOf(b))
+            return endOf(a) < endOf(b);
+        return a < b;
+    });
+    std::vector<int> path;
+    if (config.criticalPathCount > 0)
+        path.push_back(byEnd.back());
+    while ((int)path.size() < config.criticalPathCount)
+    {
+        int64_t start = compiles[path.back()].ts;
+        auto it = std::upper_bound(byEnd.begin(), byEnd.end(), start, [&](int64_t t, int i) { return t < endOf(i); });
+        if (it == byEnd.begin() || *(it - 1) == path.back())
+            break;
+        path.push_back(*(it - 1));
+    }
+    std::reverse(path.begin(), path.end());
+
+    if (format != ReportFormat::kText)
+    {
+        {
+            ReportRecords records(out, format, "schedule");
+            ReportRecord r;
+            r.name = "wallClock";
+            r.us = wallUs;
+            r.count = (int)compiles.size();
+            r.parts = { { "start", buildStart }, { "end", buildEnd } };
+            records.Add(r);
+            r.name = "busy";
+            r.us = busyUs;
+            r.count = maxRunning;
+            r.parts.clear();
+            records.Add(r);
+        }
+        {
+            ReportRecords records(out, format, "parallelism");
+            for (int step = 0; step != kSteps && step * stepUs < wallUs; ++step)
+            {
+                ReportRecord r;
+                r.us = stepBusyUs[step];
+                r.parts = { { "start", step * stepUs }, { "end", std::min((step + 1) * stepUs, wallUs) } };
+                records.Add(r);
+            }
+        }
+        {
+            ReportRecords records(out, format, "idleGaps");
+            for (const auto& gap : gaps)
+            {
+                ReportRecord r;
+                r.us = gap.second;
+                r.parts = { { "start", gap.first } };
+                records.Add(r);
             }
-            fprintf(out, "\n");
         }
+        ReportRecords records(out, format, "criticalPath");
+        for (int i : path)
+        {
+            ReportRecord r;
+            r.name = GetBuildName(compiles[i].file);
+            r.us = compiles[i].dur;
+            r.parts = { { "start", compiles[i].ts - buildStart }, { "end", endOf(i) - buildStart } };
+            records.Add(r);
+        }
+        return;
+    }
+    Print(out, "%s%s**** Build schedule%s:\n", col::kBold, col::kMagenta, col::kReset);
+    Print(out, "%i compiles in %s%.1f%s s of wall clock time, on average %s%.1f%s at once, at most %i\n",
+        (int)compiles.size(), col::kBold, wallUs / 1000000.0, col::kReset, col::kBold, double(busyUs) / wallUs, col::kReset, maxRunning);
+    Print(out, "Compiles running at once over time:\n");
+    for (int step = 0; step != kSteps && step * stepUs < wallUs; ++step)
+    {
+        int64_t len = std::min((step + 1) * stepUs, wallUs) - step * stepUs;
+        double parallelism = double(stepBusyUs[step]) / len;
+        int bar = maxRunning ? int(parallelism * 40 / maxRunning + 0.5) : 0;
+        Print(out, "%7.1f s: %s%5.1f%s%s%s\n", step * stepUs / 1000000.0, col::kBold, parallelism, col::kReset, bar ? " " : "", std::string(bar, '#').c_str());
+    }
+    if (!gaps.empty())
+    {
+        Print(out, "Gaps with no compiles running:\n");
+        for (const auto& gap : gaps)
+            Print(out, "%s%6i%s ms: at %.1f s\n", col::kBold, int(gap.second / 1000), col::kReset, gap.first / 1000000.0);
+    }
+    if (!path.empty())
+    {
+        Print(out, "Compiles at the end of the build, each started after the previous one was done:\n");
+        for (int i : path)
+            Print(out, "%s%6i%s ms: %.1f - %.1f s: %s\n", col::kBold, int(compiles[i].dur / 1000), col::kReset,
+                (compiles[i].ts - buildStart) / 1000000.0, (endOf(i) - buildStart) / 1000000.0, GetBuildName(compiles[i].file).c_str());
     }
+    Print(out, "\n");
 }
 
-void Analysis::FindExpensiveHeaders()
+std::vector<std::pair<DetailIndex, int64_t>> Analysis::FindExpensiveHeaders(const std::unordered_map<DetailIndex, IncludeEntry>& headerMap, int count)
 {
-    expensiveHeaders.reserve(headerMap.size());
+    std::vector<std::pair<DetailIndex, int64_t>> headers;
+    headers.reserve(headerMap.size());
     for (const auto& kvp : headerMap)
     {
         if (config.onlyRootHeaders && !kvp.second.root)
             continue;
-        expensiveHeaders.push_back(std::make_pair(kvp.first, kvp.second.us));
+        headers.push_back(std::make_pair(kvp.first, kvp.second.us));
     }
-    std::sort(expensiveHeaders.begin(), expensiveHeaders.end(), [&](const auto& a, const auto& b)
+    return TopK<std::pair<DetailIndex, int64_t>>(headers.begin(), headers.end(), count, [&](const auto& a, const auto& b)
     {
         if (a.second != b.second)
             return a.second > b.second;
-        return a.first < b.first;
+        return GetBuildName(a.first) < GetBuildName(b.first);
     });
-    if (expensiveHeaders.size() > config.headerCount)
-        expensiveHeaders.resize(config.headerCount);
+}
+
+static std::string s_ConfigFile = "ClangBuildAnalyzer.ini";
+
+void SetConfigFile(const std::string& path)
+{
+    s_ConfigFile = path;
+}
+
+const std::string& GetConfigFile()
+{
+    return s_ConfigFile;
 }
 
 void Analysis::ReadConfig()
 {
-    INIReader ini("ClangBuildAnalyzer.ini");
+    INIReader ini(s_ConfigFile);
 
     config.fileParseCount   = (int)ini.GetInteger("counts", "fileParse",    config.fileParseCount);
     config.fileCodegenCount = (int)ini.GetInteger("counts", "fileCodegen",  config.fileCodegenCount);
@@ -561,19 +1607,1172 @@ void Analysis::ReadConfig()
     config.templateCount    = (int)ini.GetInteger("counts", "template",     config.templateCount);
     config.headerCount      = (int)ini.GetInteger("counts", "header",       config.headerCount);
     config.headerChainCount = (int)ini.GetInteger("counts", "headerChain",  config.headerChainCount);
+    config.directoryCount   = (int)ini.GetInteger("counts", "directory",    config.directoryCount);
+    config.criticalPathCount= (int)ini.GetInteger("counts", "criticalPath", config.criticalPathCount);
+    config.idleGapCount     = (int)ini.GetInteger("counts", "idleGap",      config.idleGapCount);
 
     config.minFileTime      = (int)ini.GetInteger("minTimes", "file",       config.minFileTime);
 
     config.maxName          = (int)ini.GetInteger("misc", "maxNameLength",  config.maxName);
     config.onlyRootHeaders  =      ini.GetBoolean("misc", "onlyRootHeaders",config.onlyRootHeaders);
+    config.directoryDepth   = (int)ini.GetInteger("misc", "directoryDepth", config.directoryDepth);
 }
 
 
-void DoAnalysis(const BuildEvents& events, BuildNames& names, FILE* out)
+void DoAnalysis(const BuildEvents& events, const BuildNames& names, FILE* out, ReportFormat format)
 {
-    Analysis a(events, names, out);
+    // all the analysis data is released in one go when done
+    Arena arena("analysis");
+    ArenaScope scope(&arena);
+    timing::Count(timing::kEventsAnalyzed, events.size());
+    timing::Count(timing::kNamesAnalyzed, names.size());
+    Analysis a(events, names, out, format);
     a.ReadConfig();
-    for (int i = 0, n = (int)events.size(); i != n; ++i)
-        a.ProcessEvent(EventIndex(i));
+    {
+        timing::Scope timingScope(timing::kAggregate);
+        a.ProcessEvents();
+    }
     a.EndAnalysis();
 }
+
+// Analysis part file layout (all little endian): PartHeader, then names as in BuildNames
+// (uint64_t offsets[nameCount+1], char data[nameDataSize]), then the aggregates; each
+// table is a uint64_t item count followed by the items, see Analysis::WritePart.
+static const char kPartMagic[8] = {'C','B','A','P','A','R','T','S'};
+static const uint32_t kPartVersion = 1;
+static const uint32_t kPartFlagAbsoluteTimes = 1; // EventAggregates::absoluteTimes
+
+struct PartHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t eventCount;
+    // settings that change what gets aggregated
+    int32_t minFileTime;
+    int32_t headerChainCount;
+    uint64_t nameCount;
+    uint64_t nameDataSize;
+};
+
+template<typename T>
+static void PutValue(std::string& data, const T& value)
+{
+    data.append((const char*)&value, sizeof(value));
+}
+
+void Analysis::WritePart(std::string& data)
+{
+    PartHeader header;
+    memcpy(header.magic, kPartMagic, sizeof(header.magic));
+    header.version = kPartVersion;
+    header.flags = agg.absoluteTimes ? kPartFlagAbsoluteTimes : 0;
+    header.eventCount = events.size();
+    header.minFileTime = config.minFileTime;
+    header.headerChainCount = config.headerChainCount;
+    header.nameCount = buildNames.size();
+    header.nameDataSize = buildNames.GetData().size();
+    PutValue(data, header);
+    data.append((const char*)buildNames.GetOffsets().data(), buildNames.GetOffsets().size() * sizeof(uint64_t));
+    data.append(buildNames.GetData().data(), buildNames.GetData().size());
+
+    PutValue(data, agg.totalParseUs);
+    PutValue(data, agg.totalCodegenUs);
+    PutValue(data, agg.totalParseCount);
+    PutValue(data, uint64_t(agg.functions.size()));
+    for (const auto& fn : agg.functions)
+    {
+        PutValue(data, fn.first.first);
+        PutValue(data, fn.first.second);
+        PutValue(data, fn.second);
+    }
+    for (const auto* table : { &agg.instantiations, &agg.templateSets })
+    {
+        PutValue(data, uint64_t(table->size()));
+        for (const auto& kvp : *table)
+        {
+            PutValue(data, kvp.first);
+            PutValue(data, kvp.second.count);
+            PutValue(data, kvp.second.us);
+        }
+    }
+    for (const auto* files : { &agg.parseFiles, &agg.codegenFiles })
+    {
+        PutValue(data, uint64_t(files->size()));
+        for (const FileEntry& fe : *files)
+        {
+            PutValue(data, fe.file);
+            PutValue(data, fe.us);
+        }
+    }
+    PutValue(data, uint64_t(agg.headerMap.size()));
+    std::vector<DetailIndex> files;
+    for (const auto& kvp : agg.headerMap)
+    {
+        PutValue(data, kvp.first);
+        PutValue(data, kvp.second.us);
+        PutValue(data, kvp.second.count);
+        PutValue(data, uint8_t(kvp.second.root));
+        PutValue(data, uint64_t(kvp.second.includePaths.size()));
+        for (const IncludeChain& chain : kvp.second.includePaths)
+        {
+            PutValue(data, chain.us);
+            GetIncludeChainFiles(chain, files);
+            PutValue(data, uint64_t(files.size()));
+            data.append((const char*)files.data(), files.size() * sizeof(DetailIndex));
+        }
+    }
+    PutValue(data, uint64_t(agg.units.size()));
+    for (const auto& kvp : agg.units)
+    {
+        PutValue(data, kvp.first);
+        PutValue(data, kvp.second);
+    }
+    PutValue(data, uint64_t(agg.compiles.size()));
+    for (const CompileEntry& c : agg.compiles)
+    {
+        PutValue(data, c.file);
+        PutValue(data, c.ts);
+        PutValue(data, c.dur);
+    }
+}
+
+void MakeAnalysisPart(const BuildEvents& events, const BuildNames& names, std::string& outData)
+{
+    Arena arena("analysis");
+    ArenaScope scope(&arena);
+    timing::Count(timing::kEventsAnalyzed, events.size());
+    timing::Count(timing::kNamesAnalyzed, names.size());
+    Analysis a(events, names, nullptr);
+    a.ReadConfig();
+    {
+        timing::Scope timingScope(timing::kAggregate);
+        a.ProcessEvents();
+    }
+    std::string data;
+    a.WritePart(data);
+    ArenaScope heapScope(nullptr);
+    outData.assign(data);
+}
+
+bool SaveAnalysisPart(const BuildEvents& events, const BuildNames& names, const std::string& path)
+{
+    std::string data;
+    MakeAnalysisPart(events, names, data);
+
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    if (fclose(f) != 0)
+        ok = false;
+    return ok;
+}
+
+// Reads aggregates of a part file, with names turned into indices of the merged names.
+struct PartReader
+{
+    const char* cur;
+    const char* end;
+    const std::vector<DetailIndex>& nameRemap;
+    bool ok = true;
+
+    template<typename T>
+    T Get()
+    {
+        T value{};
+        if (size_t(end - cur) < sizeof(T))
+        {
+            ok = false;
+            return value;
+        }
+        memcpy(&value, cur, sizeof(T));
+        cur += sizeof(T);
+        return value;
+    }
+    DetailIndex Name()
+    {
+        int idx = Get<int32_t>();
+        if (idx < 0 || idx >= (int)nameRemap.size())
+        {
+            ok = false;
+            return DetailIndex();
+        }
+        return nameRemap[idx];
+    }
+    // item count of a table; not more than what could fit in the rest of the file
+    size_t Count()
+    {
+        uint64_t count = Get<uint64_t>();
+        if (count > uint64_t(end - cur))
+            ok = false;
+        return ok ? size_t(count) : 0;
+    }
+
+    void Read(EventAggregates& res)
+    {
+        res.totalParseUs = Get<int64_t>();
+        res.totalCodegenUs = Get<int64_t>();
+        res.totalParseCount = Get<int>();
+        for (size_t i = 0, n = Count(); i != n && ok; ++i)
+        {
+            IndexPair key;
+            key.first = Name();
+            key.second = Name();
+            res.functions[key] += Get<int64_t>();
+        }
+        for (auto* table : { &res.instantiations, &res.templateSets })
+        {
+            for (size_t i = 0, n = Count(); i != n && ok; ++i)
+            {
+                InstantiateEntry& e = (*table)[Name()];
+                e.count += Get<int>();
+                e.us += Get<int64_t>();
+            }
+        }
+        for (auto* files : { &res.parseFiles, &res.codegenFiles })
+        {
+            for (size_t i = 0, n = Count(); i != n && ok; ++i)
+            {
+                FileEntry fe;
+                fe.file = Name();
+                fe.us = Get<int64_t>();
+                files->push_back(fe);
+            }
+        }
+        for (size_t i = 0, n = Count(); i != n && ok; ++i)
+        {
+            IncludeEntry& e = res.headerMap[Name()];
+            e.us = Get<int64_t>();
+            e.count = Get<int>();
+            e.root = Get<uint8_t>() != 0;
+            e.includePaths.resize(Count());
+            for (IncludeChain& chain : e.includePaths)
+            {
+                chain.us = Get<int64_t>();
+                chain.files.resize(Count());
+                for (DetailIndex& file : chain.files)
+                    file = Name();
+            }
+        }
+        for (size_t i = 0, n = Count(); i != n && ok; ++i)
+        {
+            DetailIndex path = Name();
+            res.units[path].Add(Get<UnitTotals>());
+        }
+        for (size_t i = 0, n = Count(); i != n && ok; ++i)
+        {
+            CompileEntry c;
+            c.file = Name();
+            c.ts = Get<int64_t>();
+            c.dur = Get<int64_t>();
+            res.compiles.push_back(c);
+        }
+    }
+};
+
+// Data of one analysis part, and what it is called in messages.
+struct PartData
+{
+    const char* data;
+    size_t size;
+    std::string name;
+};
+
+static bool MergeAnalysisParts(const std::vector<PartData>& partData, FILE* out, ReportFormat format)
+{
+    Arena arena("analysis");
+    ArenaScope scope(&arena);
+
+    // names of all the parts are merged first, in part order, so that they get the
+    // same indices as when analyzing the whole capture
+    std::vector<std::vector<DetailIndex>> nameRemaps(partData.size());
+    BuildNames names;
+    names.Intern("", 0);
+    for (size_t part = 0; part != partData.size(); ++part)
+    {
+        const PartData& file = partData[part];
+        const std::string& path = file.name;
+        if (file.size < sizeof(PartHeader) || memcmp(file.data, kPartMagic, sizeof(kPartMagic)) != 0)
+        {
+            printf("%sERROR: '%s' is not an analysis part file.%s\n", col::kRed, path.c_str(), col::kReset);
+            return false;
+        }
+        PartHeader header;
+        memcpy(&header, file.data, sizeof(header));
+        if (header.version != kPartVersion)
+        {
+            printf("%sERROR: unsupported analysis part file version %u (expected %u).%s\n", col::kRed, header.version, kPartVersion, col::kReset);
+            return false;
+        }
+        // counts are checked against the file size by division first, so that huge ones
+        // from a corrupt header can't wrap around
+        const uint64_t available = file.size - sizeof(header);
+        if (header.nameCount >= INT_MAX || header.nameCount >= available / sizeof(uint64_t) ||
+            header.nameDataSize > available - (header.nameCount + 1) * sizeof(uint64_t))
+        {
+            printf("%sERROR: analysis part file '%s' is truncated.%s\n", col::kRed, path.c_str(), col::kReset);
+            return false;
+        }
+        const uint64_t* offsets = (const uint64_t*)(file.data + sizeof(header));
+        const char* nameData = (const char*)(offsets + header.nameCount + 1);
+        std::vector<DetailIndex>& remap = nameRemaps[part];
+        remap.resize((size_t)header.nameCount);
+        for (size_t i = 0; i != remap.size(); ++i)
+        {
+            if (offsets[i] >= offsets[i + 1] || offsets[i + 1] > header.nameDataSize)
+            {
+                printf("%sERROR: analysis part file '%s' is corrupt.%s\n", col::kRed, path.c_str(), col::kReset);
+                return false;
+            }
+            remap[i] = names.Intern(nameData + offsets[i], size_t(offsets[i + 1] - offsets[i] - 1));
+        }
+    }
+
+    const BuildEvents noEvents;
+    Analysis a(noEvents, names, out, format);
+    a.ReadConfig();
+    {
+        timing::Scope timingScope(timing::kAggregate);
+        std::vector<EventAggregates> parts(partData.size());
+        bool absoluteTimes = true;
+        for (size_t part = 0; part != partData.size(); ++part)
+        {
+            const PartData& file = partData[part];
+            PartHeader header;
+            memcpy(&header, file.data, sizeof(header));
+            const char* data = file.data + sizeof(PartHeader) + size_t(header.nameCount + 1) * sizeof(uint64_t) + size_t(header.nameDataSize);
+            PartReader reader = { data, file.data + file.size, nameRemaps[part] };
+            reader.Read(parts[part]);
+            if (!reader.ok)
+            {
+                printf("%sERROR: analysis part file '%s' is corrupt.%s\n", col::kRed, file.name.c_str(), col::kReset);
+                return false;
+            }
+            timing::Count(timing::kEventsAnalyzed, header.eventCount);
+            if (header.minFileTime != a.config.minFileTime || header.headerChainCount != a.config.headerChainCount)
+                printf("%sWARN: analysis part '%s' was made with different minTimes file or headerChain settings; the report might be incomplete.%s\n", col::kYellow, file.name.c_str(), col::kReset);
+            if (header.eventCount != 0)
+                absoluteTimes &= (header.flags & kPartFlagAbsoluteTimes) != 0;
+        }
+
+        // a header is keyed by the first of the names with its nice path, which can be
+        // a different one in each part
+        std::unordered_map<std::string, DetailIndex> headerKeys;
+        for (const EventAggregates& part : parts)
+        {
+            for (const auto& kvp : part.headerMap)
+            {
+                auto res = headerKeys.insert(std::make_pair(a.GetBuildName(kvp.first), kvp.first));
+                if (kvp.first < res.first->second)
+                    res.first->second = kvp.first;
+            }
+        }
+        for (EventAggregates& part : parts)
+        {
+            std::unordered_map<DetailIndex, IncludeEntry> headerMap;
+            for (auto& kvp : part.headerMap)
+                headerMap[headerKeys[a.GetBuildName(kvp.first)]] = std::move(kvp.second);
+            part.headerMap.swap(headerMap);
+            a.AddAggregates(part);
+        }
+        a.agg.absoluteTimes = absoluteTimes;
+    }
+    timing::Count(timing::kNamesAnalyzed, names.size());
+    a.EndAnalysis();
+    return true;
+}
+
+bool DoMergedAnalysis(const std::vector<std::string>& partPaths, FILE* out, ReportFormat format)
+{
+    std::vector<std::unique_ptr<MappedFile>> files;
+    std::vector<PartData> parts;
+    for (const std::string& path : partPaths)
+    {
+        files.emplace_back(new MappedFile());
+        MappedFile& file = *files.back();
+        if (!file.Open(path.c_str()))
+        {
+            printf("%sERROR: '%s' is not an analysis part file.%s\n", col::kRed, path.c_str(), col::kReset);
+            return false;
+        }
+        timing::Count(timing::kFilesRead);
+        timing::Count(timing::kBytesRead, file.GetSize());
+        parts.push_back(PartData{ file.GetData(), file.GetSize(), path });
+    }
+    return MergeAnalysisParts(parts, out, format);
+}
+
+bool DoMergedAnalysisOfParts(const std::vector<std::string>& partData, FILE* out, ReportFormat format)
+{
+    std::vector<PartData> parts;
+    for (const std::string& data : partData)
+        parts.push_back(PartData{ data.data(), data.size(), "part " + std::to_string(parts.size()) });
+    return MergeAnalysisParts(parts, out, format);
+}
+
+// Time (and count) of one thing, e.g. a template, in the old and the new capture.
+struct DiffEntry
+{
+    int64_t oldUs = 0;
+    int64_t newUs = 0;
+    int oldCount = 0;
+    int newCount = 0;
+    int64_t Delta() const { return newUs - oldUs; }
+};
+typedef std::unordered_map<std::string, DiffEntry> DiffTable;
+
+// Things of one kind, e.g. templates, joined by name between the old and the new capture.
+struct DiffCategory
+{
+    const char* title;
+    int count;
+    bool withCounts;
+    DiffTable table;
+};
+
+static void EmitDiffCategory(std::string& out, const DiffCategory& category, bool demangle, int maxName)
+{
+    // changes below a millisecond would print as zero anyway
+    std::vector<std::pair<std::string, DiffEntry>> regressions, improvements;
+    for (const auto& kvp : category.table)
+    {
+        if (kvp.second.Delta() >= 1000)
+            regressions.push_back(kvp);
+        else if (kvp.second.Delta() <= -1000)
+            improvements.push_back(kvp);
+    }
+    auto emit = [&](std::vector<std::pair<std::string, DiffEntry>>& entries, const char* header, bool bigGrowthFirst)
+    {
+        if (entries.empty())
+            return;
+        std::vector<std::pair<std::string, DiffEntry>> top = TopK<std::pair<std::string, DiffEntry>>(entries.begin(), entries.end(), category.count, [&](const auto& a, const auto& b)
+        {
+            if (a.second.Delta() != b.second.Delta())
+                return bigGrowthFirst ? a.second.Delta() > b.second.Delta() : a.second.Delta() < b.second.Delta();
+            return a.first < b.first;
+        });
+        Print(out, "%s%s**** %s %s%s:\n", col::kBold, col::kMagenta, header, category.title, col::kReset);
+        for (const auto& e : top)
+        {
+            std::string dname = demangle ? llvm::demangle(e.first) : e.first;
+            if (maxName > 0 && dname.size() > size_t(maxName))
+                dname = dname.substr(0, maxName - 2) + "...";
+            const DiffEntry& d = e.second;
+            if (category.withCounts)
+                Print(out, "%s%+7i%s ms: %s (%i -> %i ms, %i -> %i times)\n", col::kBold, int(d.Delta() / 1000), col::kReset, dname.c_str(), int(d.oldUs / 1000), int(d.newUs / 1000), d.oldCount, d.newCount);
+            else
+                Print(out, "%s%+7i%s ms: %s (%i -> %i ms)\n", col::kBold, int(d.Delta() / 1000), col::kReset, dname.c_str(), int(d.oldUs / 1000), int(d.newUs / 1000));
+        }
+        Print(out, "\n");
+    };
+    emit(regressions, "Biggest regressions in", true);
+    emit(improvements, "Biggest improvements in", false);
+}
+
+void DoDiffAnalysis(const BuildEvents& oldEvents, const BuildNames& oldNames, const BuildEvents& newEvents, const BuildNames& newNames, FILE* out)
+{
+    Arena arena("analysis");
+    ArenaScope scope(&arena);
+    timing::Count(timing::kEventsAnalyzed, oldEvents.size() + newEvents.size());
+    timing::Count(timing::kNamesAnalyzed, oldNames.size() + newNames.size());
+    Analysis analyses[2] = { { oldEvents, oldNames, out }, { newEvents, newNames, out } };
+    for (Analysis& a : analyses)
+    {
+        a.ReadConfig();
+        timing::Scope timingScope(timing::kAggregate);
+        a.ProcessEvents();
+    }
+    const Config& config = analyses[1].config;
+
+    // everything is joined by name, since name indices of the two captures have nothing in
+    // common; templates and functions by the raw name (demangled only when printed), files
+    // and headers by their nice path
+    DiffCategory parseFiles = { "files parse time (compiler frontend)", config.fileParseCount, false, {} };
+    DiffCategory codegenFiles = { "files codegen time (compiler backend)", config.fileCodegenCount, false, {} };
+    DiffCategory templates = { "template instantiation time", config.templateCount, true, {} };
+    DiffCategory functions = { "function compile time", config.functionCount, false, {} };
+    DiffCategory headers = { "header parse time", config.headerCount, true, {} };
+    for (int side = 0; side != 2; ++side)
+    {
+        Analysis& a = analyses[side];
+        auto add = [side](DiffTable& table, const std::string& name, int64_t us, int count)
+        {
+            DiffEntry& e = table[name];
+            (side == 0 ? e.oldUs : e.newUs) += us;
+            (side == 0 ? e.oldCount : e.newCount) += count;
+        };
+        for (const FileEntry& f : a.agg.parseFiles)
+            add(parseFiles.table, a.GetBuildName(f.file), f.us, 1);
+        for (const FileEntry& f : a.agg.codegenFiles)
+            add(codegenFiles.table, a.GetBuildName(f.file), f.us, 1);
+        for (const auto& inst : a.agg.instantiations)
+            add(templates.table, a.buildNames[inst.first], inst.second.us, inst.second.count);
+        for (const auto& fn : a.agg.functions)
+            add(functions.table, a.buildNames[fn.first.first], fn.second, 1);
+        for (const auto& kvp : a.agg.headerMap)
+        {
+            if (config.onlyRootHeaders && !kvp.second.root)
+                continue;
+            add(headers.table, a.GetBuildName(kvp.first), kvp.second.us, kvp.second.count);
+        }
+    }
+
+    std::string text;
+    timing::Scope timingScope(timing::kReports);
+    const EventAggregates& oldAgg = analyses[0].agg;
+    const EventAggregates& newAgg = analyses[1].agg;
+    if (oldAgg.totalParseUs || oldAgg.totalCodegenUs || newAgg.totalParseUs || newAgg.totalCodegenUs)
+    {
+        Print(text, "%s%s**** Time summary%s:\n", col::kBold, col::kMagenta, col::kReset);
+        Print(text, "Compilation (%i -> %i times):\n", oldAgg.totalParseCount, newAgg.totalParseCount);
+        Print(text, "  Parsing (frontend):        %7.1f -> %s%7.1f%s s (%+.1f s)\n", oldAgg.totalParseUs / 1000000.0, col::kBold, newAgg.totalParseUs / 1000000.0, col::kReset, (newAgg.totalParseUs - oldAgg.totalParseUs) / 1000000.0);
+        Print(text, "  Codegen & opts (backend):  %7.1f -> %s%7.1f%s s (%+.1f s)\n", oldAgg.totalCodegenUs / 1000000.0, col::kBold, newAgg.totalCodegenUs / 1000000.0, col::kReset, (newAgg.totalCodegenUs - oldAgg.totalCodegenUs) / 1000000.0);
+        Print(text, "\n");
+    }
+    EmitDiffCategory(text, parseFiles, false, config.maxName);
+    EmitDiffCategory(text, codegenFiles, false, config.maxName);
+    EmitDiffCategory(text, templates, true, config.maxName);
+    EmitDiffCategory(text, functions, true, config.maxName);
+    EmitDiffCategory(text, headers, false, config.maxName);
+    fwrite(text.data(), 1, text.size(), out);
+}
+
+// --serve: events are processed once, and everything that queries look at is indexed up
+// front, so that each query only goes through the things it is about. Queries come one
+// per line; each reply is one line of json, with the same records as --format json reports
+// (or an object with just an "error" string).
+struct QueryServer
+{
+    explicit QueryServer(Analysis& a_) : a(a_), events(a_.events) {}
+
+    Analysis& a;
+    const BuildEvents& events;
+
+    // all of each report section, in report order, so that top N is the first N items
+    std::vector<FileEntry> parseFiles, codegenFiles;
+    std::vector<std::pair<DetailIndex, InstantiateEntry>> templates;
+    std::vector<std::pair<std::string, InstantiateEntry>> templateSets, functionSets;
+    std::vector<std::pair<IndexPair, int64_t>> functions;
+    std::vector<std::pair<DetailIndex, int64_t>> headers;
+    std::vector<DetailIndex> units; // by frontend + backend time
+
+    // instantiation events sorted by name, and ParseFile events of headers by header
+    // index, with the range of each name in them
+    typedef std::unordered_map<DetailIndex, std::pair<size_t, size_t>> EventRanges;
+    std::vector<EventIndex> instantiationEvents, headerEvents;
+    EventRanges instantiationRanges, headerRanges;
+    // [begin,end) runs of consecutive events of each compile unit
+    std::unordered_map<DetailIndex, std::vector<std::pair<EventIndex, EventIndex>>> unitEvents;
+
+    // what queries are looked up by: nice paths of headers & compile units, demangled and
+    // collapsed names of templates
+    typedef std::unordered_map<std::string, std::vector<DetailIndex>> NameMap;
+    NameMap headerNames, unitNames, templateNames, templateSetNames;
+
+    void Build();
+    // reply to one query, without the newline
+    std::string Query(const std::string& line);
+
+private:
+    template<typename Key>
+    void GroupEvents(std::vector<EventIndex>& list, Key key, EventRanges& ranges);
+    const std::vector<DetailIndex>* FindPath(const NameMap& names, const std::string& query, std::string& error);
+
+    bool QueryTop(const std::string& category, int count, std::string& out, std::string& error);
+    bool QueryHeader(const std::string& path, int count, std::string& out, std::string& error);
+    bool QueryInstantiations(const std::string& name, int count, std::string& out, std::string& error);
+    bool QueryFile(const std::string& path, int count, std::string& out, std::string& error);
+};
+
+// sorts events by key(event), and finds the range of each key
+template<typename Key>
+void QueryServer::GroupEvents(std::vector<EventIndex>& list, Key key, EventRanges& ranges)
+{
+    std::sort(list.begin(), list.end(), [&](EventIndex x, EventIndex y)
+    {
+        DetailIndex kx = key(x), ky = key(y);
+        if (kx != ky)
+            return kx < ky;
+        return x < y;
+    });
+    for (size_t i = 0, n = list.size(); i != n; )
+    {
+        DetailIndex k = key(list[i]);
+        size_t end = i + 1;
+        while (end != n && key(list[end]) == k)
+            ++end;
+        ranges[k] = std::make_pair(i, end);
+        i = end;
+    }
+}
+
+void QueryServer::Build()
+{
+    const EventAggregates& agg = a.agg;
+
+    std::vector<DetailIndex> names;
+    for (const auto& inst : agg.instantiations)
+        names.push_back(inst.first);
+    a.PrepareNames(Analysis::kDemangledName, names);
+    names.clear();
+    for (const auto& fn : agg.functions)
+        names.push_back(fn.first.first);
+    a.PrepareNames(Analysis::kCollapsedDemangledName, names);
+    names.clear();
+    for (const auto& unit : agg.units)
+        names.push_back(unit.first);
+    a.PrepareNames(Analysis::kNiceName, names);
+
+    parseFiles = agg.parseFiles;
+    std::sort(parseFiles.begin(), parseFiles.end(), FileEntryBefore);
+    codegenFiles = agg.codegenFiles;
+    std::sort(codegenFiles.begin(), codegenFiles.end(), FileEntryBefore);
+    templates.assign(agg.instantiations.begin(), agg.instantiations.end());
+    std::sort(templates.begin(), templates.end(), InstantiationBefore());
+    functions.assign(agg.functions.begin(), agg.functions.end());
+    std::sort(functions.begin(), functions.end(), FunctionBefore());
+    headers = a.FindExpensiveHeaders(agg.headerMap, (int)agg.headerMap.size());
+    {
+        std::unordered_map<std::string, InstantiateEntry> collapsed;
+        a.GetCollapsedTemplates(collapsed);
+        templateSets.assign(collapsed.begin(), collapsed.end());
+        std::sort(templateSets.begin(), templateSets.end(), InstantiationBefore());
+        collapsed.clear();
+        a.GetCollapsedFunctions(collapsed);
+        functionSets.assign(collapsed.begin(), collapsed.end());
+        std::sort(functionSets.begin(), functionSets.end(), InstantiationBefore());
+    }
+    for (const auto& unit : agg.units)
+        units.push_back(unit.first);
+    auto unitUs = [&](DetailIndex unit)
+    {
+        const UnitTotals& t = agg.units.find(unit)->second;
+        return t.frontendUs + t.backendUs;
+    };
+    std::sort(units.begin(), units.end(), [&](DetailIndex x, DetailIndex y)
+    {
+        if (unitUs(x) != unitUs(y))
+            return unitUs(x) > unitUs(y);
+        return a.GetBuildName(x) < a.GetBuildName(y);
+    });
+
+    for (BuildEventType type : { BuildEventType::kInstantiateClass, BuildEventType::kInstantiateFunction })
+    {
+        const std::vector<EventIndex>& list = events.OfType(type);
+        instantiationEvents.insert(instantiationEvents.end(), list.begin(), list.end());
+    }
+    GroupEvents(instantiationEvents, [&](EventIndex ev) { return events.details[ev]; }, instantiationRanges);
+    for (EventIndex ev : events.OfType(BuildEventType::kParseFile))
+        if (a.GetHeaderIndex(events.details[ev]).idx >= 0)
+            headerEvents.push_back(ev);
+    GroupEvents(headerEvents, [&](EventIndex ev) { return a.GetHeaderIndex(events.details[ev]); }, headerRanges);
+    // compile unit of an event is the path of its root event; events under an OptModule
+    // have the source file as their path instead, but belong to the same unit. Clang traces
+    // are in end time order, i.e. parents come after their children, so going backwards
+    // the root of the parent is always known already; events that had to be sorted to find
+    // their parents can have them before, and walk up the chain instead.
+    std::vector<EventIndex> roots(events.size());
+    for (int i = (int)events.size() - 1; i >= 0; --i)
+    {
+        EventIndex parent = events.parents[EventIndex(i)];
+        if (parent.idx < 0)
+            roots[i] = EventIndex(i);
+        else if (parent.idx > i)
+            roots[i] = roots[parent.idx];
+        else
+        {
+            while (events.parents[parent].idx >= 0)
+                parent = events.parents[parent];
+            roots[i] = parent;
+        }
+    }
+    for (int i = 0, n = (int)events.size(); i != n; )
+    {
+        DetailIndex path = events.paths[roots[i]];
+        int end = i + 1;
+        while (end != n && events.paths[roots[end]] == path)
+            ++end;
+        unitEvents[path].emplace_back(EventIndex(i), EventIndex(end));
+        i = end;
+    }
+
+    for (const auto& kvp : agg.headerMap)
+        headerNames[a.GetBuildName(kvp.first)].push_back(kvp.first);
+    for (DetailIndex unit : units)
+        unitNames[a.GetBuildName(unit)].push_back(unit);
+    for (const auto& inst : templates)
+    {
+        templateNames[a.GetDemangledName(inst.first)].push_back(inst.first);
+        templateSetNames[a.GetCachedName(Analysis::kCollapsedName, inst.first)].push_back(inst.first);
+    }
+}
+
+static std::string DropExtension(const std::string& path)
+{
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || dot == 0 || path.find('/', dot) != std::string::npos)
+        return path;
+    return path.substr(0, dot);
+}
+
+// whether path ends with the given relative path, at a directory boundary
+static bool EndsWithPath(const std::string& path, const std::string& end)
+{
+    if (end.empty() || !utils::EndsWith(path, end))
+        return false;
+    return path.size() == end.size() || path[path.size() - end.size() - 1] == '/';
+}
+
+// Files are found by their nice path, or else by the end of it, with or without the
+// extension, as long as only one file matches that.
+const std::vector<DetailIndex>* QueryServer::FindPath(const NameMap& names, const std::string& query, std::string& error)
+{
+    std::string path = utils::GetNicePath(query);
+    auto it = names.find(path);
+    if (it != names.end())
+        return &it->second;
+    std::string pathNoExt = DropExtension(path);
+    std::vector<const NameMap::value_type*> found;
+    for (const auto& kvp : names)
+    {
+        if (EndsWithPath(kvp.first, path) || EndsWithPath(DropExtension(kvp.first), pathNoExt))
+            found.push_back(&kvp);
+    }
+    if (found.size() == 1)
+        return &found[0]->second;
+    if (found.empty())
+    {
+        error = "no file matches '" + query + "'";
+        return nullptr;
+    }
+    std::sort(found.begin(), found.end(), [](const auto* x, const auto* y) { return x->first < y->first; });
+    Print(error, "%i files match '%s': '%s', '%s'%s", (int)found.size(), query.c_str(), found[0]->first.c_str(), found[1]->first.c_str(), found.size() > 2 ? ", ..." : "");
+    return nullptr;
+}
+
+// top [count] things of a report section
+bool QueryServer::QueryTop(const std::string& category, int count, std::string& out, std::string& error)
+{
+    const Config& config = a.config;
+    static const char* kCategories[] = { "parseFiles", "codegenFiles", "templates", "templateSets", "functions", "functionSets", "headers", "units" };
+    const int defaultCounts[] = { config.fileParseCount, config.fileCodegenCount, config.templateCount, config.templateCount, config.functionCount, config.functionCount, config.headerCount, config.directoryCount > 0 ? config.directoryCount : 10 };
+    int index = 0;
+    const int categoryCount = sizeof(kCategories) / sizeof(kCategories[0]);
+    while (index != categoryCount && category != kCategories[index])
+        ++index;
+    if (index == categoryCount)
+    {
+        error = "unknown category '" + category + "', expected one of:";
+        for (const char* name : kCategories)
+            error += std::string(" ") + name;
+        return false;
+    }
+    if (count < 0)
+        count = defaultCounts[index];
+
+    ReportRecords records(out, ReportFormat::kJson, kCategories[index]);
+    auto addEntries = [&](const std::vector<std::pair<std::string, InstantiateEntry>>& list)
+    {
+        for (size_t i = 0, n = std::min(list.size(), (size_t)count); i != n; ++i)
+        {
+            ReportRecord r;
+            r.name = list[i].first;
+            r.us = list[i].second.us;
+            r.count = list[i].second.count;
+            records.Add(r);
+        }
+    };
+    switch (index)
+    {
+    case 0:
+    case 1:
+    {
+        const std::vector<FileEntry>& list = index == 0 ? parseFiles : codegenFiles;
+        for (size_t i = 0, n = std::min(list.size(), (size_t)count); i != n; ++i)
+        {
+            ReportRecord r;
+            r.name = a.GetBuildName(list[i].file);
+            r.us = list[i].us;
+            records.Add(r);
+        }
+        break;
+    }
+    case 2:
+        for (size_t i = 0, n = std::min(templates.size(), (size_t)count); i != n; ++i)
+        {
+            ReportRecord r;
+            r.name = a.GetDemangledName(templates[i].first);
+            r.us = templates[i].second.us;
+            r.count = templates[i].second.count;
+            records.Add(r);
+        }
+        break;
+    case 3:
+        addEntries(templateSets);
+        break;
+    case 4:
+        for (size_t i = 0, n = std::min(functions.size(), (size_t)count); i != n; ++i)
+        {
+            ReportRecord r;
+            r.name = a.GetDemangledName(functions[i].first.first);
+            r.file = a.GetBuildName(functions[i].first.second);
+            r.us = functions[i].second;
+            records.Add(r);
+        }
+        break;
+    case 5:
+        addEntries(functionSets);
+        break;
+    case 6:
+        for (size_t i = 0, n = std::min(headers.size(), (size_t)count); i != n; ++i)
+        {
+            ReportRecord r;
+            r.name = a.GetBuildName(headers[i].first);
+            r.us = headers[i].second;
+            r.count = a.agg.headerMap.find(headers[i].first)->second.count;
+            records.Add(r);
+        }
+        break;
+    case 7:
+        for (size_t i = 0, n = std::min(units.size(), (size_t)count); i != n; ++i)
+        {
+            const UnitTotals& t = a.agg.units.find(units[i])->second;
+            ReportRecord r;
+            r.name = a.GetBuildName(units[i]);
+            r.us = t.frontendUs + t.backendUs;
+            r.parts = { { "frontend", t.frontendUs }, { "backend", t.backendUs }, { "templates", t.templateUs }, { "headers", t.headerUs } };
+            records.Add(r);
+        }
+        break;
+    }
+    return true;
+}
+
+// total time of a header, and its [count] most expensive include chains
+bool QueryServer::QueryHeader(const std::string& path, int count, std::string& out, std::string& error)
+{
+    const std::vector<DetailIndex>* found = FindPath(headerNames, path, error);
+    if (!found)
+        return false;
+    DetailIndex header = found->front(); // headers with the same nice path have one index
+    const IncludeEntry& entry = a.agg.headerMap.find(header)->second;
+    {
+        ReportRecords records(out, ReportFormat::kJson, "headers");
+        ReportRecord r;
+        r.name = a.GetBuildName(header);
+        r.us = entry.us;
+        r.count = entry.count;
+        records.Add(r);
+    }
+
+    std::vector<IncludeChain> chains;
+    auto range = headerRanges.find(header);
+    if (range != headerRanges.end())
+    {
+        for (size_t i = range->second.first; i != range->second.second; ++i)
+        {
+            IncludeChain chain;
+            chain.event = headerEvents[i];
+            chain.us = events.durs[chain.event];
+            a.StoreIncludeChainFiles(chain);
+            chains.push_back(std::move(chain));
+        }
+    }
+    if (count < 0)
+        count = a.config.headerChainCount;
+    chains = TopK<IncludeChain>(chains.begin(), chains.end(), count, [&](const IncludeChain& x, const IncludeChain& y) { return a.IncludeChainBefore(x, y); });
+    ReportRecords records(out, ReportFormat::kJson, "headerChains");
+    std::vector<DetailIndex> files;
+    for (const IncludeChain& chain : chains)
+    {
+        ReportRecord r;
+        r.name = a.GetBuildName(header);
+        r.us = chain.us;
+        a.GetIncludeChainFiles(chain, files);
+        for (auto it = files.rbegin(), itEnd = files.rend(); it != itEnd; ++it)
+            r.includedVia.push_back(a.GetBuildName(*it));
+        records.Add(r);
+    }
+    return true;
+}
+
+// Outermost instantiations of a template (by its exact name, or its collapsed name for
+// all instantiations of it), and the [count] most expensive instantiations inside them.
+// Time of those is counted like in the templates report, except that recursive ones
+// (inside another one with the same name) are already part of the outer one.
+bool QueryServer::QueryInstantiations(const std::string& name, int count, std::string& out, std::string& error)
+{
+    std::string matchedName = name;
+    auto it = templateNames.find(name);
+    if (it == templateNames.end())
+    {
+        it = templateSetNames.find(name);
+        if (it == templateSetNames.end())
+        {
+            matchedName = collapseName(name);
+            it = templateSetNames.find(matchedName);
+        }
+        if (it == templateSetNames.end())
+        {
+            error = "no template instantiations named '" + name + "'";
+            return false;
+        }
+    }
+    std::vector<DetailIndex> symbols = it->second;
+    std::sort(symbols.begin(), symbols.end());
+    auto isSymbol = [&](EventIndex ev)
+    {
+        BuildEventType type = events.types[ev];
+        return (type == BuildEventType::kInstantiateClass || type == BuildEventType::kInstantiateFunction) &&
+            std::binary_search(symbols.begin(), symbols.end(), events.details[ev]);
+    };
+
+    InstantiateEntry total;
+    std::unordered_map<DetailIndex, InstantiateEntry> nested;
+    std::unordered_map<DetailIndex, int> openCount;
+    struct Visit
+    {
+        EventIndex ev;
+        const EventIndex* nextChild;
+        bool instantiation;
+    };
+    std::vector<Visit> stack;
+    for (DetailIndex symbol : symbols)
+    {
+        auto range = instantiationRanges.find(symbol);
+        if (range == instantiationRanges.end())
+            continue;
+        for (size_t i = range->second.first; i != range->second.second; ++i)
+        {
+            EventIndex root = instantiationEvents[i];
+            bool inside = false;
+            for (EventIndex p = events.parents[root]; p.idx >= 0 && !inside; p = events.parents[p])
+                inside = isSymbol(p);
+            if (inside)
+                continue;
+            total.us += events.durs[root];
+            ++total.count;
+
+            stack.push_back(Visit{ root, events.GetChildren(root).begin(), false });
+            while (!stack.empty())
+            {
+                Visit& top = stack.back();
+                if (top.nextChild == events.GetChildren(top.ev).end())
+                {
+                    if (top.instantiation)
+                        --openCount[events.details[top.ev]];
+                    stack.pop_back();
+                    continue;
+                }
+                EventIndex child = *top.nextChild++;
+                BuildEventType type = events.types[child];
+                bool instantiation = type == BuildEventType::kInstantiateClass || type == BuildEventType::kInstantiateFunction;
+                if (instantiation)
+                {
+                    DetailIndex detail = events.details[child];
+                    InstantiateEntry& e = nested[detail];
+                    ++e.count;
+                    if (openCount[detail]++ == 0)
+                        e.us += events.durs[child];
+                }
+                stack.push_back(Visit{ child, events.GetChildren(child).begin(), instantiation });
+            }
+        }
+    }
+
+    {
+        ReportRecords records(out, ReportFormat::kJson, "templates");
+        ReportRecord r;
+        r.name = matchedName;
+        r.us = total.us;
+        r.count = total.count;
+        records.Add(r);
+    }
+    if (count < 0)
+        count = a.config.templateCount;
+    ReportRecords records(out, ReportFormat::kJson, "instantiations");
+    for (const auto& e : TopK<std::pair<DetailIndex, InstantiateEntry>>(nested.begin(), nested.end(), count, InstantiationBefore()))
+    {
+        ReportRecord r;
+        r.name = a.GetDemangledName(e.first);
+        r.us = e.second.us;
+        r.count = e.second.count;
+        records.Add(r);
+    }
+    return true;
+}
+
+// Times of one compile unit, and its [count] most expensive templates, functions and
+// headers; the events of it are aggregated the same way as for the whole build.
+bool QueryServer::QueryFile(const std::string& path, int count, std::string& out, std::string& error)
+{
+    const std::vector<DetailIndex>* found = FindPath(unitNames, path, error);
+    if (!found)
+        return false;
+    EventAggregates unit;
+    for (DetailIndex file : *found)
+    {
+        auto ranges = unitEvents.find(file);
+        if (ranges == unitEvents.end())
+            continue;
+        for (const auto& range : ranges->second)
+            a.ProcessEventRange(range.first, range.second, unit);
+    }
+    UnitTotals totals;
+    for (const auto& kvp : unit.units)
+        totals.Add(kvp.second);
+
+    {
+        ReportRecords records(out, ReportFormat::kJson, "units");
+        ReportRecord r;
+        r.name = a.GetBuildName(found->front());
+        r.us = totals.frontendUs + totals.backendUs;
+        r.parts = { { "frontend", totals.frontendUs }, { "backend", totals.backendUs }, { "templates", totals.templateUs }, { "headers", totals.headerUs } };
+        records.Add(r);
+    }
+    {
+        ReportRecords records(out, ReportFormat::kJson, "templates");
+        for (const auto& e : TopK<std::pair<DetailIndex, InstantiateEntry>>(unit.instantiations.begin(), unit.instantiations.end(), count < 0 ? a.config.templateCount : count, InstantiationBefore()))
+        {
+            ReportRecord r;
+            r.name = a.GetDemangledName(e.first);
+            r.us = e.second.us;
+            r.count = e.second.count;
+            records.Add(r);
+        }
+    }
+    {
+        ReportRecords records(out, ReportFormat::kJson, "functions");
+        for (const auto& e : TopK<std::pair<IndexPair, int64_t>>(unit.functions.begin(), unit.functions.end(), count < 0 ? a.config.functionCount : count, FunctionBefore()))
+        {
+            ReportRecord r;
+            r.name = a.GetDemangledName(e.first.first);
+            r.file = a.GetBuildName(e.first.second);
+            r.us = e.second;
+            records.Add(r);
+        }
+    }
+    ReportRecords records(out, ReportFormat::kJson, "headers");
+    for (const auto& e : a.FindExpensiveHeaders(unit.headerMap, count < 0 ? a.config.headerCount : count))
+    {
+        ReportRecord r;
+        r.name = a.GetBuildName(e.first);
+        r.us = e.second;
+        r.count = unit.headerMap.find(e.first)->second.count;
+        records.Add(r);
+    }
+    return true;
+}
+
+std::string QueryServer::Query(const std::string& line)
+{
+    // command, then the argument (rest of the line), which can end with a count
+    size_t space = line.find(' ');
+    std::string command = line.substr(0, space);
+    std::string arg = space == std::string::npos ? std::string() : line.substr(line.find_first_not_of(' ', space));
+    std::string text, error;
+    int count = -1;
+    size_t countStart = arg.rfind(' ');
+    if (countStart != std::string::npos && countStart + 1 != arg.size() && arg.find_first_not_of("0123456789", countStart + 1) == std::string::npos)
+    {
+        errno = 0;
+        long value = strtol(arg.c_str() + countStart + 1, nullptr, 10);
+        if (errno == ERANGE || value > INT_MAX)
+            error = "count '" + arg.substr(countStart + 1) + "' is out of range";
+        count = int(std::min<long>(value, INT_MAX));
+        arg.erase(arg.find_last_not_of(' ', countStart) + 1);
+    }
+
+    if (error.empty())
+    {
+        if (command == "top" && !arg.empty())
+            QueryTop(arg, count, text, error);
+        else if (command == "header" && !arg.empty())
+            QueryHeader(arg, count, text, error);
+        else if (command == "instantiations" && !arg.empty())
+            QueryInstantiations(arg, count, text, error);
+        else if (command == "file" && !arg.empty())
+            QueryFile(arg, count, text, error);
+        else if (command == "help")
+            text = "\"commands\": [\"top <parseFiles|codegenFiles|templates|templateSets|functions|functionSets|headers|units> [count]\", "
+                "\"header <path> [count]\", \"instantiations <template> [count]\", \"file <path> [count]\", \"help\", \"quit\"]";
+        else
+            error = "unknown query '" + line + "'; 'help' lists the queries";
+    }
+
+    std::string reply = "{";
+    if (!error.empty())
+    {
+        reply += "\"error\": ";
+        AppendJsonString(reply, error);
+    }
+    else
+    {
+        // records are one per line in reports; here the whole reply is one line
+        for (size_t i = 0, n = text.size(); i != n; ++i)
+        {
+            if (text[i] != '\n')
+                reply += text[i];
+            else
+                while (i + 1 != n && text[i + 1] == ' ')
+                    ++i;
+        }
+    }
+    reply += "}";
+    return reply;
+}
+
+static bool ReadLine(FILE* in, std::string& line)
+{
+    line.clear();
+    char buffer[4096];
+    bool read = false;
+    while (fgets(buffer, sizeof(buffer), in))
+    {
+        read = true;
+        line += buffer;
+        if (line.back() == '\n')
+            break;
+    }
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r' || line.back() == ' '))
+        line.pop_back();
+    return read;
+}
+
+void DoServe(const BuildEvents& events, const BuildNames& names, FILE* in, FILE* out)
+{
+    Arena arena("analysis");
+    ArenaScope scope(&arena);
+    timing::Count(timing::kEventsAnalyzed, events.size());
+    timing::Count(timing::kNamesAnalyzed, names.size());
+    Analysis a(events, names, out, ReportFormat::kJson);
+    a.ReadConfig();
+    {
+        timing::Scope timingScope(timing::kAggregate);
+        a.ProcessEvents();
+    }
+    QueryServer server(a);
+    server.Build();
+    printf("%s  ready, waiting for queries ('help' lists them).%s\n", col::kYellow, col::kReset);
+    fflush(stdout);
+
+    // each query gets a scratch arena for its temporary data
+    Arena queryArena("query");
+    std::string line;
+    while (ReadLine(in, line))
+    {
+        if (line.empty())
+            continue;
+        if (line == "quit")
+            break;
+        {
+            ArenaScope queryScope(&queryArena);
+            std::string reply = server.Query(line);
+            reply += '\n';
+            fwrite(reply.data(), 1, reply.size(), out);
+            fflush(out);
+        }
+        queryArena.Reset();
+    }
+}
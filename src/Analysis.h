@@ -5,4 +5,38 @@
 #include "BuildEvents.h"
 #include <stdio.h>
 
-void DoAnalysis(const BuildEvents& events, BuildNames& names, FILE* out);
+enum class ReportFormat
+{
+    kText,
+    kJson, // object with a list of records for each report section
+    kCsv, // one table of records of all report sections
+};
+
+// Settings file that reports (and [filters] of json parsing) are configured with;
+// ClangBuildAnalyzer.ini of the working directory by default.
+void SetConfigFile(const std::string& path);
+const std::string& GetConfigFile();
+
+// Report is the same in all formats; json & csv ones don't truncate names.
+void DoAnalysis(const BuildEvents& events, const BuildNames& names, FILE* out, ReportFormat format = ReportFormat::kText);
+
+// Analysis of a part of a build (e.g. of some of the files of a capture) can be saved as
+// a compact file of its aggregated data, and DoMergedAnalysis of any number of those gives
+// the report of the whole build. With the parts in the order of their files in the capture,
+// and the same ClangBuildAnalyzer.ini settings, that is exactly the same as the report of
+// DoAnalysis of the whole capture.
+bool SaveAnalysisPart(const BuildEvents& events, const BuildNames& names, const std::string& path);
+bool DoMergedAnalysis(const std::vector<std::string>& partPaths, FILE* out, ReportFormat format = ReportFormat::kText);
+// Same, with the data of parts in memory instead of in files.
+void MakeAnalysisPart(const BuildEvents& events, const BuildNames& names, std::string& outData);
+bool DoMergedAnalysisOfParts(const std::vector<std::string>& partData, FILE* out, ReportFormat format = ReportFormat::kText);
+
+// Compares two captures: biggest regressions & improvements of total times of files,
+// templates, functions and headers (matched by name) from the old to the new one.
+void DoDiffAnalysis(const BuildEvents& oldEvents, const BuildNames& oldNames, const BuildEvents& newEvents, const BuildNames& newNames, FILE* out);
+
+// Processes the events once, and then answers queries (one per line of in, until it ends
+// or a "quit" line) with one line of json each in out: top N of any report section,
+// include chains of a header, instantiations inside ones of a template, and times of one
+// compile unit. "help" query lists them.
+void DoServe(const BuildEvents& events, const BuildNames& names, FILE* in, FILE* out);
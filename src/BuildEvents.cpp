@@ -1,18 +1,302 @@
 // Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
 // SPDX-License-Identifier: Unlicense
 #include "BuildEvents.h"
+#include "Allocator.h"
 #include "Colors.h"
-#include "external/sajson.h"
+#include "MappedFile.h"
+#include "Parallel.h"
+#include "Timing.h"
+#include "Utils.h"
+#include "external/cute_files.h"
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <condition_variable>
+#include <limits.h>
+#include <mutex>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unordered_map>
-#include <iterator>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CBA_SSE2 1
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+void BuildEvents::clear()
+{
+    types.clear();
+    ts.clear();
+    durs.clear();
+    details.clear();
+    parents.clear();
+    childOffsets.assign(1, 0);
+    children.clear();
+    paths.clear();
+    for (auto& list : eventsOfType)
+        list.clear();
+    absoluteTimes = false;
+}
+
+void BuildEvents::reserve(size_t n)
+{
+    types.reserve(n);
+    ts.reserve(n);
+    durs.reserve(n);
+    details.reserve(n);
+    parents.reserve(n);
+    childOffsets.reserve(n + 1);
+    children.reserve(n);
+    paths.reserve(n);
+}
+
+void BuildEvents::push_back(const BuildEvent& ev)
+{
+    types.push_back(ev.type);
+    ts.push_back(ev.ts);
+    durs.push_back(ev.dur);
+    details.push_back(ev.detailIndex);
+    parents.push_back(ev.parent);
+    childOffsets.push_back((uint32_t)children.size());
+    paths.push_back(DetailIndex());
+    eventsOfType[(int)ev.type].push_back(EventIndex(int(types.size() - 1)));
+}
+
+static bool IsPathEvent(BuildEventType type)
+{
+    return type == BuildEventType::kCompiler || type == BuildEventType::kFrontend || type == BuildEventType::kBackend || type == BuildEventType::kOptModule;
+}
+
+void BuildEvents::FindPaths()
+{
+    // walk up the parents until an event with a path (or one with known path) is found,
+    // and then set the path for the whole walked chain; each event is visited once
+    const DetailIndex kNotFound(-1);
+    paths.assign(size(), kNotFound);
+    std::vector<EventIndex> chain;
+    for (int i = 0, n = (int)size(); i != n; ++i)
+    {
+        if (paths[EventIndex(i)] != kNotFound)
+            continue;
+        chain.clear();
+        DetailIndex path;
+        for (EventIndex ev(i); ev.idx >= 0; ev = parents[ev])
+        {
+            if (paths[ev] != kNotFound)
+            {
+                path = paths[ev];
+                break;
+            }
+            chain.push_back(ev);
+            if (IsPathEvent(types[ev]) && details[ev] != DetailIndex())
+            {
+                path = details[ev];
+                break;
+            }
+        }
+        for (EventIndex ev : chain)
+            paths[ev] = path;
+    }
+}
+
+static uint64_t HashName(const char* str, size_t len)
+{
+    // multiply & xorshift over 8 byte words; names are often long template names
+    const uint64_t kMul = 0x9E3779B97F4A7C15ull;
+    uint64_t h = len * kMul;
+    while (len >= 8)
+    {
+        uint64_t w;
+        memcpy(&w, str, 8);
+        h = (h ^ w) * kMul;
+        h ^= h >> 29;
+        str += 8;
+        len -= 8;
+    }
+    uint64_t w = 0;
+    if (len != 0)
+        memcpy(&w, str, len);
+    h = (h ^ w) * kMul;
+    h ^= h >> 32;
+    return h;
+}
+
+void BuildNames::clear()
+{
+    m_Data.clear();
+    m_Offsets.assign(1, 0);
+    m_Hashes.clear();
+    m_Slots.clear();
+}
+
+void BuildNames::reserve(size_t count)
+{
+    m_Offsets.reserve(count + 1);
+    m_Hashes.reserve(count);
+}
+
+void BuildNames::Assign(const char* data, size_t dataSize, const uint64_t* offsets, size_t count)
+{
+    m_Data.assign(data, data + dataSize);
+    m_Offsets.assign(offsets, offsets + count + 1);
+    m_Hashes.clear();
+    m_Slots.clear();
+}
+
+void BuildNames::Rehash(size_t slotCount)
+{
+    for (size_t i = m_Hashes.size(), n = size(); i != n; ++i)
+        m_Hashes.push_back(HashName(GetName(DetailIndex(int(i))), GetLength(DetailIndex(int(i)))));
+    m_Slots.assign(slotCount, -1);
+    const size_t mask = slotCount - 1;
+    for (size_t i = 0, n = size(); i != n; ++i)
+    {
+        size_t slot = m_Hashes[i] & mask;
+        while (m_Slots[slot] >= 0)
+            slot = (slot + 1) & mask;
+        m_Slots[slot] = int(i);
+    }
+}
+
+DetailIndex BuildNames::Find(const char* str, size_t len, uint64_t hash, size_t& slot) const
+{
+    const size_t mask = m_Slots.size() - 1;
+    for (slot = hash & mask; ; slot = (slot + 1) & mask)
+    {
+        int idx = m_Slots[slot];
+        if (idx < 0)
+            return DetailIndex(-1);
+        DetailIndex pos(idx);
+        if (m_Hashes[idx] == hash && GetLength(pos) == len && memcmp(GetName(pos), str, len) == 0)
+            return pos;
+    }
+}
+
+DetailIndex BuildNames::Intern(const char* str, size_t len)
+{
+    // keep the table at most half full
+    size_t slotCount = m_Slots.empty() ? 64 : m_Slots.size();
+    while ((size() + 1) * 2 > slotCount)
+        slotCount *= 2;
+    if (slotCount != m_Slots.size() || m_Hashes.size() != size())
+        Rehash(slotCount);
+
+    const uint64_t hash = HashName(str, len);
+    size_t slot;
+    DetailIndex found = Find(str, len, hash, slot);
+    if (found.idx >= 0)
+        return found;
+
+    DetailIndex index((int)size());
+    m_Slots[slot] = index.idx;
+    m_Hashes.push_back(hash);
+    m_Data.insert(m_Data.end(), str, str + len);
+    m_Data.push_back(0);
+    m_Offsets.push_back(m_Data.size());
+    return index;
+}
 
 static void DebugPrintEvents(const BuildEvents& events, const BuildNames& names)
 {
     for (size_t i = 0; i < events.size(); ++i)
     {
-        const BuildEvent& event = events[EventIndex(int(i))];
-        printf("%4zi: t=%i t1=%7llu t2=%7llu par=%4i ch=%4zi det=%s\n", i, event.type, event.ts, event.ts+event.dur, event.parent.idx, event.children.size(), names[event.detailIndex].substr(0,130).c_str());
+        const BuildEvent event = events[EventIndex(int(i))];
+        printf("%4zi: t=%i t1=%7llu t2=%7llu par=%4i ch=%4zi det=%s\n", i, event.type, event.ts, event.ts+event.dur, event.parent.idx, events.GetChildren(EventIndex(int(i))).size(), names[event.detailIndex].substr(0,130).c_str());
+    }
+}
+
+// Clang writes trace events when they end, so usually the events are in end time order
+// and children always go before their parents. Then the whole hierarchy is found in one
+// pass, with a stack of events that don't have a parent yet. Returns false if events are
+// not in that order, or if the hierarchy could be ambiguous (partially overlapping events,
+// or zero length events at a boundary between two events); the sorting path handles those.
+static bool FindParentsEndOrdered(BuildEvents& events)
+{
+    std::vector<EventIndex> stack;
+    int64_t prevEnd = INT64_MIN;
+    for (int i = 0, n = (int)events.size(); i != n; ++i)
+    {
+        const EventIndex ev(i);
+        const int64_t ts = events.ts[ev];
+        const int64_t end = ts + events.durs[ev];
+        if (end < prevEnd)
+            return false;
+        prevEnd = end;
+
+        events.parents[ev] = EventIndex(-1);
+        // events on the stack end before this one; the ones that start within it are children
+        while (!stack.empty() && events.ts[stack.back()] >= ts)
+        {
+            const EventIndex child = stack.back();
+            if (events.durs[child] == 0 && events.ts[child] == end)
+                return false;
+            events.parents[child] = ev;
+            stack.pop_back();
+        }
+        if (!stack.empty())
+        {
+            const EventIndex prev = stack.back();
+            const int64_t prevEventEnd = events.ts[prev] + events.durs[prev];
+            if (prevEventEnd > ts || (prevEventEnd == ts && end == ts))
+                return false;
+        }
+        stack.push_back(ev);
+    }
+    return true;
+}
+
+// Stable LSD radix sort of event indices by a 64 bit key per event, 8 bits at a time;
+// passes where all keys have the same digit are skipped.
+static void RadixSortByKey(std::vector<EventIndex>& indices, std::vector<EventIndex>& temp, const std::vector<uint64_t>& keys)
+{
+    static const int kPasses = 8;
+    std::vector<size_t> counts(kPasses * 256);
+    for (uint64_t key : keys)
+        for (int pass = 0; pass != kPasses; ++pass)
+            ++counts[pass * 256 + ((key >> (pass * 8)) & 0xFF)];
+    temp.resize(indices.size());
+    for (int pass = 0; pass != kPasses; ++pass)
+    {
+        size_t* count = &counts[pass * 256];
+        const int shift = pass * 8;
+        if (count[(keys[indices[0].idx] >> shift) & 0xFF] == indices.size())
+            continue;
+        size_t sum = 0;
+        for (int digit = 0; digit != 256; ++digit)
+        {
+            size_t c = count[digit];
+            count[digit] = sum;
+            sum += c;
+        }
+        for (EventIndex ev : indices)
+            temp[count[(keys[ev.idx] >> shift) & 0xFF]++] = ev;
+        indices.swap(temp);
+    }
+}
+
+// Fills child lists from the parent indices; children of each event are put in the
+// given order (all event indices), or in event index order if there's none.
+static void BuildChildLists(BuildEvents& events, const EventIndex* order)
+{
+    const int n = (int)events.size();
+    std::vector<uint32_t>& offsets = events.childOffsets;
+    offsets.assign(n + 1, 0);
+    for (EventIndex parent : events.parents)
+        if (parent.idx != -1)
+            ++offsets[parent.idx + 1];
+    for (size_t i = 1; i < offsets.size(); ++i)
+        offsets[i] += offsets[i - 1];
+    events.children.resize(offsets.back());
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (int i = 0; i != n; ++i)
+    {
+        EventIndex ev = order ? order[i] : EventIndex(i);
+        EventIndex parent = events.parents[ev];
+        if (parent.idx != -1)
+            events.children[fill[parent.idx]++] = ev;
     }
 }
 
@@ -21,301 +305,1823 @@ static void FindParentChildrenIndices(BuildEvents& events)
     if (events.empty())
         return;
 
-    // sort events by start time so that parent events go before child events
-    std::vector<EventIndex> sortedIndices;
-    sortedIndices.resize(events.size());
-    for (int i = 0, n = (int)events.size(); i != n; ++i)
-        sortedIndices[i] = EventIndex(i);
-    std::sort(sortedIndices.begin(), sortedIndices.end(), [&](EventIndex ia, EventIndex ib){
-        const auto& ea = events[ia];
-        const auto& eb = events[ib];
-        if (ea.ts != eb.ts)
-            return ea.ts < eb.ts;
-        // break start time ties by making longer events go first (they must be parent)
-        if (ea.dur != eb.dur)
-            return ea.dur > eb.dur;
-        // break ties by assuming that later events in sequence must start parent
-        return ia > ib;
-    });
-
-    // figure out the event hierarchy; for now the parent/child indices are into
-    // the "sortedIndices" array and not event indices in the "events" array.
-    // As a result, we will be digging into .idx members a lot, as we are temporarily
-    // putting the wrong kind of index into 'parent'.
+    if (FindParentsEndOrdered(events))
+    {
+        BuildChildLists(events, nullptr);
+        return;
+    }
+
+    // sort events by start time so that parent events go before child events; break
+    // start time ties by making longer events go first (they must be parent), and then
+    // by assuming that later events in sequence must start parent. Radix sort is stable,
+    // so sort by the least important key first.
+    const size_t n = events.size();
+    std::vector<EventIndex> sortedIndices(n), temp;
+    for (size_t i = 0; i != n; ++i)
+        sortedIndices[i] = EventIndex(int(n - 1 - i));
+    const uint64_t kSignBit = 1ull << 63;
+    std::vector<uint64_t> keys(n);
+    for (size_t i = 0; i != n; ++i)
+        keys[i] = ~((uint64_t)events.durs[EventIndex(int(i))] ^ kSignBit);
+    RadixSortByKey(sortedIndices, temp, keys);
+    for (size_t i = 0; i != n; ++i)
+        keys[i] = (uint64_t)events.ts[EventIndex(int(i))] ^ kSignBit;
+    RadixSortByKey(sortedIndices, temp, keys);
+
+    // figure out the event hierarchy; for each event in sorted order, its parent
+    // is the closest one up the chain of the previous event that contains it.
+    // The parent indices are into the "sortedIndices" array for now.
+    std::vector<int> sortedParents(n);
     int root = 0;
-    BuildEvent* evRoot = &events[sortedIndices[root]];
-    evRoot->parent.idx = -1;
-    for (int i = 1, n = (int)events.size(); i != n; ++i)
+    sortedParents[0] = -1;
+    for (int i = 1; i != (int)n; ++i)
     {
-        BuildEvent* ev2 = &events[sortedIndices[i]];
+        const int64_t ts2 = events.ts[sortedIndices[i]];
+        const int64_t end2 = ts2 + events.durs[sortedIndices[i]];
         while (root != -1)
         {
             // add slice if within bounds
-            if (ev2->ts >= evRoot->ts && ev2->ts+ev2->dur <= evRoot->ts+evRoot->dur)
-            {
-                ev2->parent.idx = root;
-                evRoot->children.push_back(EventIndex(i));
+            const int64_t tsRoot = events.ts[sortedIndices[root]];
+            if (ts2 >= tsRoot && end2 <= tsRoot + events.durs[sortedIndices[root]])
                 break;
-            }
-            
-            root = evRoot->parent.idx;
-            if (root != -1)
-                evRoot = &events[sortedIndices[root]];
+            root = sortedParents[root];
         }
-        if (root == -1)
+        sortedParents[i] = root;
+        root = i;
+    }
+    for (size_t i = 0; i != n; ++i)
+    {
+        int par = sortedParents[i];
+        events.parents[sortedIndices[i]] = par == -1 ? EventIndex(-1) : sortedIndices[par];
+    }
+    BuildChildLists(events, sortedIndices.data());
+}
+
+static void AddEvents(BuildEvents& res, const BuildEvents& add, const std::vector<DetailIndex>& detailRemap, int64_t tsOffset)
+{
+    // copy (not move) since source events are usually allocated from an arena that goes away soon
+    const int offset = (int)res.size();
+    const uint32_t childOffset = (uint32_t)res.children.size();
+    res.types.insert(res.types.end(), add.types.begin(), add.types.end());
+    for (int64_t t : add.ts)
+        res.ts.push_back(t + tsOffset);
+    res.durs.insert(res.durs.end(), add.durs.begin(), add.durs.end());
+    for (DetailIndex d : add.details)
+        res.details.push_back(detailRemap[d.idx]);
+    for (EventIndex p : add.parents)
+        res.parents.push_back(p.idx >= 0 ? EventIndex(p.idx + offset) : p);
+    for (size_t i = 1; i < add.childOffsets.size(); ++i)
+        res.childOffsets.push_back(add.childOffsets[i] + childOffset);
+    for (EventIndex ch : add.children)
+        res.children.push_back(EventIndex(ch.idx + offset));
+    for (DetailIndex d : add.paths)
+        res.paths.push_back(detailRemap[d.idx]);
+    for (int type = 0; type != kBuildEventTypeCount; ++type)
+        for (EventIndex ev : add.eventsOfType[type])
+            res.eventsOfType[type].push_back(EventIndex(ev.idx + offset));
+}
+
+// Known clang -ftime-trace event names. Events that are not used by the analysis
+// have kUnknown type; they are skipped without a warning. New clang versions add
+// more event names; add them here.
+struct EventNameEntry
+{
+    const char* name;
+    size_t length;
+    BuildEventType type;
+};
+#define EVENT_NAME(name, type) { name, sizeof(name) - 1, BuildEventType::type }
+static constexpr EventNameEntry kEventNames[] =
+{
+    EVENT_NAME("ExecuteCompiler", kCompiler),
+    EVENT_NAME("Frontend", kFrontend),
+    EVENT_NAME("Backend", kBackend),
+    EVENT_NAME("Source", kParseFile),
+    EVENT_NAME("ParseTemplate", kParseTemplate),
+    EVENT_NAME("ParseClass", kParseClass),
+    EVENT_NAME("InstantiateClass", kInstantiateClass),
+    EVENT_NAME("InstantiateFunction", kInstantiateFunction),
+    EVENT_NAME("OptModule", kOptModule),
+    EVENT_NAME("OptFunction", kOptFunction),
+    EVENT_NAME("PerformPendingInstantiations", kUnknown),
+    EVENT_NAME("CodeGen Function", kUnknown),
+    EVENT_NAME("PerFunctionPasses", kUnknown),
+    EVENT_NAME("PerModulePasses", kUnknown),
+    EVENT_NAME("CodeGenPasses", kUnknown),
+    EVENT_NAME("DebugType", kUnknown),
+    EVENT_NAME("DebugFunction", kUnknown),
+    EVENT_NAME("DebugGlobalVariable", kUnknown),
+    EVENT_NAME("DebugConstGlobalVariable", kUnknown),
+    EVENT_NAME("RunPass", kUnknown),
+    EVENT_NAME("RunLoopPass", kUnknown),
+};
+#undef EVENT_NAME
+static const int kEventNameCount = int(sizeof(kEventNames) / sizeof(kEventNames[0]));
+
+// Open addressing hash table over event names, built at compile time. The hash only
+// looks at the length and first & last characters, which is enough to tell the
+// known names apart almost always.
+static const size_t kEventNameSlotCount = 128;
+static_assert(kEventNameCount < (int)kEventNameSlotCount / 2, "event name table too full");
+
+static constexpr size_t EventNameHash(const char* name, size_t length)
+{
+    return length == 0 ? 0 : (length * 31 + (unsigned char)name[0] * 7 + (unsigned char)name[length - 1]) & (kEventNameSlotCount - 1);
+}
+
+struct EventNameTable
+{
+    int8_t slots[kEventNameSlotCount];
+};
+
+static constexpr EventNameTable BuildEventNameTable()
+{
+    EventNameTable table = {};
+    for (size_t i = 0; i != kEventNameSlotCount; ++i)
+        table.slots[i] = -1;
+    for (int i = 0; i != kEventNameCount; ++i)
+    {
+        size_t slot = EventNameHash(kEventNames[i].name, kEventNames[i].length);
+        while (table.slots[slot] != -1)
+            slot = (slot + 1) & (kEventNameSlotCount - 1);
+        table.slots[slot] = (int8_t)i;
+    }
+    return table;
+}
+static constexpr EventNameTable kEventNameTable = BuildEventNameTable();
+
+// returns false for names that are not in the table
+static bool FindEventType(const char* name, size_t length, BuildEventType& outType)
+{
+    for (size_t slot = EventNameHash(name, length); kEventNameTable.slots[slot] != -1; slot = (slot + 1) & (kEventNameSlotCount - 1))
+    {
+        const EventNameEntry& entry = kEventNames[kEventNameTable.slots[slot]];
+        if (entry.length == length && memcmp(entry.name, name, length) == 0)
         {
-            ev2->parent.idx = -1;
+            outType = entry.type;
+            return true;
         }
-        root = i;
-        evRoot = &events[sortedIndices[i]];
     }
+    return false;
+}
+
+// Unknown event names are warned about only this many times in total, so that
+// traces from a newer clang don't flood the output.
+static const int kMaxUnknownEventWarnings = 10;
+
+ParseFilters::ParseFilters()
+{
+    for (int i = 0; i != kBuildEventTypeCount; ++i)
+    {
+        typeEnabled[i] = true;
+        minDurations[i] = 0;
+    }
+}
+
+bool ParseFilters::IsDefault() const
+{
+    return GetKey() == ParseFilters().GetKey();
+}
+
+// '*' matches any run of characters (including slashes), '?' any one character
+static bool MatchGlob(const char* glob, const char* str)
+{
+    const char* starGlob = nullptr;
+    const char* starStr = nullptr;
+    while (*str)
+    {
+        if (*glob == '*')
+        {
+            starGlob = ++glob;
+            starStr = str;
+        }
+        else if (*glob == '?' || *glob == *str)
+        {
+            ++glob;
+            ++str;
+        }
+        else if (starGlob)
+        {
+            glob = starGlob;
+            str = ++starStr;
+        }
+        else
+            return false;
+    }
+    while (*glob == '*')
+        ++glob;
+    return *glob == 0;
+}
+
+bool ParseFilters::AcceptsFile(const std::string& name) const
+{
+    for (const auto& glob : excludeFiles)
+        if (MatchGlob(glob.c_str(), name.c_str()))
+            return false;
+    if (includeFiles.empty())
+        return true;
+    for (const auto& glob : includeFiles)
+        if (MatchGlob(glob.c_str(), name.c_str()))
+            return true;
+    return false;
+}
+
+std::vector<std::string> ParseFilters::SplitList(const std::string& list)
+{
+    std::vector<std::string> res;
+    size_t pos = 0;
+    while (pos <= list.size())
+    {
+        size_t next = list.find(',', pos);
+        if (next == std::string::npos)
+            next = list.size();
+        size_t first = list.find_first_not_of(" \t", pos);
+        size_t last = list.find_last_not_of(" \t", next - 1);
+        if (first != std::string::npos && first < next && last != std::string::npos && last >= first)
+            res.emplace_back(list.substr(first, last - first + 1));
+        pos = next + 1;
+    }
+    return res;
+}
+
+static bool FindFilterEventType(const std::string& name, BuildEventType& outType)
+{
+    if (FindEventType(name.data(), name.size(), outType) && outType != BuildEventType::kUnknown)
+        return true;
+    printf("%sERROR: unknown trace event '%s' in filters.%s\n", col::kRed, name.c_str(), col::kReset);
+    return false;
+}
+
+bool ParseFilters::SetEnabledTypes(const std::string& list)
+{
+    std::vector<std::string> names = SplitList(list);
+    if (names.empty())
+        return true;
+    bool enabled[kBuildEventTypeCount] = {};
+    enabled[(int)BuildEventType::kUnknown] = true; // events without a name
+    enabled[(int)BuildEventType::kCompiler] = true;
+    for (const auto& name : names)
+    {
+        BuildEventType type;
+        if (!FindFilterEventType(name, type))
+            return false;
+        enabled[(int)type] = true;
+    }
+    for (int i = 0; i != kBuildEventTypeCount; ++i)
+        typeEnabled[i] = enabled[i];
+    return true;
+}
 
-    // fixup event parent/child indices to be into "events" array
-    for (auto& e : events)
+bool ParseFilters::SetMinTimes(const std::string& list)
+{
+    for (const auto& item : SplitList(list))
     {
-        for (auto& c : e.children)
-            c = sortedIndices[c.idx];
-        if (e.parent.idx != -1)
-            e.parent = sortedIndices[e.parent.idx];
+        size_t colon = item.find(':');
+        std::string name = item.substr(0, colon);
+        name.erase(name.find_last_not_of(" \t") + 1);
+        char* numEnd = nullptr;
+        double ms = colon != std::string::npos ? strtod(item.c_str() + colon + 1, &numEnd) : 0.0;
+        if (colon == std::string::npos || numEnd == item.c_str() + colon + 1 || ms < 0.0)
+        {
+            printf("%sERROR: minimum event times in filters should be like 'OptFunction:0.5', was '%s'.%s\n", col::kRed, item.c_str(), col::kReset);
+            return false;
+        }
+        BuildEventType type;
+        if (!FindFilterEventType(name, type))
+            return false;
+        if (type != BuildEventType::kCompiler)
+            minDurations[(int)type] = int64_t(ms * 1000.0 + 0.5);
     }
+    return true;
 }
 
-static void AddEvents(BuildEvents& res, BuildEvents& add)
+std::string ParseFilters::GetKey() const
 {
-    int offset = (int)res.size();
-    std::move(add.begin(), add.end(), std::back_inserter(res));
-    add.clear();
-    for (size_t i = offset, n = res.size(); i != n; ++i)
+    std::string key;
+    char buf[32];
+    for (int i = 0; i != kBuildEventTypeCount; ++i)
     {
-        BuildEvent& ev = res[EventIndex(int(i))];
-        if (ev.parent.idx >= 0)
-            ev.parent.idx += offset;
-        for (auto& ch : ev.children)
-            ch.idx += offset;
+        snprintf(buf, sizeof(buf), "%c%lld,", typeEnabled[i] ? '+' : '-', (long long)minDurations[i]);
+        key += buf;
     }
+    for (const auto& glob : includeFiles)
+        key += "\ni" + glob;
+    for (const auto& glob : excludeFiles)
+        key += "\ne" + glob;
+    return key;
+}
+
+static ParseFilters s_Filters;
+static std::string s_FiltersKey; // empty when filters are default
+
+void SetParseFilters(const ParseFilters& filters)
+{
+    s_Filters = filters;
+    s_FiltersKey = filters.IsDefault() ? std::string() : filters.GetKey();
+}
+
+const ParseFilters& GetParseFilters()
+{
+    return s_Filters;
+}
+
+static inline int CountTrailingZeros(unsigned mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
 }
 
-struct JsonTraverser
+// Reads one file entry of the big json file ({"traceEvents":[{...}, {...}, ...], ...}) in a
+// single pass, turning trace events into build events as they are read, without building
+// a DOM of the whole file first. Strings are unescaped in place, so the json text gets
+// modified; names only get copied when they are interned.
+struct TraceEventsReader
 {
-    JsonTraverser(BuildEvents& outEvents, BuildNames& outNames)
-    : resultEvents(outEvents), resultNames(outNames)
+    TraceEventsReader(const std::string& fileName, char* jsonText, size_t jsonSize, BuildEvents& outEvents, BuildNames& outNames, std::atomic<int>& unknownEventCount_)
+    : curFileName(fileName), start(jsonText), p(jsonText), end(jsonText + jsonSize), resultEvents(outEvents), resultNames(outNames), unknownEventCount(unknownEventCount_)
     {
-        NameToIndex(""); // make sure zero index is empty
+        resultNames.Intern("", 0); // make sure zero index is empty
     }
 
-    std::string curFileName;
+    const std::string& curFileName;
+    char* const start;
+    char* p;
+    char* const end;
     BuildEvents& resultEvents;
     BuildNames& resultNames;
-    BuildEvents fileEvents;
+    std::atomic<int>& unknownEventCount;
+    bool failed = false; // error about the contents was printed
+    bool syntaxError = false; // not valid json; at errorOffset
+    size_t errorOffset = 0;
 
-    std::unordered_map<std::string, DetailIndex> nameToIndex;
+    static const int kMaxDepth = 256;
 
-    DetailIndex NameToIndex(const std::string& name)
+    struct StringRef
     {
-        auto it = nameToIndex.find(name);
-        if (it != nameToIndex.end())
-            return it->second;
-        DetailIndex index((int)nameToIndex.size());
-        nameToIndex.insert(std::make_pair(name, index));
-        resultNames.push_back(name);
-        return index;
-    }
+        const char* data = nullptr;
+        size_t length = 0;
+        bool Equals(const char* s, size_t len) const { return length == len && memcmp(data, s, len) == 0; }
+    };
+
+    enum ValueKind { kMissing, kString, kInteger, kOther };
+    struct Field
+    {
+        ValueKind kind = kMissing;
+        StringRef str;
+        int64_t num = 0;
+    };
 
-    void ParseRoot(const sajson::value& node)
+    bool SyntaxError()
     {
-        if (node.get_type() != sajson::TYPE_OBJECT)
+        if (!syntaxError)
         {
-            printf("%sERROR: root of JSON should be an object.%s\n", col::kRed, col::kReset);
-            resultEvents.clear();
-            return;
+            syntaxError = true;
+            errorOffset = p - start;
         }
-        const auto& files = node.get_value_of_key(sajson::literal("files"));
-        ParseFiles(files);
+        return false;
+    }
+
+    bool ContentError(const char* message)
+    {
+        printf("%sERROR: %s%s\n", col::kRed, message, col::kReset);
+        failed = true;
+        return false;
+    }
+
+    void SkipWhitespace()
+    {
+        while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+            ++p;
     }
 
-    void ParseFiles(const sajson::value& node)
+    static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+    // Skips whitespace, and checks that there's something after it.
+    bool SkipToValue()
+    {
+        SkipWhitespace();
+        return p != end || SyntaxError();
+    }
+
+    // Calls onValue(key) for each key of the object at p; it has to read the value.
+    template<typename Func>
+    bool ReadObject(Func onValue)
     {
-        if (node.get_type() != sajson::TYPE_OBJECT)
+        ++p;
+        if (!SkipToValue())
+            return false;
+        if (*p == '}')
         {
-            printf("%sERROR: 'files' of JSON should be an object.%s\n", col::kRed, col::kReset);
-            resultEvents.clear();
-            return;
+            ++p;
+            return true;
         }
-
-        for (size_t i = 0, n = node.get_length(); i != n; ++i)
+        while (true)
         {
-            const auto& fileName = node.get_object_key(i);
-            curFileName = fileName.as_string();
-            const auto& fileVal = node.get_object_value(i);
-            if (fileVal.get_type() != sajson::TYPE_OBJECT)
+            if (*p != '"')
+                return SyntaxError();
+            StringRef key;
+            if (!ReadString(key) || !SkipToValue())
+                return false;
+            if (*p != ':')
+                return SyntaxError();
+            ++p;
+            if (!SkipToValue() || !onValue(key) || !SkipToValue())
+                return false;
+            if (*p == '}')
             {
-                printf("%sERROR: 'files' elements in JSON should be objects.%s\n", col::kRed, col::kReset);
-                resultEvents.clear();
-                return;
+                ++p;
+                return true;
             }
-            const auto& traceEventsVal = fileVal.get_value_of_key(sajson::literal("traceEvents"));
-            ParseTraceEvents(traceEventsVal);
+            if (*p != ',')
+                return SyntaxError();
+            ++p;
+            if (!SkipToValue())
+                return false;
         }
     }
 
-    void ParseTraceEvents(const sajson::value& node)
+    // Calls onValue() for each element of the array at p; it has to read the value.
+    template<typename Func>
+    bool ReadArray(Func onValue)
     {
-        if (node.get_type() != sajson::TYPE_ARRAY)
+        ++p;
+        if (!SkipToValue())
+            return false;
+        if (*p == ']')
         {
-            printf("%sERROR: 'traceEvents' of JSON should be an array.%s\n", col::kRed, col::kReset);
-            resultEvents.clear();
-            return;
+            ++p;
+            return true;
         }
-        fileEvents.clear();
-        fileEvents.reserve(node.get_length());
-        for (size_t i = 0, n = node.get_length(); i != n; ++i)
+        while (true)
         {
-            ParseEvent(node.get_array_element(i));
+            if (!onValue() || !SkipToValue())
+                return false;
+            if (*p == ']')
+            {
+                ++p;
+                return true;
+            }
+            if (*p != ',')
+                return SyntaxError();
+            ++p;
+            if (!SkipToValue())
+                return false;
         }
+    }
 
-        FindParentChildrenIndices(fileEvents);
-        if (!fileEvents.empty())
+    // Finds the first quote, backslash or control character in [p,end), 16 bytes at a time when possible.
+    static char* FindStringSpecialChar(char* p, char* end)
+    {
+#if CBA_SSE2
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i control = _mm_set1_epi8(0x1F);
+        while (end - p >= 16)
         {
-            if (fileEvents.back().parent.idx != -1)
-            {
-                printf("%sERROR: the last trace event should be root; was not in '%s'.%s\n", col::kRed, curFileName.c_str(), col::kReset);
-                resultEvents.clear();
-                return;
-            }
+            __m128i chars = _mm_loadu_si128((const __m128i*)p);
+            __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chars, quote), _mm_cmpeq_epi8(chars, backslash)),
+                                           _mm_cmpeq_epi8(_mm_min_epu8(chars, control), chars));
+            int mask = _mm_movemask_epi8(special);
+            if (mask != 0)
+                return p + CountTrailingZeros((unsigned)mask);
+            p += 16;
         }
-        AddEvents(resultEvents, fileEvents);
+#endif
+        while (p != end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+            ++p;
+        return p;
     }
 
-    static bool StrEqual(const sajson::string& s1, const sajson::string& s2)
+    bool ReadHex4(unsigned& outValue)
     {
-        if (s1.length() != s2.length())
-            return false;
-        if (memcmp(s1.data(), s2.data(), s2.length()) != 0)
-            return false;
+        if (end - p < 4)
+            return SyntaxError();
+        unsigned value = 0;
+        for (int i = 0; i != 4; ++i, ++p)
+        {
+            char c = *p;
+            value <<= 4;
+            if (c >= '0' && c <= '9')
+                value |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                value |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                value |= c - 'A' + 10;
+            else
+                return SyntaxError();
+        }
+        outValue = value;
         return true;
     }
 
-    const sajson::string kPid = sajson::literal("pid");
-    const sajson::string kTid = sajson::literal("tid");
-    const sajson::string kPh = sajson::literal("ph");
-    const sajson::string kName = sajson::literal("name");
-    const sajson::string kTs = sajson::literal("ts");
-    const sajson::string kDur = sajson::literal("dur");
-    const sajson::string kArgs = sajson::literal("args");
-    const sajson::string kDetail = sajson::literal("detail");
-
-    void ParseEvent(const sajson::value& node)
+    static char* WriteUtf8(char* dst, unsigned cp)
     {
-        if (node.get_type() != sajson::TYPE_OBJECT)
+        if (cp < 0x80)
+            *dst++ = (char)cp;
+        else if (cp < 0x800)
         {
-            printf("%sERROR: 'traceEvents' elements in JSON should be objects.%s\n", col::kRed, col::kReset);
-            resultEvents.clear();
-            return;
+            *dst++ = (char)(0xC0 | (cp >> 6));
+            *dst++ = (char)(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000)
+        {
+            *dst++ = (char)(0xE0 | (cp >> 12));
+            *dst++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+            *dst++ = (char)(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            *dst++ = (char)(0xF0 | (cp >> 18));
+            *dst++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+            *dst++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+            *dst++ = (char)(0x80 | (cp & 0x3F));
         }
+        return dst;
+    }
 
-        BuildEvent event;
-        for (size_t i = 0, n = node.get_length(); i != n; ++i)
+    // Reads the string at p. Escaped strings are unescaped in place: the result
+    // is never longer than the escaped text.
+    bool ReadString(StringRef& out)
+    {
+        char* str = ++p;
+        char* dst = FindStringSpecialChar(p, end);
+        p = dst;
+        while (true)
         {
-            const auto& nodeKey = node.get_object_key(i);
-            const auto& nodeVal = node.get_object_value(i);
-            if (StrEqual(nodeKey, kPid))
-            {
-                if (nodeVal.get_type() == sajson::TYPE_INTEGER && nodeVal.get_integer_value() != 1)
-                    return;
-            }
-            else if (StrEqual(nodeKey, kTid))
-            {
-                if (nodeVal.get_type() == sajson::TYPE_INTEGER && nodeVal.get_integer_value() != 0)
-                    return;
-            }
-            else if (StrEqual(nodeKey, kPh))
+            if (p == end || (unsigned char)*p < 0x20)
+                return SyntaxError();
+            if (*p == '"')
+                break;
+            if (++p == end)
+                return SyntaxError();
+            switch (*p++)
             {
-                if (nodeVal.get_type() != sajson::TYPE_STRING || strcmp(nodeVal.as_cstring(), "X") != 0)
-                    return;
-            }
-            else if (StrEqual(nodeKey, kName))
+            case '"': *dst++ = '"'; break;
+            case '\\': *dst++ = '\\'; break;
+            case '/': *dst++ = '/'; break;
+            case 'b': *dst++ = '\b'; break;
+            case 'f': *dst++ = '\f'; break;
+            case 'n': *dst++ = '\n'; break;
+            case 'r': *dst++ = '\r'; break;
+            case 't': *dst++ = '\t'; break;
+            case 'u':
             {
-                if (nodeVal.get_type() != sajson::TYPE_STRING)
-                    return;
-                const char* name = nodeVal.as_cstring();
-                if (!strcmp(name, "ExecuteCompiler"))
-                    event.type = BuildEventType::kCompiler;
-                else if (!strcmp(name, "Frontend"))
-                    event.type = BuildEventType::kFrontend;
-                else if (!strcmp(name, "Backend"))
-                    event.type = BuildEventType::kBackend;
-                else if (!strcmp(name, "Source"))
-                    event.type = BuildEventType::kParseFile;
-                else if (!strcmp(name, "ParseTemplate"))
-                    event.type = BuildEventType::kParseTemplate;
-                else if (!strcmp(name, "ParseClass"))
-                    event.type = BuildEventType::kParseClass;
-                else if (!strcmp(name, "InstantiateClass"))
-                    event.type = BuildEventType::kInstantiateClass;
-                else if (!strcmp(name, "InstantiateFunction"))
-                    event.type = BuildEventType::kInstantiateFunction;
-                else if (!strcmp(name, "PerformPendingInstantiations"))
-                    ;
-                else if (!strcmp(name, "CodeGen Function"))
-                    ;
-                else if (!strcmp(name, "OptModule"))
-                    event.type = BuildEventType::kOptModule;
-                else if (!strcmp(name, "OptFunction"))
-                    event.type = BuildEventType::kOptFunction;
-                else if (!strcmp(name, "PerFunctionPasses") || !strcmp(name, "PerModulePasses") || !strcmp(name, "CodeGenPasses"))
-                    ;
-                else if (!strcmp(name, "DebugType") || !strcmp(name, "DebugFunction") || !strcmp(name, "DebugGlobalVariable") || !strcmp(name, "DebugConstGlobalVariable"))
-                    ;
-                else if (!strcmp(name, "RunPass"))
-                    ;
-                else if (!strcmp(name, "RunLoopPass"))
-                    ;
-                else
+                unsigned cp;
+                if (!ReadHex4(cp))
+                    return false;
+                if (cp >= 0xDC00 && cp < 0xE000)
+                    return SyntaxError();
+                if (cp >= 0xD800 && cp < 0xDC00)
                 {
-                    printf("%sWARN: unknown trace event '%s' in '%s', skipping.%s\n", col::kYellow, name, curFileName.c_str(), col::kReset);
+                    unsigned low;
+                    if (end - p < 2 || p[0] != '\\' || p[1] != 'u')
+                        return SyntaxError();
+                    p += 2;
+                    if (!ReadHex4(low))
+                        return false;
+                    if (low < 0xDC00 || low >= 0xE000)
+                        return SyntaxError();
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
                 }
-                if (event.type== BuildEventType::kUnknown)
-                    return;
-            }
-            else if (StrEqual(nodeKey, kTs))
-            {
-                if (nodeVal.get_type() != sajson::TYPE_INTEGER)
-                    return;
-                event.ts = nodeVal.get_integer_value();
+                dst = WriteUtf8(dst, cp);
+                break;
             }
-            else if (StrEqual(nodeKey, kDur))
-            {
-                if (nodeVal.get_type() != sajson::TYPE_INTEGER)
-                    return;
-                event.dur = nodeVal.get_integer_value();
+            default:
+                --p;
+                return SyntaxError();
             }
-            else if (StrEqual(nodeKey, kArgs))
+            char* next = FindStringSpecialChar(p, end);
+            memmove(dst, p, next - p);
+            dst += next - p;
+            p = next;
+        }
+        ++p;
+        out.data = str;
+        out.length = dst - str;
+        return true;
+    }
+
+    // Reads the number at p; it is an integer if it has no fraction nor exponent, and fits into 64 bits.
+    bool ReadNumber(bool& outIsInteger, int64_t& outValue)
+    {
+        bool negative = false;
+        if (*p == '-')
+        {
+            negative = true;
+            ++p;
+        }
+        if (p == end || !IsDigit(*p))
+            return SyntaxError();
+        uint64_t value = 0;
+        bool overflow = false;
+        if (*p == '0')
+            ++p;
+        else
+        {
+            for (; p != end && IsDigit(*p); ++p)
             {
-                if (nodeVal.get_type() == sajson::TYPE_OBJECT && nodeVal.get_length() == 1)
-                {
-                    const auto& nodeDetail = nodeVal.get_object_value(0);
-                    if (nodeDetail.get_type() == sajson::TYPE_STRING)
-                        event.detailIndex = NameToIndex(nodeDetail.as_string());
-                }
+                unsigned digit = *p - '0';
+                if (value > (UINT64_MAX - digit) / 10)
+                    overflow = true;
+                value = value * 10 + digit;
             }
         }
+        bool isInteger = true;
+        if (p != end && *p == '.')
+        {
+            isInteger = false;
+            ++p;
+            if (p == end || !IsDigit(*p))
+                return SyntaxError();
+            while (p != end && IsDigit(*p))
+                ++p;
+        }
+        if (p != end && (*p == 'e' || *p == 'E'))
+        {
+            isInteger = false;
+            ++p;
+            if (p != end && (*p == '+' || *p == '-'))
+                ++p;
+            if (p == end || !IsDigit(*p))
+                return SyntaxError();
+            while (p != end && IsDigit(*p))
+                ++p;
+        }
+        if (overflow || value > (negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX))
+            isInteger = false;
+        outIsInteger = isInteger;
+        outValue = negative ? (int64_t)(0 - value) : (int64_t)value;
+        return true;
+    }
 
-        if (event.detailIndex == DetailIndex() && event.type == BuildEventType::kCompiler)
-            event.detailIndex = NameToIndex(curFileName);
-        fileEvents.emplace_back(event);
+    bool ReadLiteral(const char* literal, size_t length)
+    {
+        if ((size_t)(end - p) < length || memcmp(p, literal, length) != 0)
+            return SyntaxError();
+        p += length;
+        return true;
     }
-};
 
-void ParseBuildEvents(std::string& jsonText, BuildEvents& outEvents, BuildNames& outNames)
-{
-    const sajson::document& doc = sajson::parse(sajson::dynamic_allocation(), sajson::mutable_string_view(jsonText.size(), &jsonText[0]));
-    if (!doc.is_valid())
+    bool SkipValue(int depth)
     {
-        printf("%sERROR: JSON parse error %s.%s\n", col::kRed, doc.get_error_message_as_cstring(), col::kReset);
-        return;
+        if (depth > kMaxDepth)
+            return SyntaxError();
+        switch (*p)
+        {
+        case '"': { StringRef str; return ReadString(str); }
+        case '{': return ReadObject([&](const StringRef&) { return SkipValue(depth + 1); });
+        case '[': return ReadArray([&]() { return SkipValue(depth + 1); });
+        case 't': return ReadLiteral("true", 4);
+        case 'f': return ReadLiteral("false", 5);
+        case 'n': return ReadLiteral("null", 4);
+        default: { bool isInteger; int64_t value; return ReadNumber(isInteger, value); }
+        }
     }
 
-    JsonTraverser traverser(outEvents, outNames);
-    traverser.ParseRoot(doc.get_root());
-    //DebugPrintEvents(outEvents, outNames);
+    bool ReadField(Field& field, int depth)
+    {
+        if (*p == '"')
+        {
+            field.kind = kString;
+            return ReadString(field.str);
+        }
+        if (*p == '-' || IsDigit(*p))
+        {
+            bool isInteger;
+            if (!ReadNumber(isInteger, field.num))
+                return false;
+            field.kind = isInteger ? kInteger : kOther;
+            return true;
+        }
+        field.kind = kOther;
+        return SkipValue(depth);
+    }
+
+    bool ReadFile()
+    {
+        SkipWhitespace();
+        if (p == end || *p != '{')
+            return ContentError("'files' elements in JSON should be objects.");
+        // files that are filtered out are not parsed at all
+        if (!s_Filters.AcceptsFile(curFileName))
+            return true;
+        bool foundEvents = false;
+        bool ok = ReadObject([&](const StringRef& key)
+        {
+            if (foundEvents || !key.Equals("traceEvents", 11))
+                return SkipValue(1);
+            foundEvents = true;
+            if (*p != '[')
+                return ContentError("'traceEvents' of JSON should be an array.");
+            resultEvents.reserve((end - start) / 128);
+            return ReadArray([&]() { return ReadEvent(); });
+        });
+        if (!ok)
+            return false;
+        SkipWhitespace();
+        if (p != end)
+            return SyntaxError();
+        if (!foundEvents)
+            return ContentError("'traceEvents' of JSON should be an array.");
+        return true;
+    }
+
+    bool ReadEvent()
+    {
+        if (*p != '{')
+            return ContentError("'traceEvents' elements in JSON should be objects.");
+
+        // Keys can come in any order; they are looked at in a fixed one (by length, then
+        // alphabetically) so that names get interned in the same order no matter how
+        // the trace was written.
+        Field ph, ts, dur, pid, tid, name;
+        bool hasDetail = false;
+        StringRef detail;
+        bool ok = ReadObject([&](const StringRef& key)
+        {
+            switch (key.length)
+            {
+            case 2:
+                if (key.Equals("ph", 2)) return ReadField(ph, 3);
+                if (key.Equals("ts", 2)) return ReadField(ts, 3);
+                break;
+            case 3:
+                if (key.Equals("dur", 3)) return ReadField(dur, 3);
+                if (key.Equals("pid", 3)) return ReadField(pid, 3);
+                if (key.Equals("tid", 3)) return ReadField(tid, 3);
+                break;
+            case 4:
+                if (key.Equals("name", 4)) return ReadField(name, 3);
+                if (key.Equals("args", 4))
+                {
+                    if (*p != '{')
+                    {
+                        hasDetail = false;
+                        return SkipValue(3);
+                    }
+                    // detail is only used when it's the only thing in args
+                    int argCount = 0;
+                    bool detailIsString = false;
+                    bool argsOk = ReadObject([&](const StringRef&)
+                    {
+                        if (++argCount == 1 && *p == '"')
+                        {
+                            detailIsString = true;
+                            return ReadString(detail);
+                        }
+                        return SkipValue(4);
+                    });
+                    hasDetail = argCount == 1 && detailIsString;
+                    return argsOk;
+                }
+                break;
+            }
+            return SkipValue(3);
+        });
+        if (!ok)
+            return false;
+
+        BuildEvent event;
+        if (ph.kind != kMissing && (ph.kind != kString || ph.str.length != 1 || ph.str.data[0] != 'X'))
+            return true;
+        if (ts.kind != kMissing)
+        {
+            if (ts.kind != kInteger)
+                return true;
+            event.ts = ts.num;
+        }
+        if (dur.kind != kMissing)
+        {
+            if (dur.kind != kInteger)
+                return true;
+            event.dur = dur.num;
+        }
+        if (pid.kind == kInteger && pid.num != 1)
+            return true;
+        if (tid.kind == kInteger && tid.num != 0)
+            return true;
+        if (name.kind != kMissing)
+        {
+            if (name.kind != kString)
+                return true;
+            if (!FindEventType(name.str.data, name.str.length, event.type))
+            {
+                if (++unknownEventCount <= kMaxUnknownEventWarnings)
+                    printf("%sWARN: unknown trace event '%.*s' in '%s', skipping.%s\n", col::kYellow, (int)name.str.length, name.str.data, curFileName.c_str(), col::kReset);
+            }
+            if (event.type == BuildEventType::kUnknown)
+                return true;
+        }
+        // filtered out events are dropped before anything of them is stored
+        if (!s_Filters.AcceptsEvent(event.type, event.dur))
+            return true;
+
+        if (hasDetail)
+            event.detailIndex = resultNames.Intern(detail.data, detail.length);
+
+        if (event.detailIndex == DetailIndex() && event.type == BuildEventType::kCompiler)
+            event.detailIndex = resultNames.Intern(curFileName);
+        resultEvents.push_back(event);
+        return true;
+    }
+
+    bool FinishEvents()
+    {
+        {
+            timing::Scope timingScope(timing::kHierarchy);
+            FindParentChildrenIndices(resultEvents);
+            resultEvents.FindPaths();
+        }
+        if (!resultEvents.empty())
+        {
+            if (resultEvents.parents.back().idx != -1)
+            {
+                printf("%sERROR: the last trace event should be root; was not in '%s'.%s\n", col::kRed, curFileName.c_str(), col::kReset);
+                failed = true;
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// The big json file is {"ClangBuildAnalyzerMarker":..., "files":{"name":{...}, "name":{...}, ...}}.
+// Instead of parsing all of it at once, find where each entry of "files" is with a quick
+// scan, so that they can be parsed independently (and in parallel).
+struct JsonFileRange
+{
+    std::string name;
+    char* data;
+    size_t size;
+    int64_t endTime = -1; // from "traceFileTimes", if the capture has it
+};
+
+static const char* SkipWhitespace(const char* p, const char* end)
+{
+    while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        ++p;
+    return p;
+}
+
+static const char* SkipString(const char* p, const char* end)
+{
+    assert(p != end && *p == '"');
+    for (++p; p != end; ++p)
+    {
+        if (*p == '\\')
+        {
+            if (++p == end)
+                break;
+        }
+        else if (*p == '"')
+            return p + 1;
+    }
+    return nullptr;
+}
+
+static const char* SkipValue(const char* p, const char* end)
+{
+    if (p == end)
+        return nullptr;
+    if (*p == '"')
+        return SkipString(p, end);
+    if (*p == '{' || *p == '[')
+    {
+        int depth = 0;
+        while (p != end)
+        {
+            char c = *p;
+            if (c == '"')
+            {
+                p = SkipString(p, end);
+                if (!p)
+                    return nullptr;
+                continue;
+            }
+            if (c == '{' || c == '[')
+                ++depth;
+            else if (c == '}' || c == ']')
+            {
+                if (--depth == 0)
+                    return p + 1;
+            }
+            ++p;
+        }
+        return nullptr;
+    }
+    // number, true, false, null
+    while (p != end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+        ++p;
+    return p;
+}
+
+static void AppendUtf8(std::string& str, unsigned cp)
+{
+    if (cp < 0x80)
+        str += char(cp);
+    else if (cp < 0x800)
+    {
+        str += char(0xC0 | (cp >> 6));
+        str += char(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        str += char(0xE0 | (cp >> 12));
+        str += char(0x80 | ((cp >> 6) & 0x3F));
+        str += char(0x80 | (cp & 0x3F));
+    }
+}
+
+// p points at opening quote
+static bool ReadString(const char* p, const char* end, std::string& out)
+{
+    const char* strEnd = SkipString(p, end);
+    if (!strEnd)
+        return false;
+    out.clear();
+    for (++p, --strEnd; p != strEnd; ++p)
+    {
+        if (*p != '\\')
+        {
+            out += *p;
+            continue;
+        }
+        ++p;
+        switch (*p)
+        {
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u':
+        {
+            if (strEnd - p < 5)
+                return false;
+            unsigned cp = 0;
+            for (int i = 1; i <= 4; ++i)
+            {
+                char c = p[i];
+                cp <<= 4;
+                if (c >= '0' && c <= '9') cp |= c - '0';
+                else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+                else return false;
+            }
+            AppendUtf8(out, cp);
+            p += 4;
+            break;
+        }
+        default: out += *p; break;
+        }
+    }
+    return true;
+}
+
+static bool SplitFiles(char* text, size_t size, std::vector<JsonFileRange>& outFiles)
+{
+    const char* p = text;
+    const char* end = text + size;
+    p = SkipWhitespace(p, end);
+    if (p == end || *p != '{')
+    {
+        printf("%sERROR: root of JSON should be an object.%s\n", col::kRed, col::kReset);
+        return false;
+    }
+    p = SkipWhitespace(p + 1, end);
+
+    std::string key;
+    bool foundFiles = false;
+    std::unordered_map<std::string, int64_t> endTimes;
+    while (p != end && *p != '}')
+    {
+        if (*p != '"' || !ReadString(p, end, key))
+            break;
+        p = SkipWhitespace(SkipString(p, end), end);
+        if (p == end || *p != ':')
+            break;
+        p = SkipWhitespace(p + 1, end);
+        const char* valEnd = nullptr;
+        if (key == "files" && !foundFiles)
+        {
+            if (p == end || *p != '{')
+            {
+                printf("%sERROR: 'files' of JSON should be an object.%s\n", col::kRed, col::kReset);
+                return false;
+            }
+            foundFiles = true;
+            p = SkipWhitespace(p + 1, end);
+            while (p != end && *p != '}')
+            {
+                JsonFileRange file;
+                if (*p != '"' || !ReadString(p, end, file.name))
+                    break;
+                p = SkipWhitespace(SkipString(p, end), end);
+                if (p == end || *p != ':')
+                    break;
+                p = SkipWhitespace(p + 1, end);
+                if (p == end || *p != '{')
+                {
+                    printf("%sERROR: 'files' elements in JSON should be objects.%s\n", col::kRed, col::kReset);
+                    return false;
+                }
+                const char* fileEnd = SkipValue(p, end);
+                if (!fileEnd)
+                    break;
+                file.data = text + (p - text);
+                file.size = fileEnd - p;
+                outFiles.emplace_back(std::move(file));
+                p = SkipWhitespace(fileEnd, end);
+                if (p != end && *p == ',')
+                    p = SkipWhitespace(p + 1, end);
+            }
+            if (p == end || *p != '}')
+                break;
+            valEnd = p + 1;
+        }
+        else if (key == "traceFileTimes" && p != end && *p == '{')
+        {
+            // {"name":endTime, ...}; can come before or after "files"
+            p = SkipWhitespace(p + 1, end);
+            std::string name;
+            while (p != end && *p != '}')
+            {
+                if (*p != '"' || !ReadString(p, end, name))
+                    break;
+                p = SkipWhitespace(SkipString(p, end), end);
+                if (p == end || *p != ':')
+                    break;
+                p = SkipWhitespace(p + 1, end);
+                char* numEnd = nullptr;
+                long long t = strtoll(p, &numEnd, 10);
+                if (numEnd == p || numEnd > end)
+                    break;
+                endTimes[name] = t;
+                p = SkipWhitespace(numEnd, end);
+                if (p != end && *p == ',')
+                    p = SkipWhitespace(p + 1, end);
+            }
+            if (p == end || *p != '}')
+                break;
+            valEnd = p + 1;
+        }
+        else
+        {
+            valEnd = SkipValue(p, end);
+            if (!valEnd)
+                break;
+        }
+        p = SkipWhitespace(valEnd, end);
+        if (p != end && *p == ',')
+            p = SkipWhitespace(p + 1, end);
+    }
+    if (p == end || *p != '}')
+    {
+        printf("%sERROR: JSON parse error at offset %zu.%s\n", col::kRed, size_t(p - text), col::kReset);
+        return false;
+    }
+    if (!foundFiles)
+    {
+        printf("%sERROR: 'files' of JSON should be an object.%s\n", col::kRed, col::kReset);
+        return false;
+    }
+    for (auto& file : outFiles)
+    {
+        auto it = endTimes.find(file.name);
+        if (it != endTimes.end())
+            file.endTime = it->second;
+    }
+    return true;
+}
+
+// Same split into file entries as SplitFiles does, of the big json file that comes in
+// pieces (e.g. as it is being decompressed). Each Next call takes one item (opening of
+// the root or of "files", a file entry, a trace file time, a closing brace, another key
+// & its value) from the text at p, or tells that the text does not have all of it yet.
+struct StreamSplitter
+{
+    enum class State { kRoot, kKeys, kFiles, kTimes, kDone };
+    enum class Step { kItem, kFile, kMore, kError };
+
+    State state = State::kRoot;
+    bool foundFiles = false;
+    std::unordered_map<std::string, int64_t> endTimes;
+    // file entry of the last kFile step; data points into the text given to Next
+    std::string fileName;
+    const char* fileData = nullptr;
+    size_t fileSize = 0;
+
+    // eof: there is no more text after end; offset: position of text in the whole json, for errors
+    Step Next(const char*& p, const char* end, bool eof, size_t offset)
+    {
+        const char* text = p;
+        const char* q = SkipWhitespace(p, end);
+        if (q == end)
+            return Incomplete(eof, offset + (q - text));
+        if (state != State::kRoot && state != State::kDone && *q == ',')
+        {
+            p = q + 1;
+            return Step::kItem;
+        }
+        switch (state)
+        {
+        case State::kRoot:
+            if (*q != '{')
+            {
+                printf("%sERROR: root of JSON should be an object.%s\n", col::kRed, col::kReset);
+                return Step::kError;
+            }
+            state = State::kKeys;
+            p = q + 1;
+            return Step::kItem;
+        case State::kKeys:
+        case State::kFiles:
+        case State::kTimes:
+        {
+            if (*q == '}')
+            {
+                state = state == State::kKeys ? State::kDone : State::kKeys;
+                p = q + 1;
+                return Step::kItem;
+            }
+            std::string& key = state == State::kFiles ? fileName : m_Key;
+            if (*q != '"')
+                return Error(offset + (q - text));
+            const char* r = SkipString(q, end);
+            if (!r)
+                return Incomplete(eof, offset + (q - text));
+            if (!ReadString(q, end, key))
+                return Error(offset + (q - text));
+            r = SkipWhitespace(r, end);
+            if (r != end && *r != ':')
+                return Error(offset + (r - text));
+            if (r != end)
+                r = SkipWhitespace(r + 1, end);
+            if (r == end)
+                return Incomplete(eof, offset + (r - text));
+
+            if (state == State::kFiles)
+            {
+                if (*r != '{')
+                {
+                    printf("%sERROR: 'files' elements in JSON should be objects.%s\n", col::kRed, col::kReset);
+                    return Step::kError;
+                }
+                const char* fileEnd = SkipValue(r, end);
+                if (!fileEnd)
+                    return Incomplete(eof, offset + (r - text));
+                fileData = r;
+                fileSize = fileEnd - r;
+                p = fileEnd;
+                return Step::kFile;
+            }
+            if (state == State::kTimes)
+            {
+                const char* numEnd = r;
+                if (numEnd != end && *numEnd == '-')
+                    ++numEnd;
+                long long t = 0;
+                for (; numEnd != end && *numEnd >= '0' && *numEnd <= '9'; ++numEnd)
+                    t = t * 10 + (*numEnd - '0');
+                if (numEnd == end && !eof)
+                    return Step::kMore;
+                if (numEnd == r || (numEnd == r + 1 && *r == '-'))
+                    return Error(offset + (r - text));
+                endTimes[key] = *r == '-' ? -t : t;
+                p = numEnd;
+                return Step::kItem;
+            }
+            if (key == "files" && !foundFiles)
+            {
+                if (*r != '{')
+                {
+                    printf("%sERROR: 'files' of JSON should be an object.%s\n", col::kRed, col::kReset);
+                    return Step::kError;
+                }
+                foundFiles = true;
+                state = State::kFiles;
+                p = r + 1;
+                return Step::kItem;
+            }
+            if (key == "traceFileTimes" && *r == '{')
+            {
+                state = State::kTimes;
+                p = r + 1;
+                return Step::kItem;
+            }
+            const char* valEnd = SkipValue(r, end);
+            if (!valEnd || (valEnd == end && !eof))
+                return Incomplete(eof, offset + (r - text));
+            p = valEnd;
+            return Step::kItem;
+        }
+        case State::kDone:
+            break;
+        }
+        return Step::kItem;
+    }
+
+private:
+    Step Incomplete(bool eof, size_t errorOffset)
+    {
+        return eof ? Error(errorOffset) : Step::kMore;
+    }
+    Step Error(size_t errorOffset)
+    {
+        printf("%sERROR: JSON parse error at offset %zu.%s\n", col::kRed, errorOffset, col::kReset);
+        return Step::kError;
+    }
+
+    std::string m_Key;
+};
+
+static bool LoadCachedFileEvents(const std::string& path, BuildEvents& outEvents, BuildNames& outNames);
+
+// Written into a temporary file of this writer first, which is then moved over the entry,
+// so that an interrupted run never leaves a partial entry behind. Other processes (or
+// threads) writing the same entry at the same time have their own temporary files, and
+// the entry is always a complete one of them.
+static void WriteCacheEntry(const std::string& cachePath, const BuildEvents& events, const BuildNames& names)
+{
+    static std::atomic<unsigned> s_TmpCounter(0);
+    char suffix[40];
+    snprintf(suffix, sizeof(suffix), ".%u-%u.tmp", utils::GetProcessId(), s_TmpCounter++);
+    std::string tmpPath = cachePath + suffix;
+    if (!SaveBuildEventsBinary(tmpPath, events, names) || !utils::MoveFileOver(tmpPath, cachePath))
+        remove(tmpPath.c_str());
+}
+
+static bool ParseFileJson(const std::string& fileName, char* jsonText, size_t jsonSize, BuildEvents& outEvents, BuildNames& outNames, std::atomic<int>& unknownEventCount)
+{
+    TraceEventsReader reader(fileName, jsonText, jsonSize, outEvents, outNames, unknownEventCount);
+    bool ok;
+    {
+        timing::Scope timingScope(timing::kParseJson);
+        ok = reader.ReadFile();
+    }
+    timing::Count(timing::kFilesParsed);
+    if (!ok)
+    {
+        if (reader.syntaxError)
+            printf("%sERROR: JSON parse error at offset %zu in '%s'.%s\n", col::kRed, reader.errorOffset, fileName.c_str(), col::kReset);
+        return false;
+    }
+    return reader.FinishEvents();
+}
+
+bool ParseTraceFile(const std::string& fileName, char* jsonText, size_t jsonSize, BuildEvents& outEvents, BuildNames& outNames)
+{
+    // json DOM and events & names during parsing are allocated from an arena, and only
+    // the final copies of events & names go into regular memory
+    Arena arena("parse");
+    BuildEvents fileEvents;
+    BuildNames fileNames;
+    std::atomic<int> unknownEventCount{ 0 };
+    bool ok;
+    {
+        ArenaScope scope(&arena);
+        ok = ParseFileJson(fileName, jsonText, jsonSize, fileEvents, fileNames, unknownEventCount);
+    }
+    if (unknownEventCount > kMaxUnknownEventWarnings)
+        printf("%sWARN: %i more unknown trace events skipped.%s\n", col::kYellow, unknownEventCount - kMaxUnknownEventWarnings, col::kReset);
+    if (!ok)
+        return false;
+    outEvents = fileEvents;
+    outNames = fileNames;
+    return true;
+}
+
+void AppendBuildEvents(const BuildEvents& events, const BuildNames& names, BuildEvents& outEvents, BuildNames& outNames, int64_t endTime)
+{
+    if (outNames.empty())
+        outNames.Intern("", 0);
+    std::vector<DetailIndex> remap(names.size());
+    for (size_t i = 0, n = names.size(); i != n; ++i)
+    {
+        DetailIndex d((int)i);
+        remap[i] = outNames.Intern(names.GetName(d), names.GetLength(d));
+    }
+
+    // the trace is written right when the compile is done, i.e. the last event
+    // of the file ends at endTime
+    int64_t tsOffset = 0;
+    if (!events.empty())
+    {
+        if (endTime >= 0)
+        {
+            int64_t lastEnd = 0;
+            for (size_t i = 0, n = events.size(); i != n; ++i)
+                lastEnd = std::max(lastEnd, events.ts[EventIndex(int(i))] + events.durs[EventIndex(int(i))]);
+            tsOffset = endTime - lastEnd;
+        }
+        bool absolute = endTime >= 0 && (outEvents.empty() || outEvents.absoluteTimes);
+        outEvents.absoluteTimes = absolute;
+    }
+    AddEvents(outEvents, events, remap, tsOffset);
+}
+
+static const char kCacheExt[] = ".cba";
+
+// Each file entry is parsed on a worker thread into its own events & names,
+// and then merged into the final result strictly in file order, so that indices
+// of everything come out the same as if all of it was parsed sequentially.
+struct BuildEventsMerger
+{
+    BuildEvents& outEvents;
+    BuildNames& outNames;
+    std::mutex mutex;
+    std::condition_variable mergeDone;
+    size_t nextToMerge = 0;
+    std::atomic<int> unknownEventCount{ 0 };
+    bool failed = false;
+
+    // with a cache directory: name of the cache entry of each file
+    const std::string& cacheDir;
+    std::vector<std::string> cacheNames;
+    std::atomic<int> cacheHits{ 0 };
+
+    // with keepFileRanges: name & start of events of each merged file, for end times
+    // that only become known after the files are merged (see ApplyEndTimes)
+    bool keepFileRanges = false;
+    std::vector<std::string> mergedNames;
+    std::vector<size_t> fileEventStarts;
+
+    BuildEventsMerger(BuildEvents& outEvents_, BuildNames& outNames_, const std::string& cacheDir_)
+    : outEvents(outEvents_), outNames(outNames_), cacheDir(cacheDir_)
+    {
+        outNames.Intern("", 0);
+    }
+
+    void ParseFile(JsonFileRange& file, size_t index)
+    {
+        // cache entry is keyed by the file name and the whole json text of the file; has
+        // to be computed before parsing, since that modifies the text
+        std::string cacheName, cachePath;
+        if (!cacheDir.empty())
+        {
+            char key[40];
+            // events of the same file are different with other filters
+            std::string nameKey = file.name + s_FiltersKey;
+            snprintf(key, sizeof(key), "%016llx%016llx",
+                (unsigned long long)HashName(nameKey.data(), nameKey.size()),
+                (unsigned long long)HashName(file.data, file.size));
+            cacheName = std::string(key) + kCacheExt;
+            cachePath = cacheDir + "/" + cacheName;
+        }
+
+        // everything needed while parsing one file (json DOM, events and names of the file)
+        // is allocated from an arena, and released in one go after merging into the result
+        Arena arena("parse");
+        BuildEvents fileEvents;
+        BuildNames fileNames;
+        bool ok = false;
+        {
+            ArenaScope scope(&arena);
+            if (!cachePath.empty() && LoadCachedFileEvents(cachePath, fileEvents, fileNames))
+            {
+                ++cacheHits;
+                ok = true;
+            }
+            else
+            {
+                ok = ParseFileJson(file.name, file.data, file.size, fileEvents, fileNames, unknownEventCount);
+                if (ok && !cachePath.empty())
+                    WriteCacheEntry(cachePath, fileEvents, fileNames);
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        mergeDone.wait(lock, [&]() { return nextToMerge == index; });
+        if (!ok)
+            failed = true;
+        if (!cacheDir.empty())
+            cacheNames.emplace_back(std::move(cacheName));
+        if (!failed)
+        {
+            timing::Scope timingScope(timing::kMergeFiles);
+            if (keepFileRanges)
+            {
+                mergedNames.push_back(file.name);
+                fileEventStarts.push_back(outEvents.size());
+            }
+            Merge(fileEvents, fileNames, file.endTime);
+        }
+        ++nextToMerge;
+        lock.unlock();
+        mergeDone.notify_all();
+    }
+
+    void Merge(const BuildEvents& fileEvents, const BuildNames& fileNames, int64_t endTime)
+    {
+        AppendBuildEvents(fileEvents, fileNames, outEvents, outNames, endTime);
+    }
+
+    // Moves events of already merged files onto the absolute timeline, the same way
+    // as AppendBuildEvents would have done with their end times.
+    void ApplyEndTimes(const std::unordered_map<std::string, int64_t>& endTimes)
+    {
+        if (endTimes.empty() || outEvents.empty())
+            return;
+        bool absolute = true;
+        for (size_t i = 0, n = mergedNames.size(); i != n; ++i)
+        {
+            size_t first = fileEventStarts[i];
+            size_t last = i + 1 != n ? fileEventStarts[i + 1] : outEvents.size();
+            if (first == last)
+                continue;
+            auto it = endTimes.find(mergedNames[i]);
+            if (it == endTimes.end())
+            {
+                absolute = false;
+                continue;
+            }
+            int64_t lastEnd = 0;
+            for (size_t e = first; e != last; ++e)
+                lastEnd = std::max(lastEnd, outEvents.ts[EventIndex(int(e))] + outEvents.durs[EventIndex(int(e))]);
+            int64_t tsOffset = it->second - lastEnd;
+            for (size_t e = first; e != last; ++e)
+                outEvents.ts[EventIndex(int(e))] += tsOffset;
+        }
+        outEvents.absoluteTimes = absolute;
+    }
+};
+
+// Removes cache entries that were not used by this run, i.e. of files that have changed
+// or are not part of the build anymore.
+void RemoveUnusedCacheEntries(const std::string& cacheDir, std::vector<std::string>& usedNames)
+{
+    std::sort(usedNames.begin(), usedNames.end());
+    cf_dir_t dir;
+    if (!cf_dir_open(&dir, cacheDir.c_str()))
+        return;
+    std::vector<std::string> unused;
+    while (dir.has_next)
+    {
+        cf_file_t file;
+        cf_read_file(&dir, &file);
+        if (!file.is_dir && cf_match_ext(&file, kCacheExt) && !std::binary_search(usedNames.begin(), usedNames.end(), std::string(file.name)))
+            unused.emplace_back(file.path);
+        cf_dir_next(&dir);
+    }
+    cf_dir_close(&dir);
+    for (const auto& path : unused)
+        remove(path.c_str());
+}
+
+static bool FinishMerge(BuildEventsMerger& merger, BuildEvents& outEvents, const std::string& cacheDir, std::vector<std::string>* outUsedCacheEntries)
+{
+    if (merger.unknownEventCount > kMaxUnknownEventWarnings)
+        printf("%sWARN: %i more unknown trace events skipped.%s\n", col::kYellow, merger.unknownEventCount - kMaxUnknownEventWarnings, col::kReset);
+    if (merger.failed)
+    {
+        outEvents.clear();
+        return false;
+    }
+    if (!cacheDir.empty())
+    {
+        printf("%s  %i of %i files loaded from cache.%s\n", col::kYellow, (int)merger.cacheHits, (int)merger.cacheNames.size(), col::kReset);
+        if (outUsedCacheEntries)
+            outUsedCacheEntries->insert(outUsedCacheEntries->end(), merger.cacheNames.begin(), merger.cacheNames.end());
+        else
+            RemoveUnusedCacheEntries(cacheDir, merger.cacheNames);
+    }
+    return true;
+}
+
+static bool ParseFiles(std::vector<JsonFileRange>& files, BuildEvents& outEvents, BuildNames& outNames, const std::string& cacheDir, std::vector<std::string>* outUsedCacheEntries)
+{
+    BuildEventsMerger merger(outEvents, outNames, cacheDir);
+    parallel::ForEach(files.size(), [&](size_t index) { merger.ParseFile(files[index], index); });
+    //DebugPrintEvents(outEvents, outNames);
+    return FinishMerge(merger, outEvents, cacheDir, outUsedCacheEntries);
+}
+
+void ParseBuildEvents(char* jsonText, size_t jsonSize, BuildEvents& outEvents, BuildNames& outNames, const std::string& cacheDir, std::vector<std::string>* outUsedCacheEntries)
+{
+    timing::Scope timingScope(timing::kParse);
+    std::vector<JsonFileRange> files;
+    if (!SplitFiles(jsonText, jsonSize, files))
+        return;
+    ParseFiles(files, outEvents, outNames, cacheDir, outUsedCacheEntries);
+}
+
+bool ParseBuildEventsShard(char* jsonText, size_t jsonSize, size_t shardIndex, size_t shardCount, BuildEvents& outEvents, BuildNames& outNames, const std::string& cacheDir, std::vector<std::string>* outUsedCacheEntries)
+{
+    timing::Scope timingScope(timing::kParse);
+    std::vector<JsonFileRange> files;
+    if (!SplitFiles(jsonText, jsonSize, files))
+        return false;
+    size_t begin = files.size() * shardIndex / shardCount;
+    size_t end = files.size() * (shardIndex + 1) / shardCount;
+    files.erase(files.begin() + end, files.end());
+    files.erase(files.begin(), files.begin() + begin);
+    return ParseFiles(files, outEvents, outNames, cacheDir, outUsedCacheEntries);
+}
+
+// file entries of a stream are parsed in batches of about this much json text
+static const size_t kStreamBatchSize = 64 * 1024 * 1024;
+
+void ParseBuildEventsStream(const std::function<bool(std::vector<char>&)>& readMore, BuildEvents& outEvents, BuildNames& outNames, const std::string& cacheDir, std::vector<std::string>* outUsedCacheEntries)
+{
+    timing::Scope timingScope(timing::kParse);
+    BuildEventsMerger merger(outEvents, outNames, cacheDir);
+    merger.keepFileRanges = true;
+    StreamSplitter splitter;
+
+    // each file entry is copied out of the stream buffer into a text of its own, for
+    // parsing on the worker threads
+    std::vector<JsonFileRange> batch;
+    std::vector<std::vector<char>> batchTexts;
+    size_t batchSize = 0;
+    size_t fileCount = 0;
+    auto parseBatch = [&]()
+    {
+        parallel::ForEach(batch.size(), [&](size_t index) { merger.ParseFile(batch[index], fileCount + index); });
+        fileCount += batch.size();
+        batch.clear();
+        batchTexts.clear();
+        batchSize = 0;
+    };
+
+    std::vector<char> buffer;
+    size_t pos = 0; // start of not yet split text in buffer
+    size_t bufferOffset = 0; // position of buffer start in the whole json
+    bool eof = false;
+    while (splitter.state != StreamSplitter::State::kDone && !merger.failed)
+    {
+        const char* p = buffer.data() + pos;
+        StreamSplitter::Step step = splitter.Next(p, buffer.data() + buffer.size(), eof, bufferOffset + pos);
+        size_t available = buffer.size() - pos;
+        pos = p - buffer.data();
+        if (step == StreamSplitter::Step::kError)
+            merger.failed = true;
+        else if (step == StreamSplitter::Step::kFile)
+        {
+            JsonFileRange file;
+            file.name = splitter.fileName;
+            batchTexts.emplace_back(splitter.fileData, splitter.fileData + splitter.fileSize);
+            file.data = batchTexts.back().data();
+            file.size = splitter.fileSize;
+            batch.emplace_back(std::move(file));
+            batchSize += splitter.fileSize;
+            if (batchSize >= kStreamBatchSize)
+                parseBatch();
+        }
+        else if (step == StreamSplitter::Step::kMore)
+        {
+            // drop the already split text, and read until there is twice as much as
+            // before, so that a big item is not scanned over and over again
+            buffer.erase(buffer.begin(), buffer.begin() + pos);
+            bufferOffset += pos;
+            pos = 0;
+            timing::Scope readScope(timing::kReadFiles);
+            while (!eof && buffer.size() < available * 2 + 1)
+                eof = !readMore(buffer);
+        }
+    }
+    if (!merger.failed)
+    {
+        parseBatch();
+        if (!splitter.foundFiles)
+        {
+            printf("%sERROR: 'files' of JSON should be an object.%s\n", col::kRed, col::kReset);
+            merger.failed = true;
+        }
+    }
+    if (!merger.failed)
+        merger.ApplyEndTimes(splitter.endTimes);
+    FinishMerge(merger, outEvents, cacheDir, outUsedCacheEntries);
+}
+
+
+// Binary file layout (all little endian, each section starts at 8 byte alignment):
+// - BinaryHeader
+// - event types: uint8_t[eventCount]
+// - event start times: int64_t[eventCount]
+// - event durations: int64_t[eventCount]
+// - event detail indices: int32_t[eventCount]
+// - event parent indices: int32_t[eventCount]
+// - child list offsets: uint32_t[eventCount+1]
+// - child event indices: int32_t[childCount]
+// - name offsets: uint64_t[nameCount+1]
+// - name data, each name zero terminated: char[nameDataSize]
+static const char kBinaryMagic[8] = {'C','B','A','E','V','N','T','S'};
+static const uint32_t kBinaryVersion = 1;
+static const uint32_t kBinaryFlagAbsoluteTimes = 1; // BuildEvents::absoluteTimes
+
+struct BinaryHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags; // was always zero in older files
+    uint64_t eventCount;
+    uint64_t childCount;
+    uint64_t nameCount;
+    uint64_t nameDataSize;
+};
+
+static size_t AlignedSize(size_t size)
+{
+    return (size + 7) & ~size_t(7);
+}
+
+template<typename T>
+static bool WriteSection(FILE* f, const std::vector<T>& data)
+{
+    static const char kZeros[8] = {};
+    size_t size = data.size() * sizeof(T);
+    if (size != 0 && fwrite(data.data(), 1, size, f) != size)
+        return false;
+    size_t padding = AlignedSize(size) - size;
+    return fwrite(kZeros, 1, padding, f) == padding;
+}
+
+bool SaveBuildEventsBinary(const std::string& path, const BuildEvents& events, const BuildNames& names)
+{
+    BinaryHeader header;
+    memcpy(header.magic, kBinaryMagic, sizeof(header.magic));
+    header.version = kBinaryVersion;
+    header.flags = events.absoluteTimes ? kBinaryFlagAbsoluteTimes : 0;
+    header.eventCount = events.size();
+    header.childCount = events.children.size();
+    header.nameCount = names.size();
+    header.nameDataSize = names.GetData().size();
+
+    // event columns are stored in memory the same way as in the file
+    static_assert(sizeof(BuildEventType) == 1 && sizeof(DetailIndex) == 4 && sizeof(EventIndex) == 4, "unexpected event column sizes");
+
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(&header, 1, sizeof(header), f) == sizeof(header);
+    ok = ok && WriteSection(f, events.types);
+    ok = ok && WriteSection(f, events.ts);
+    ok = ok && WriteSection(f, events.durs);
+    ok = ok && WriteSection(f, events.details);
+    ok = ok && WriteSection(f, events.parents);
+    ok = ok && WriteSection(f, events.childOffsets);
+    ok = ok && WriteSection(f, events.children);
+    ok = ok && WriteSection(f, names.GetOffsets());
+    ok = ok && WriteSection(f, names.GetData());
+    if (fclose(f) != 0)
+        ok = false;
+    return ok;
+}
+
+bool IsBuildEventsBinary(const char* data, size_t size)
+{
+    return size >= sizeof(BinaryHeader) && memcmp(data, kBinaryMagic, sizeof(kBinaryMagic)) == 0;
+}
+
+struct BinaryReader
+{
+    const char* cur;
+    const char* end;
+
+    template<typename T>
+    const T* Section(uint64_t count)
+    {
+        // checked by division first, so that a huge count can't wrap around
+        if (count > uint64_t(end - cur) / sizeof(T))
+            return nullptr;
+        size_t size = AlignedSize(size_t(count * sizeof(T)));
+        if (size_t(end - cur) < size)
+            return nullptr;
+        const T* res = (const T*)cur;
+        cur += size;
+        return res;
+    }
+};
+
+// Everything the events and names get indexed with is checked, so that a damaged file
+// is reported instead of crashing later: name offsets, event types and detail indices,
+// and that parents & child lists form a tree where each event is reached once.
+static bool IsValidBinaryEvents(const BinaryHeader& header, const BuildEventType* types, const DetailIndex* details, const EventIndex* parents,
+    const uint32_t* childOffsets, const EventIndex* children, const uint64_t* nameOffsets, const char* nameData)
+{
+    const size_t n = (size_t)header.eventCount;
+    const size_t nameCount = (size_t)header.nameCount;
+    if (nameOffsets[nameCount] != header.nameDataSize || childOffsets[0] != 0 || childOffsets[n] != header.childCount)
+        return false;
+    for (size_t i = 0; i != nameCount; ++i)
+    {
+        // each name is zero terminated
+        if (nameOffsets[i] >= nameOffsets[i + 1] || nameOffsets[i + 1] > header.nameDataSize || nameData[nameOffsets[i + 1] - 1] != 0)
+            return false;
+    }
+    for (size_t i = 0; i != n; ++i)
+    {
+        if ((int)types[i] >= kBuildEventTypeCount || details[i].idx < 0 || size_t(details[i].idx) >= nameCount || childOffsets[i] > childOffsets[i + 1])
+            return false;
+        if (parents[i].idx < -1 || parents[i].idx >= (int)n)
+            return false;
+    }
+
+    // walk down from the root events; events in a parent cycle never get reached
+    std::vector<uint8_t> reached(n);
+    std::vector<int> stack;
+    for (size_t i = 0; i != n; ++i)
+    {
+        if (parents[i].idx != -1)
+            continue;
+        reached[i] = 1;
+        stack.push_back(int(i));
+        while (!stack.empty())
+        {
+            int ev = stack.back();
+            stack.pop_back();
+            for (uint32_t c = childOffsets[ev], cEnd = childOffsets[ev + 1]; c != cEnd; ++c)
+            {
+                int child = children[c].idx;
+                if (child < 0 || child >= (int)n || reached[child] || parents[child].idx != ev)
+                    return false;
+                reached[child] = 1;
+                stack.push_back(child);
+            }
+        }
+    }
+    return std::find(reached.begin(), reached.end(), 0) == reached.end();
+}
+
+// Returns the error, or null when loaded; nothing is loaded into outEvents/outNames
+// when the file is not valid. All of the data is checked first, and then copied out of
+// the file, so the file does not have to stay around afterwards.
+static const char* ReadBuildEventsBinary(const char* data, size_t size, BuildEvents& outEvents, BuildNames& outNames)
+{
+    if (!IsBuildEventsBinary(data, size))
+        return "not a binary build events file";
+    const BinaryHeader& header = *(const BinaryHeader*)data;
+    if (header.version != kBinaryVersion)
+        return "unsupported binary build events file version";
+    // event and name indices are ints
+    if (header.eventCount >= INT_MAX || header.childCount >= INT_MAX || header.nameCount >= INT_MAX)
+        return "binary build events file is corrupt";
+
+    BinaryReader reader = { data + sizeof(BinaryHeader), data + size };
+    const size_t n = (size_t)header.eventCount;
+    const BuildEventType* types = reader.Section<BuildEventType>(n);
+    const int64_t* ts = reader.Section<int64_t>(n);
+    const int64_t* dur = reader.Section<int64_t>(n);
+    const DetailIndex* details = reader.Section<DetailIndex>(n);
+    const EventIndex* parents = reader.Section<EventIndex>(n);
+    const uint32_t* childOffsets = reader.Section<uint32_t>(n + 1);
+    const EventIndex* children = reader.Section<EventIndex>(header.childCount);
+    const uint64_t* nameOffsets = reader.Section<uint64_t>(header.nameCount + 1);
+    const char* nameData = reader.Section<char>(header.nameDataSize);
+    if (!types || !ts || !dur || !details || !parents || !childOffsets || !children || !nameOffsets || !nameData)
+        return "binary build events file is truncated";
+    if (!IsValidBinaryEvents(header, types, details, parents, childOffsets, children, nameOffsets, nameData))
+        return "binary build events file is corrupt";
+
+    outEvents.types.assign(types, types + n);
+    outEvents.ts.assign(ts, ts + n);
+    outEvents.durs.assign(dur, dur + n);
+    outEvents.details.assign(details, details + n);
+    outEvents.parents.assign(parents, parents + n);
+    outEvents.childOffsets.assign(childOffsets, childOffsets + n + 1);
+    outEvents.children.assign(children, children + header.childCount);
+    for (auto& list : outEvents.eventsOfType)
+        list.clear();
+    for (size_t i = 0; i != n; ++i)
+        outEvents.eventsOfType[(int)types[i]].push_back(EventIndex(int(i)));
+    // paths are not stored in the file, since they are quick to find
+    outEvents.FindPaths();
+    outEvents.absoluteTimes = (header.flags & kBinaryFlagAbsoluteTimes) != 0;
+    outNames.Assign(nameData, (size_t)header.nameDataSize, nameOffsets, (size_t)header.nameCount);
+    return nullptr;
+}
+
+bool LoadBuildEventsBinary(const char* data, size_t size, BuildEvents& outEvents, BuildNames& outNames)
+{
+    timing::Scope timingScope(timing::kLoadBinary);
+    if (IsBuildEventsBinary(data, size) && ((const BinaryHeader*)data)->version != kBinaryVersion)
+    {
+        printf("%sERROR: unsupported binary build events file version %u (expected %u).%s\n", col::kRed, ((const BinaryHeader*)data)->version, kBinaryVersion, col::kReset);
+        return false;
+    }
+    const char* error = ReadBuildEventsBinary(data, size, outEvents, outNames);
+    if (error)
+    {
+        printf("%sERROR: %s.%s\n", col::kRed, error, col::kReset);
+        return false;
+    }
+    return true;
+}
+
+// Cache entries are regular binary files; ones written by another version (or damaged
+// in some way) are silently ignored, and the file is parsed again.
+static bool LoadCachedFileEvents(const std::string& path, BuildEvents& outEvents, BuildNames& outNames)
+{
+    MappedFile mapped;
+    if (!mapped.Open(path.c_str()) || !IsBuildEventsBinary(mapped.GetData(), mapped.GetSize()))
+        return false;
+    timing::Count(timing::kFilesRead);
+    timing::Count(timing::kBytesRead, mapped.GetSize());
+    timing::Scope timingScope(timing::kLoadBinary);
+    return ReadBuildEventsBinary(mapped.GetData(), mapped.GetSize(), outEvents, outNames) == nullptr;
 }
@@ -1,12 +1,13 @@
 // Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
 // SPDX-License-Identifier: Unlicense
 #pragma once
+#include <functional>
 #include <stdint.h>
 #include <string>
 #include <vector>
 #include <utility>
 
-enum class BuildEventType
+enum class BuildEventType : uint8_t
 {
     kUnknown,
     kCompiler,
@@ -19,7 +20,9 @@ enum class BuildEventType
     kInstantiateFunction,
     kOptModule,
     kOptFunction,
+    kCount
 };
+static const int kBuildEventTypeCount = (int)BuildEventType::kCount;
 
 struct DetailIndex
 {
@@ -63,6 +66,7 @@ namespace std
     };
 }
 
+// Values of one event; BuildEvents does not store these as-is, but returns them from operator[].
 struct BuildEvent
 {
     BuildEventType type = BuildEventType::kUnknown;
@@ -70,7 +74,6 @@ struct BuildEvent
     int64_t dur = 0;
     DetailIndex detailIndex;
     EventIndex parent{ -1 };
-    std::vector<EventIndex> children;
 };
 
 template <typename T, typename Idx>
@@ -80,7 +83,171 @@ struct IndexedVector : std::vector<T>
     typename std::vector<T>::reference       operator[](Idx pos) { return this->begin()[pos.idx]; }
     typename std::vector<T>::const_reference operator[](Idx pos) const { return this->begin()[pos.idx]; }
 };
-typedef IndexedVector<std::string, DetailIndex> BuildNames;
-typedef IndexedVector<BuildEvent, EventIndex> BuildEvents;
 
-void ParseBuildEvents(std::string& jsonText, BuildEvents& outEvents, BuildNames& outNames);
+// Interned detail names (file paths, template & function names). Each name is stored
+// once, zero terminated, in one contiguous blob; name i is at [offsets[i], offsets[i+1]-1).
+// Lookups hash the name bytes directly, so no temporary strings are needed.
+class BuildNames
+{
+public:
+    // index of an existing equal name, or adds a new one
+    DetailIndex Intern(const char* str, size_t len);
+    DetailIndex Intern(const std::string& str) { return Intern(str.data(), str.size()); }
+
+    size_t size() const { return m_Offsets.size() - 1; }
+    bool empty() const { return size() == 0; }
+    void clear();
+    void reserve(size_t count);
+
+    // pointer is valid until a new name is added
+    const char* GetName(DetailIndex pos) const { return m_Data.data() + m_Offsets[pos.idx]; }
+    size_t GetLength(DetailIndex pos) const { return size_t(m_Offsets[pos.idx + 1] - m_Offsets[pos.idx] - 1); }
+    std::string operator[](DetailIndex pos) const { return std::string(GetName(pos), GetLength(pos)); }
+
+    const std::vector<char>& GetData() const { return m_Data; }
+    const std::vector<uint64_t>& GetOffsets() const { return m_Offsets; }
+    // takes already laid out names (e.g. from binary file); hash table is built on first Intern
+    void Assign(const char* data, size_t dataSize, const uint64_t* offsets, size_t count);
+
+private:
+    void Rehash(size_t slotCount);
+    DetailIndex Find(const char* str, size_t len, uint64_t hash, size_t& slot) const;
+
+    std::vector<char> m_Data;
+    std::vector<uint64_t> m_Offsets = { 0 };
+    std::vector<uint64_t> m_Hashes; // for each name; can be shorter than names until hashed
+    std::vector<int> m_Slots; // open addressing table of name indices, -1 for empty
+};
+
+struct EventIndexRange
+{
+    const EventIndex* first;
+    const EventIndex* last;
+    const EventIndex* begin() const { return first; }
+    const EventIndex* end() const { return last; }
+    size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+};
+
+// All the build events, stored as a separate array for each field, since most of
+// the analysis only looks at a field or two of each event. Children of all events are
+// in one array, with each event's children at [childOffsets[i], childOffsets[i+1]).
+struct BuildEvents
+{
+    IndexedVector<BuildEventType, EventIndex> types;
+    IndexedVector<int64_t, EventIndex> ts;
+    IndexedVector<int64_t, EventIndex> durs;
+    IndexedVector<DetailIndex, EventIndex> details;
+    IndexedVector<EventIndex, EventIndex> parents;
+    std::vector<uint32_t> childOffsets = { 0 };
+    std::vector<EventIndex> children;
+
+    // compile unit path of each event: detail of the closest Compiler, Frontend, Backend
+    // or OptModule event (that has a detail) up the parent chain, including the event itself
+    IndexedVector<DetailIndex, EventIndex> paths;
+    // indices of events of each type, in increasing order
+    std::vector<EventIndex> eventsOfType[kBuildEventTypeCount];
+    // event times are microseconds since the Unix epoch, i.e. compiles of all the files are
+    // on one timeline; otherwise times of each file start from wherever its trace started
+    bool absoluteTimes = false;
+
+    size_t size() const { return types.size(); }
+    bool empty() const { return types.empty(); }
+    void clear();
+    void reserve(size_t n);
+
+    // new event has no children, and no path until FindPaths is called
+    void push_back(const BuildEvent& ev);
+    // fills paths once all the parents are known
+    void FindPaths();
+
+    const std::vector<EventIndex>& OfType(BuildEventType type) const { return eventsOfType[(int)type]; }
+
+    BuildEvent operator[](EventIndex pos) const
+    {
+        BuildEvent ev;
+        ev.type = types[pos];
+        ev.ts = ts[pos];
+        ev.dur = durs[pos];
+        ev.detailIndex = details[pos];
+        ev.parent = parents[pos];
+        return ev;
+    }
+    EventIndexRange GetChildren(EventIndex pos) const
+    {
+        const EventIndex* base = children.data();
+        return EventIndexRange{ base + childOffsets[pos.idx], base + childOffsets[pos.idx + 1] };
+    }
+};
+
+// Which events parsing of json traces keeps. Filtered out events are dropped right when
+// they are read, before their names are interned or they are stored, so they cost no
+// memory. Compiler events (one for each compiled file) are always kept.
+struct ParseFilters
+{
+    bool typeEnabled[kBuildEventTypeCount];
+    int64_t minDurations[kBuildEventTypeCount]; // microseconds
+    // globs ('*' matches anything, '?' any one character) of compiled file names, as they are
+    // named in the capture; with includes, only files matching one of them are parsed
+    std::vector<std::string> includeFiles;
+    std::vector<std::string> excludeFiles;
+
+    ParseFilters();
+    bool IsDefault() const;
+    bool AcceptsFile(const std::string& name) const;
+    bool AcceptsEvent(BuildEventType type, int64_t dur) const { return typeEnabled[(int)type] && dur >= minDurations[(int)type]; }
+
+    // Comma separated lists, e.g. "Source, InstantiateClass" (event names as in the traces)
+    // and "OptFunction:0.5, Source:2" (type and milliseconds); print an error and return
+    // false on unknown event names.
+    bool SetEnabledTypes(const std::string& list);
+    bool SetMinTimes(const std::string& list);
+    static std::vector<std::string> SplitList(const std::string& list);
+
+    // text form of the settings, to tell apart cache entries of differently filtered files
+    std::string GetKey() const;
+};
+
+// Filters used by all json parsing from now on; by default everything is kept.
+void SetParseFilters(const ParseFilters& filters);
+const ParseFilters& GetParseFilters();
+
+// Parses the big json file produced by --stop. Json text is modified in place
+// during parsing (can be e.g. a copy-on-write file mapping).
+//
+// With a cache directory, parsed events of each compiled file are stored there as
+// binary files, and later runs load them instead of parsing the json of files whose
+// trace did not change. Cache entries not used by this run are removed, unless
+// outUsedCacheEntries is given: then the used ones are added to it, for a later
+// RemoveUnusedCacheEntries call (e.g. when several captures share the cache).
+void ParseBuildEvents(char* jsonText, size_t jsonSize, BuildEvents& outEvents, BuildNames& outNames, const std::string& cacheDir = "", std::vector<std::string>* outUsedCacheEntries = nullptr);
+void RemoveUnusedCacheEntries(const std::string& cacheDir, std::vector<std::string>& usedNames);
+
+// Same as ParseBuildEvents, for only a part of the files of the big json file: the
+// shardIndex-th one of shardCount about equally long runs of consecutive files. Returns
+// false on errors; a shard can have no files (or events) at all. The cache works the same
+// way too; shards sharing one should pass outUsedCacheEntries, so that entries of files of
+// the other shards are not removed.
+bool ParseBuildEventsShard(char* jsonText, size_t jsonSize, size_t shardIndex, size_t shardCount, BuildEvents& outEvents, BuildNames& outNames, const std::string& cacheDir = "", std::vector<std::string>* outUsedCacheEntries = nullptr);
+
+// Same as ParseBuildEvents, for the big json file that comes in pieces, e.g. as it is being
+// decompressed: readMore appends the next piece to the given buffer, and returns false at
+// the end of the data. Only the files being parsed are in memory at once, not the whole text.
+void ParseBuildEventsStream(const std::function<bool(std::vector<char>&)>& readMore, BuildEvents& outEvents, BuildNames& outNames, const std::string& cacheDir = "", std::vector<std::string>* outUsedCacheEntries = nullptr);
+
+// Parses -ftime-trace json of one compiled file, i.e. one entry of the big json file;
+// json text is modified in place. fileName is how the file is named in the results.
+bool ParseTraceFile(const std::string& fileName, char* jsonText, size_t jsonSize, BuildEvents& outEvents, BuildNames& outNames);
+
+// Appends events & names of one compiled file to the result, the same way as parsing
+// the big json file does for each of its entries. With endTime of the compile (microseconds
+// since the Unix epoch, e.g. trace file modification time), event times are moved onto the
+// absolute timeline; the result has absoluteTimes only if all appended files had an endTime.
+void AppendBuildEvents(const BuildEvents& events, const BuildNames& names, BuildEvents& outEvents, BuildNames& outNames, int64_t endTime = -1);
+
+// Compact binary form of already parsed events & names; loading it needs no json parsing,
+// but it is not used in place: the data is validated in one pass over all events, and
+// then copied into the BuildEvents/BuildNames (per-type lists & paths are rebuilt).
+bool SaveBuildEventsBinary(const std::string& path, const BuildEvents& events, const BuildNames& names);
+bool IsBuildEventsBinary(const char* data, size_t size);
+bool LoadBuildEventsBinary(const char* data, size_t size, BuildEvents& outEvents, BuildNames& outNames);
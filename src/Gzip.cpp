@@ -0,0 +1,679 @@
+// Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
+// SPDX-License-Identifier: Unlicense
+#include "Gzip.h"
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <string.h>
+
+// Deflate format is described in RFC 1951, and gzip wrapper around it in RFC 1952.
+
+static const size_t kWindowSize = 32 * 1024;
+
+static const uint16_t kLengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t kLengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t kDistBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t kDistExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t kCodeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+struct CrcTable
+{
+    uint32_t values[256];
+    CrcTable()
+    {
+        for (uint32_t i = 0; i != 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k != 8; ++k)
+                c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+            values[i] = c;
+        }
+    }
+};
+static const CrcTable s_CrcTable;
+
+static uint32_t UpdateCrc(uint32_t crc, const void* data, size_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+    for (size_t i = 0; i != size; ++i)
+        crc = s_CrcTable.values[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t ReverseBits(uint32_t code, int count)
+{
+    uint32_t res = 0;
+    for (int i = 0; i != count; ++i, code >>= 1)
+        res = (res << 1) | (code & 1);
+    return res;
+}
+
+bool IsGzipData(const char* data, size_t size)
+{
+    return size >= 2 && (uint8_t)data[0] == 0x1F && (uint8_t)data[1] == 0x8B;
+}
+
+
+GzipReader::GzipReader(const char* data, size_t size)
+: m_In((const uint8_t*)data), m_InEnd((const uint8_t*)data + size)
+{
+}
+
+void GzipReader::Refill()
+{
+    while (m_BitCount <= 56)
+    {
+        uint64_t byte = 0;
+        if (m_In != m_InEnd)
+            byte = *m_In++;
+        else
+            ++m_Overrun;
+        m_Bits |= byte << m_BitCount;
+        m_BitCount += 8;
+    }
+}
+
+uint32_t GzipReader::GetBits(int count)
+{
+    if (m_BitCount < count)
+        Refill();
+    uint32_t value = uint32_t(m_Bits & ((1ull << count) - 1));
+    m_Bits >>= count;
+    m_BitCount -= count;
+    return value;
+}
+
+int GzipReader::Decode(const Huffman& h)
+{
+    if (m_BitCount < 15)
+        Refill();
+    if (h.bits == 0)
+        return -1;
+    uint16_t entry = h.table[m_Bits & ((1u << h.bits) - 1)];
+    int length = entry & 15;
+    if (length == 0)
+        return -1;
+    m_Bits >>= length;
+    m_BitCount -= length;
+    return entry >> 4;
+}
+
+bool GzipReader::Huffman::Build(const uint8_t* lengths, int count)
+{
+    int counts[16] = {};
+    for (int i = 0; i != count; ++i)
+        ++counts[lengths[i]];
+    counts[0] = 0;
+    bits = 0;
+    int left = 1;
+    for (int len = 1; len != 16; ++len)
+    {
+        if (counts[len])
+            bits = len;
+        left = (left << 1) - counts[len];
+        if (left < 0)
+            return false; // over-subscribed
+    }
+    table.assign(bits ? size_t(1) << bits : 0, 0);
+
+    int next[16];
+    int code = 0;
+    for (int len = 1; len != 16; ++len)
+    {
+        code = (code + counts[len - 1]) << 1;
+        next[len] = code;
+    }
+    for (int sym = 0; sym != count; ++sym)
+    {
+        int len = lengths[sym];
+        if (len == 0)
+            continue;
+        for (size_t idx = ReverseBits(next[len]++, len); idx < table.size(); idx += size_t(1) << len)
+            table[idx] = uint16_t((sym << 4) | len);
+    }
+    return true;
+}
+
+bool GzipReader::ReadHeader()
+{
+    if (GetBits(8) != 0x1F || GetBits(8) != 0x8B || GetBits(8) != 8)
+        return false;
+    uint32_t flags = GetBits(8);
+    GetBits(32); // modification time
+    GetBits(16); // extra flags, OS
+    if (flags & 4)
+    {
+        uint32_t extraSize = GetBits(16);
+        for (uint32_t i = 0; i != extraSize; ++i)
+            GetBits(8);
+    }
+    for (uint32_t zeroTerminated : { 8u, 16u }) // file name, comment
+    {
+        if (flags & zeroTerminated)
+            while (GetBits(8) != 0 && m_BitCount >= int(m_Overrun * 8))
+                ;
+    }
+    if (flags & 2)
+        GetBits(16); // header crc
+    return m_BitCount >= int(m_Overrun * 8);
+}
+
+bool GzipReader::ReadTrailer()
+{
+    GetBits(m_BitCount & 7);
+    uint32_t crc = GetBits(32);
+    uint32_t size = GetBits(32);
+    return m_BitCount >= int(m_Overrun * 8) && crc == m_Crc && size == m_Size;
+}
+
+bool GzipReader::InflateStored()
+{
+    GetBits(m_BitCount & 7);
+    uint32_t length = GetBits(16);
+    uint32_t invLength = GetBits(16);
+    if (length != (~invLength & 0xFFFF))
+        return false;
+    for (uint32_t i = 0; i != length; ++i)
+        m_Window.push_back(char(GetBits(8)));
+    return true;
+}
+
+bool GzipReader::ReadDynamicTables(Huffman& lengths, Huffman& dists)
+{
+    int lengthCount = GetBits(5) + 257;
+    int distCount = GetBits(5) + 1;
+    int codeLengthCount = GetBits(4) + 4;
+    if (lengthCount > 286 || distCount > 30)
+        return false;
+    uint8_t codeLengths[19] = {};
+    for (int i = 0; i != codeLengthCount; ++i)
+        codeLengths[kCodeLengthOrder[i]] = uint8_t(GetBits(3));
+    Huffman codeLengthCodes;
+    if (!codeLengthCodes.Build(codeLengths, 19))
+        return false;
+
+    uint8_t lens[286 + 30];
+    int n = 0;
+    const int total = lengthCount + distCount;
+    while (n < total)
+    {
+        int sym = Decode(codeLengthCodes);
+        if (sym < 0)
+            return false;
+        if (sym < 16)
+        {
+            lens[n++] = uint8_t(sym);
+            continue;
+        }
+        uint8_t value = 0;
+        int repeat;
+        if (sym == 16)
+        {
+            if (n == 0)
+                return false;
+            value = lens[n - 1];
+            repeat = 3 + GetBits(2);
+        }
+        else if (sym == 17)
+            repeat = 3 + GetBits(3);
+        else
+            repeat = 11 + GetBits(7);
+        if (n + repeat > total)
+            return false;
+        while (repeat--)
+            lens[n++] = value;
+    }
+    if (lens[256] == 0)
+        return false; // no end of block code
+    return lengths.Build(lens, lengthCount) && dists.Build(lens + lengthCount, distCount);
+}
+
+bool GzipReader::InflateCodes(const Huffman& lengths, const Huffman& dists)
+{
+    while (m_BitCount >= int(m_Overrun * 8))
+    {
+        int sym = Decode(lengths);
+        if (sym < 0)
+            return false;
+        if (sym < 256)
+        {
+            m_Window.push_back(char(sym));
+            continue;
+        }
+        if (sym == 256)
+            return true;
+        sym -= 257;
+        if (sym >= 29)
+            return false;
+        int length = kLengthBase[sym] + GetBits(kLengthExtra[sym]);
+        int distSym = Decode(dists);
+        if (distSym < 0 || distSym >= 30)
+            return false;
+        size_t dist = kDistBase[distSym] + GetBits(kDistExtra[distSym]);
+        if (dist > m_Window.size())
+            return false;
+        size_t from = m_Window.size() - dist;
+        for (int i = 0; i != length; ++i)
+        {
+            char c = m_Window[from + i];
+            m_Window.push_back(c);
+        }
+    }
+    return false;
+}
+
+bool GzipReader::InflateBlock()
+{
+    struct FixedCodes
+    {
+        Huffman lengths, dists;
+        FixedCodes()
+        {
+            uint8_t lens[288];
+            for (int i = 0; i != 288; ++i)
+                lens[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+            lengths.Build(lens, 288);
+            uint8_t distLens[30];
+            memset(distLens, 5, sizeof(distLens));
+            dists.Build(distLens, 30);
+        }
+    };
+    static const FixedCodes s_Fixed;
+
+    m_LastBlock = GetBits(1) != 0;
+    switch (GetBits(2))
+    {
+    case 0:
+        return InflateStored();
+    case 1:
+        return InflateCodes(s_Fixed.lengths, s_Fixed.dists);
+    case 2:
+    {
+        Huffman lengths, dists;
+        return ReadDynamicTables(lengths, dists) && InflateCodes(lengths, dists);
+    }
+    default:
+        return false;
+    }
+}
+
+bool GzipReader::Read(std::vector<char>& out)
+{
+    if (m_Failed)
+        return false;
+    if (!m_InMember)
+    {
+        // end of input after a member ends the stream
+        if (m_In == m_InEnd && m_BitCount <= int(m_Overrun * 8))
+            return false;
+        if (!ReadHeader())
+        {
+            m_Failed = true;
+            return false;
+        }
+        m_InMember = true;
+        m_LastBlock = false;
+        m_Crc = 0;
+        m_Size = 0;
+        m_Window.clear();
+    }
+
+    size_t start = m_Window.size();
+    if (!InflateBlock() || m_BitCount < int(m_Overrun * 8))
+    {
+        m_Failed = true;
+        return false;
+    }
+    out.insert(out.end(), m_Window.begin() + start, m_Window.end());
+    m_Crc = UpdateCrc(m_Crc, m_Window.data() + start, m_Window.size() - start);
+    m_Size += uint32_t(m_Window.size() - start);
+    if (m_Window.size() > 2 * kWindowSize)
+        m_Window.erase(m_Window.begin(), m_Window.end() - kWindowSize);
+
+    if (m_LastBlock)
+    {
+        if (!ReadTrailer())
+        {
+            m_Failed = true;
+            return false;
+        }
+        m_InMember = false;
+    }
+    return true;
+}
+
+bool GzipReader::ReadAll(std::vector<char>& out)
+{
+    out.clear();
+    while (Read(out))
+        ;
+    return !m_Failed;
+}
+
+
+static const int kHashBits = 15;
+static const size_t kBlockSize = 128 * 1024;
+static const int kMinMatch = 3;
+static const int kMaxMatch = 258;
+static const int kMaxChain = 32;
+
+// Code lengths of a Huffman code of the given symbol frequencies, no longer than maxBits;
+// when they would be, frequencies are flattened until they are not. There are always at
+// least two codes, since some decoders don't like codes with just one.
+static void BuildCodeLengths(const uint32_t* freqs, int count, int maxBits, uint8_t* lengths)
+{
+    memset(lengths, 0, count);
+    std::vector<int> used;
+    for (int i = 0; i != count; ++i)
+        if (freqs[i])
+            used.push_back(i);
+    if (used.size() < 2)
+    {
+        int sym = used.empty() ? 0 : used[0];
+        lengths[sym] = 1;
+        lengths[sym == 0 ? 1 : 0] = 1;
+        return;
+    }
+
+    std::vector<uint64_t> f(freqs, freqs + count);
+    const int n = (int)used.size();
+    while (true)
+    {
+        typedef std::pair<uint64_t, int> Node; // weight, node index (leaves first)
+        std::priority_queue<Node, std::vector<Node>, std::greater<Node>> queue;
+        std::vector<int> parent(2 * n - 1, -1);
+        for (int k = 0; k != n; ++k)
+            queue.push(Node(f[used[k]], k));
+        for (int next = n; queue.size() > 1; ++next)
+        {
+            Node a = queue.top();
+            queue.pop();
+            Node b = queue.top();
+            queue.pop();
+            parent[a.second] = parent[b.second] = next;
+            queue.push(Node(a.first + b.first, next));
+        }
+        int maxLength = 0;
+        for (int k = 0; k != n; ++k)
+        {
+            int length = 0;
+            for (int p = k; parent[p] >= 0; p = parent[p])
+                ++length;
+            lengths[used[k]] = uint8_t(length);
+            maxLength = std::max(maxLength, length);
+        }
+        if (maxLength <= maxBits)
+            return;
+        for (int sym : used)
+            f[sym] = (f[sym] + 1) / 2;
+    }
+}
+
+// canonical codes of the lengths, bit reversed since deflate writes them starting from the top bit
+static void BuildCodes(const uint8_t* lengths, int count, uint16_t* codes)
+{
+    int counts[16] = {};
+    for (int i = 0; i != count; ++i)
+        ++counts[lengths[i]];
+    counts[0] = 0;
+    int next[16];
+    int code = 0;
+    for (int len = 1; len != 16; ++len)
+    {
+        code = (code + counts[len - 1]) << 1;
+        next[len] = code;
+    }
+    for (int sym = 0; sym != count; ++sym)
+        codes[sym] = lengths[sym] ? uint16_t(ReverseBits(next[lengths[sym]]++, lengths[sym])) : 0;
+}
+
+static int LengthCode(int length)
+{
+    int code = 28;
+    while (kLengthBase[code] > length)
+        --code;
+    return code;
+}
+
+static int DistCode(int dist)
+{
+    int code = 29;
+    while (kDistBase[code] > dist)
+        --code;
+    return code;
+}
+
+GzipWriter::GzipWriter(FILE* file)
+: m_File(file)
+{
+    m_Head.assign(size_t(1) << kHashBits, -1);
+    m_Prev.assign(kWindowSize, -1);
+    static const uint8_t kHeader[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+    m_Out.assign(kHeader, kHeader + sizeof(kHeader));
+}
+
+void GzipWriter::PutBits(uint32_t value, int count)
+{
+    m_Bits |= uint64_t(value) << m_BitCount;
+    m_BitCount += count;
+    while (m_BitCount >= 8)
+    {
+        m_Out.push_back(uint8_t(m_Bits));
+        m_Bits >>= 8;
+        m_BitCount -= 8;
+    }
+}
+
+void GzipWriter::FlushOutput()
+{
+    if (!m_Out.empty() && fwrite(m_Out.data(), 1, m_Out.size(), m_File) != m_Out.size())
+        m_Error = true;
+    m_Out.clear();
+}
+
+void GzipWriter::CompressBlock(size_t size, bool last)
+{
+    // find matches with earlier data, greedily taking the longest one at each position
+    struct Symbol
+    {
+        uint16_t litLength; // literal byte, or match length when dist is not zero
+        uint16_t dist;
+    };
+    std::vector<Symbol> symbols;
+    symbols.reserve(size);
+    uint32_t litFreqs[286] = {};
+    uint32_t distFreqs[30] = {};
+    const uint8_t* data = m_Data.data();
+    auto hashAt = [&](size_t i) { return ((uint32_t(data[i]) << 16) | (uint32_t(data[i + 1]) << 8) | data[i + 2]) * 2654435761u >> (32 - kHashBits); };
+    auto insert = [&](size_t i)
+    {
+        if (i + 2 >= m_Data.size())
+            return;
+        uint32_t h = hashAt(i);
+        int64_t pos = m_DataStart + int64_t(i);
+        m_Prev[size_t(pos) & (kWindowSize - 1)] = m_Head[h];
+        m_Head[h] = pos;
+    };
+    const size_t end = m_Pending + size;
+    for (size_t i = m_Pending; i < end; )
+    {
+        size_t bestLength = 0, bestDist = 0;
+        if (i + kMinMatch <= end)
+        {
+            const int64_t pos = m_DataStart + int64_t(i);
+            const size_t maxLength = std::min<size_t>(kMaxMatch, end - i);
+            int64_t cand = m_Head[hashAt(i)];
+            for (int chain = 0; chain != kMaxChain && cand >= m_DataStart && pos - cand <= int64_t(kWindowSize); ++chain)
+            {
+                const uint8_t* a = data + i;
+                const uint8_t* b = data + size_t(cand - m_DataStart);
+                if (a[bestLength] == b[bestLength])
+                {
+                    size_t length = 0;
+                    while (length < maxLength && a[length] == b[length])
+                        ++length;
+                    if (length > bestLength)
+                    {
+                        bestLength = length;
+                        bestDist = size_t(pos - cand);
+                        if (length == maxLength)
+                            break;
+                    }
+                }
+                int64_t prev = m_Prev[size_t(cand) & (kWindowSize - 1)];
+                if (prev >= cand)
+                    break;
+                cand = prev;
+            }
+        }
+        if (bestLength >= kMinMatch)
+        {
+            symbols.push_back(Symbol{ uint16_t(bestLength), uint16_t(bestDist) });
+            ++litFreqs[257 + LengthCode(int(bestLength))];
+            ++distFreqs[DistCode(int(bestDist))];
+            for (size_t k = 0; k != bestLength; ++k)
+                insert(i + k);
+            i += bestLength;
+        }
+        else
+        {
+            symbols.push_back(Symbol{ data[i], 0 });
+            ++litFreqs[data[i]];
+            insert(i);
+            ++i;
+        }
+    }
+    ++litFreqs[256];
+
+    // dynamic Huffman codes, and the code lengths of them run length encoded
+    uint8_t litLengths[286], distLengths[30];
+    BuildCodeLengths(litFreqs, 286, 15, litLengths);
+    BuildCodeLengths(distFreqs, 30, 15, distLengths);
+    int litCount = 286;
+    while (litCount > 257 && litLengths[litCount - 1] == 0)
+        --litCount;
+    int distCount = 30;
+    while (distCount > 1 && distLengths[distCount - 1] == 0)
+        --distCount;
+    uint8_t allLengths[286 + 30];
+    memcpy(allLengths, litLengths, litCount);
+    memcpy(allLengths + litCount, distLengths, distCount);
+    const int total = litCount + distCount;
+    std::vector<std::pair<uint8_t, uint8_t>> lengthSymbols; // code length symbol, extra bits
+    uint32_t lengthFreqs[19] = {};
+    auto addLengthSymbol = [&](int sym, int extra)
+    {
+        lengthSymbols.push_back(std::make_pair(uint8_t(sym), uint8_t(extra)));
+        ++lengthFreqs[sym];
+    };
+    for (int k = 0; k < total; )
+    {
+        uint8_t value = allLengths[k];
+        int run = 1;
+        while (k + run < total && allLengths[k + run] == value)
+            ++run;
+        if (value == 0 && run >= 3)
+        {
+            run = std::min(run, 138);
+            if (run >= 11)
+                addLengthSymbol(18, run - 11);
+            else
+                addLengthSymbol(17, run - 3);
+            k += run;
+        }
+        else if (value != 0 && run >= 4)
+        {
+            addLengthSymbol(value, 0);
+            run = std::min(run - 1, 6);
+            addLengthSymbol(16, run - 3);
+            k += 1 + run;
+        }
+        else
+        {
+            addLengthSymbol(value, 0);
+            k += 1;
+        }
+    }
+    uint8_t codeLengths[19];
+    BuildCodeLengths(lengthFreqs, 19, 7, codeLengths);
+    int codeLengthCount = 19;
+    while (codeLengthCount > 4 && codeLengths[kCodeLengthOrder[codeLengthCount - 1]] == 0)
+        --codeLengthCount;
+
+    uint16_t litCodes[286], distCodes[30], lengthCodes[19];
+    BuildCodes(litLengths, 286, litCodes);
+    BuildCodes(distLengths, 30, distCodes);
+    BuildCodes(codeLengths, 19, lengthCodes);
+
+    PutBits(last ? 1 : 0, 1);
+    PutBits(2, 2);
+    PutBits(litCount - 257, 5);
+    PutBits(distCount - 1, 5);
+    PutBits(codeLengthCount - 4, 4);
+    for (int i = 0; i != codeLengthCount; ++i)
+        PutBits(codeLengths[kCodeLengthOrder[i]], 3);
+    static const int kLengthSymbolExtra[3] = { 2, 3, 7 };
+    for (const auto& ls : lengthSymbols)
+    {
+        PutBits(lengthCodes[ls.first], codeLengths[ls.first]);
+        if (ls.first >= 16)
+            PutBits(ls.second, kLengthSymbolExtra[ls.first - 16]);
+    }
+    for (const Symbol& s : symbols)
+    {
+        if (s.dist == 0)
+        {
+            PutBits(litCodes[s.litLength], litLengths[s.litLength]);
+            continue;
+        }
+        int lc = LengthCode(s.litLength);
+        PutBits(litCodes[257 + lc], litLengths[257 + lc]);
+        PutBits(s.litLength - kLengthBase[lc], kLengthExtra[lc]);
+        int dc = DistCode(s.dist);
+        PutBits(distCodes[dc], distLengths[dc]);
+        PutBits(s.dist - kDistBase[dc], kDistExtra[dc]);
+    }
+    PutBits(litCodes[256], litLengths[256]);
+
+    // keep a window of already compressed data for matches of the next block
+    m_Pending = end;
+    if (m_Pending > kWindowSize)
+    {
+        size_t drop = m_Pending - kWindowSize;
+        m_Data.erase(m_Data.begin(), m_Data.begin() + drop);
+        m_DataStart += drop;
+        m_Pending -= drop;
+    }
+    if (m_Out.size() >= kBlockSize)
+        FlushOutput();
+}
+
+bool GzipWriter::Write(const char* data, size_t size)
+{
+    m_Crc = UpdateCrc(m_Crc, data, size);
+    m_Size += uint32_t(size);
+    // add the data in pieces, so that there is never much more than a block pending
+    while (size != 0)
+    {
+        size_t piece = std::min(size, kBlockSize);
+        m_Data.insert(m_Data.end(), (const uint8_t*)data, (const uint8_t*)data + piece);
+        data += piece;
+        size -= piece;
+        while (m_Data.size() - m_Pending >= kBlockSize)
+            CompressBlock(kBlockSize, false);
+    }
+    return !m_Error;
+}
+
+bool GzipWriter::Finish()
+{
+    CompressBlock(m_Data.size() - m_Pending, true);
+    if (m_BitCount != 0)
+        PutBits(0, 8 - m_BitCount);
+    for (uint32_t value : { m_Crc, m_Size })
+        for (int i = 0; i != 4; ++i)
+            m_Out.push_back(uint8_t(value >> (i * 8)));
+    FlushOutput();
+    return !m_Error;
+}
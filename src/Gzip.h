@@ -0,0 +1,93 @@
+// Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
+// SPDX-License-Identifier: Unlicense
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+// gzip data starts with these two bytes
+bool IsGzipData(const char* data, size_t size);
+
+// Streaming gzip decompression of data in memory (e.g. a mapped file). Output comes
+// one deflate block at a time, so that the whole decompressed data never has to be
+// in memory at once. Files with several gzip members are read as one stream.
+class GzipReader
+{
+public:
+    GzipReader(const char* data, size_t size);
+    GzipReader(const GzipReader&) = delete;
+    GzipReader& operator=(const GzipReader&) = delete;
+
+    // Appends decompressed data of the next block to out; returns false at the end
+    // of the data, or on errors (see Failed).
+    bool Read(std::vector<char>& out);
+    bool Failed() const { return m_Failed; }
+
+    // Decompresses everything into out (replacing what was there).
+    bool ReadAll(std::vector<char>& out);
+
+private:
+    struct Huffman
+    {
+        std::vector<uint16_t> table; // (symbol << 4) | code length, indexed by the next 'bits' bits
+        int bits = 0;
+        bool Build(const uint8_t* lengths, int count);
+    };
+
+    void Refill();
+    uint32_t GetBits(int count);
+    int Decode(const Huffman& h);
+    bool ReadHeader();
+    bool ReadTrailer();
+    bool InflateBlock();
+    bool InflateStored();
+    bool InflateCodes(const Huffman& lengths, const Huffman& dists);
+    bool ReadDynamicTables(Huffman& lengths, Huffman& dists);
+
+    const uint8_t* m_In;
+    const uint8_t* m_InEnd;
+    uint64_t m_Bits = 0;
+    int m_BitCount = 0;
+    size_t m_Overrun = 0; // zero bytes "read" past the end of input
+
+    std::vector<char> m_Window; // up to 32KB of previous output, followed by output of current block
+    uint32_t m_Crc = 0;
+    uint32_t m_Size = 0;
+    bool m_InMember = false;
+    bool m_LastBlock = false;
+    bool m_Failed = false;
+};
+
+// Streaming gzip compression into a file; LZ77 with hash chains and dynamic
+// Huffman codes, i.e. about the same as gzip's default level.
+class GzipWriter
+{
+public:
+    explicit GzipWriter(FILE* file);
+    GzipWriter(const GzipWriter&) = delete;
+    GzipWriter& operator=(const GzipWriter&) = delete;
+
+    bool Write(const char* data, size_t size);
+    // Compresses the rest and writes the gzip trailer; the file is not closed.
+    bool Finish();
+
+private:
+    void CompressBlock(size_t size, bool last);
+    void PutBits(uint32_t value, int count);
+    void FlushOutput();
+
+    FILE* m_File;
+    std::vector<uint8_t> m_Data; // up to 32KB of already compressed data, followed by pending data
+    size_t m_Pending = 0; // start of pending data in m_Data
+    int64_t m_DataStart = 0; // stream position of m_Data[0]
+    std::vector<int64_t> m_Head; // stream position of the last string with each hash
+    std::vector<int64_t> m_Prev; // previous position with the same hash, by position within the window
+
+    std::vector<uint8_t> m_Out;
+    uint64_t m_Bits = 0;
+    int m_BitCount = 0;
+    uint32_t m_Crc = 0;
+    uint32_t m_Size = 0;
+    bool m_Error = false;
+};
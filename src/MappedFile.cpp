@@ -0,0 +1,90 @@
+// Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
+// SPDX-License-Identifier: Unlicense
+#include "MappedFile.h"
+#ifdef _MSC_VER
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+struct IUnknown; // workaround for old Win SDK header failures when using /permissive-
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::Open(const char* path, bool copyOnWrite)
+{
+    Close();
+    m_Writable = copyOnWrite;
+#ifdef _MSC_VER
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+        CloseHandle(file);
+        return false;
+    }
+    m_File = file;
+    if (size.QuadPart == 0)
+        return true; // can't map empty files, but it's not an error
+    HANDLE mapping = CreateFileMappingA(file, NULL, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+    {
+        Close();
+        return false;
+    }
+    m_Mapping = mapping;
+    m_Data = (char*)MapViewOfFile(mapping, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    if (m_Data == nullptr)
+    {
+        Close();
+        return false;
+    }
+    m_Size = (size_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return true; // can't map empty files, but it's not an error
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, copyOnWrite ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays valid after closing the file
+    if (data == MAP_FAILED)
+        return false;
+    m_Data = (char*)data;
+    m_Size = (size_t)st.st_size;
+#endif
+    return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef _MSC_VER
+    if (m_Data)
+        UnmapViewOfFile(m_Data);
+    if (m_Mapping)
+        CloseHandle(m_Mapping);
+    if (m_File)
+        CloseHandle(m_File);
+    m_Mapping = nullptr;
+    m_File = nullptr;
+#else
+    if (m_Data)
+        munmap(m_Data, m_Size);
+#endif
+    m_Data = nullptr;
+    m_Size = 0;
+    m_Writable = false;
+}
@@ -0,0 +1,32 @@
+// Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
+// SPDX-License-Identifier: Unlicense
+#pragma once
+#include <stddef.h>
+
+// Memory mapping of a whole file. Either read-only, or copy-on-write: the data
+// can be modified in memory (e.g. by in-place json parsing), but the changes
+// never go back into the file, and only modified pages take up extra memory.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile() { Close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const char* path, bool copyOnWrite = false);
+    void Close();
+
+    const char* GetData() const { return m_Data; }
+    char* GetWritableData() const { return m_Writable ? m_Data : nullptr; }
+    size_t GetSize() const { return m_Size; }
+
+private:
+    char* m_Data = nullptr;
+    size_t m_Size = 0;
+    bool m_Writable = false;
+#ifdef _MSC_VER
+    void* m_File = nullptr;
+    void* m_Mapping = nullptr;
+#endif
+};
@@ -0,0 +1,50 @@
+// Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
+// SPDX-License-Identifier: Unlicense
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace parallel
+{
+    inline int GetThreadCount()
+    {
+        unsigned count = std::thread::hardware_concurrency();
+        return count != 0 ? (int)count : 1;
+    }
+
+    // Calls func(index) for each index in [0,count) from several threads, and
+    // waits until all of them are done. Indices are handed out in increasing order,
+    // so a job can wait on results of jobs with smaller indices without deadlocking.
+    template<typename Func>
+    void ForEach(size_t count, Func func)
+    {
+        size_t threadCount = std::min<size_t>(GetThreadCount(), count);
+        if (threadCount <= 1)
+        {
+            for (size_t i = 0; i != count; ++i)
+                func(i);
+            return;
+        }
+
+        std::atomic<size_t> nextIndex(0);
+        auto worker = [&]()
+        {
+            while (true)
+            {
+                size_t index = nextIndex++;
+                if (index >= count)
+                    break;
+                func(index);
+            }
+        };
+        std::vector<std::thread> threads;
+        threads.reserve(threadCount - 1);
+        for (size_t i = 0; i != threadCount - 1; ++i)
+            threads.emplace_back(worker);
+        worker();
+        for (auto& t : threads)
+            t.join();
+    }
+}
@@ -0,0 +1,159 @@
+// Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
+// SPDX-License-Identifier: Unlicense
+#include "Timing.h"
+#include "Allocator.h"
+#include "Colors.h"
+#include <atomic>
+#include <mutex>
+#include <stdio.h>
+#include <vector>
+
+#include "external/sokol_time.h"
+
+static const struct
+{
+    const char* name;
+    int depth; // for indentation when printing
+} kPhaseInfos[] =
+{
+    { "Scan files", 0 },
+    { "Write capture", 0 },
+    { "Read & check", 1 },
+    { "Parse", 0 },
+    { "JSON", 1 },
+    { "Hierarchy", 1 },
+    { "Merge files", 1 },
+    { "Load binary", 0 },
+    { "Aggregate", 0 },
+    { "Prepare names", 0 },
+    { "Reports", 0 },
+    { "Time summary", 1 },
+    { "Parse files", 1 },
+    { "Codegen files", 1 },
+    { "Templates", 1 },
+    { "Functions", 1 },
+    { "Headers", 1 },
+    { "Directories", 1 },
+    { "Schedule", 1 },
+};
+static_assert(sizeof(kPhaseInfos) / sizeof(kPhaseInfos[0]) == timing::kPhaseCount, "phase infos should match phases");
+
+static const char* kCounterNames[] =
+{
+    "Files read",
+    "Bytes read",
+    "Files parsed",
+    "Events",
+    "Unique names",
+};
+static_assert(sizeof(kCounterNames) / sizeof(kCounterNames[0]) == timing::kCounterCount, "counter names should match counters");
+
+static std::atomic<uint64_t> s_PhaseTicks[timing::kPhaseCount];
+static std::atomic<int> s_PhaseCounts[timing::kPhaseCount];
+static std::atomic<uint64_t> s_Counters[timing::kCounterCount];
+
+struct TraceScope
+{
+    timing::Phase phase;
+    int thread;
+    uint64_t start;
+    uint64_t duration;
+};
+static std::atomic<bool> s_Tracing(false);
+static uint64_t s_TraceStart = 0;
+static std::mutex s_TraceMutex;
+static std::vector<TraceScope> s_TraceScopes;
+static std::atomic<int> s_TraceThreadCount(0);
+static thread_local int s_TraceThread = -1;
+
+timing::Scope::Scope(Phase phase)
+: m_Phase(phase), m_Start(stm_now())
+{
+}
+
+timing::Scope::~Scope()
+{
+    uint64_t duration = stm_since(m_Start);
+    s_PhaseTicks[m_Phase] += duration;
+    ++s_PhaseCounts[m_Phase];
+    if (s_Tracing)
+    {
+        if (s_TraceThread < 0)
+            s_TraceThread = s_TraceThreadCount++;
+        // scopes are often inside of an arena scope, but the recorded ones have to outlive it
+        ArenaScope heapScope(nullptr);
+        std::lock_guard<std::mutex> lock(s_TraceMutex);
+        s_TraceScopes.push_back({ m_Phase, s_TraceThread, m_Start, duration });
+    }
+}
+
+void timing::Count(Counter counter, uint64_t value)
+{
+    s_Counters[counter] += value;
+}
+
+uint64_t timing::GetCount(Counter counter)
+{
+    return s_Counters[counter].load();
+}
+
+double timing::GetSeconds(Phase phase)
+{
+    return stm_sec(s_PhaseTicks[phase].load());
+}
+
+void timing::Reset()
+{
+    for (auto& ticks : s_PhaseTicks)
+        ticks = 0;
+    for (auto& count : s_PhaseCounts)
+        count = 0;
+    for (auto& counter : s_Counters)
+        counter = 0;
+}
+
+void timing::Print()
+{
+    printf("%sTime spent in phases:%s\n", col::kYellow, col::kReset);
+    for (int i = 0; i != kPhaseCount; ++i)
+    {
+        if (s_PhaseCounts[i] == 0)
+            continue;
+        int indent = kPhaseInfos[i].depth * 2;
+        printf("  %*s%-*s %s%9.1f%s ms\n", indent, "", 16 - indent, kPhaseInfos[i].name, col::kBold, GetSeconds((Phase)i) * 1000.0, col::kReset);
+    }
+    printf("%sCounts:%s\n", col::kYellow, col::kReset);
+    for (int i = 0; i != kCounterCount; ++i)
+        printf("  %-16s %s%9llu%s\n", kCounterNames[i], col::kBold, (unsigned long long)s_Counters[i].load(), col::kReset);
+    printf("  %-16s %s%9llu%s\n", "Allocations", col::kBold, (unsigned long long)memstats::GetAllocationCount(), col::kReset);
+}
+
+void timing::StartTrace()
+{
+    s_TraceStart = stm_now();
+    s_Tracing = true;
+}
+
+bool timing::WriteTrace(const char* path)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f)
+        return false;
+    std::lock_guard<std::mutex> lock(s_TraceMutex);
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (const TraceScope& scope : s_TraceScopes)
+    {
+        fprintf(f, "{\"pid\":1,\"tid\":%i,\"ph\":\"X\",\"ts\":%.1f,\"dur\":%.1f,\"name\":\"%s\"},\n",
+            scope.thread, stm_us(stm_diff(scope.start, s_TraceStart)), stm_us(scope.duration), kPhaseInfos[scope.phase].name);
+    }
+    // counters at the end of the run
+    uint64_t end = stm_since(s_TraceStart);
+    for (int i = 0; i != kCounterCount; ++i)
+    {
+        fprintf(f, "{\"pid\":1,\"tid\":0,\"ph\":\"C\",\"ts\":%.1f,\"name\":\"%s\",\"args\":{\"value\":%llu}},\n",
+            stm_us(end), kCounterNames[i], (unsigned long long)s_Counters[i].load());
+    }
+    fprintf(f, "{\"pid\":1,\"tid\":0,\"ph\":\"M\",\"name\":\"process_name\",\"args\":{\"name\":\"ClangBuildAnalyzer\"}}\n");
+    fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(f) == 0;
+}
@@ -0,0 +1,70 @@
+// Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
+// SPDX-License-Identifier: Unlicense
+#pragma once
+#include <stdint.h>
+
+// Time spent in the processing phases & counts of processed things, for --bench
+// and --timings. Phases that run on several threads at once (parsing of separate
+// files, report sections) add up the time of all the threads, so they can be
+// larger than the phase that contains them.
+namespace timing
+{
+    enum Phase
+    {
+        kScanFiles,
+        kWriteCapture,
+        kReadFiles,
+        kParse,
+        kParseJson,
+        kHierarchy,
+        kMergeFiles,
+        kLoadBinary,
+        kAggregate,
+        kPrepareNames,
+        kReports,
+        kReportTimeSummary,
+        kReportParseFiles,
+        kReportCodegenFiles,
+        kReportTemplates,
+        kReportFunctions,
+        kReportHeaders,
+        kReportDirectories,
+        kReportSchedule,
+        kPhaseCount
+    };
+
+    enum Counter
+    {
+        kFilesRead,
+        kBytesRead,
+        kFilesParsed,
+        kEventsAnalyzed,
+        kNamesAnalyzed,
+        kCounterCount
+    };
+
+    class Scope
+    {
+    public:
+        explicit Scope(Phase phase);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        Phase m_Phase;
+        uint64_t m_Start;
+    };
+
+    void Count(Counter counter, uint64_t value = 1);
+    uint64_t GetCount(Counter counter);
+
+    double GetSeconds(Phase phase);
+    void Reset();
+    // Prints time of phases that were entered, and the counters.
+    void Print();
+
+    // From now on, each scope is also recorded to be written as a Chrome trace
+    // (chrome://tracing, Perfetto, Speedscope etc. can show it).
+    void StartTrace();
+    bool WriteTrace(const char* path);
+}
@@ -0,0 +1,201 @@
+// Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
+// SPDX-License-Identifier: Unlicense
+#include "TraceGenerator.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+// Names are picked out of fixed size pools, so that the same headers, templates and
+// functions show up in many files, just like in a real build.
+struct NamePools
+{
+    std::vector<std::string> headers;
+    std::vector<std::string> templates;
+    std::vector<std::string> functions;
+};
+
+static int NameLength(std::mt19937& rng, int average)
+{
+    return std::max(8, average / 2 + int(rng() % (average + 1)));
+}
+
+// like "ns3::Tmpl17<ns12::Arg140, ns0::Arg7>"
+static std::string MakeTemplateName(std::mt19937& rng, int length)
+{
+    std::string name = "ns" + std::to_string(rng() % 16) + "::Tmpl" + std::to_string(rng() % 64) + "<";
+    bool first = true;
+    while ((int)name.size() < length - 1)
+    {
+        if (!first)
+            name += ", ";
+        name += "ns" + std::to_string(rng() % 16) + "::Arg" + std::to_string(rng() % 256);
+        first = false;
+    }
+    name += ">";
+    return name;
+}
+
+// mangled, like "_ZN3ns56Class28method17EiRKf"
+static std::string MakeFunctionName(std::mt19937& rng, int length)
+{
+    static const char* kParams[] = { "i", "f", "d", "c", "b", "l", "PKc", "RKi", "RKf" };
+    std::string ns = "ns" + std::to_string(rng() % 16);
+    std::string cls = "Class" + std::to_string(rng() % 256);
+    std::string fn = "method" + std::to_string(rng() % 64);
+    std::string name = "_ZN" + std::to_string(ns.size()) + ns + std::to_string(cls.size()) + cls + std::to_string(fn.size()) + fn + "E";
+    do
+        name += kParams[rng() % (sizeof(kParams) / sizeof(kParams[0]))];
+    while ((int)name.size() < length);
+    return name;
+}
+
+static void MakeNamePools(const TraceGeneratorSettings& settings, NamePools& pools)
+{
+    const int kHeaderCount = 1000;
+    const int kTemplateCount = 4000;
+    const int kFunctionCount = 4000;
+    std::mt19937 rng(12345);
+    for (int i = 0; i != kHeaderCount; ++i)
+        pools.headers.emplace_back("include/lib" + std::to_string(i % 20) + "/header" + std::to_string(i) + ".h");
+    for (int i = 0; i != kTemplateCount; ++i)
+        pools.templates.emplace_back(MakeTemplateName(rng, NameLength(rng, settings.nameLength)));
+    for (int i = 0; i != kFunctionCount; ++i)
+        pools.functions.emplace_back(MakeFunctionName(rng, NameLength(rng, settings.nameLength)));
+}
+
+// Events are written in the order clang writes them: each one when it ends, i.e. after
+// all of its children, with the root ExecuteCompiler event last.
+struct TraceFileGenerator
+{
+    const TraceGeneratorSettings& settings;
+    const NamePools& pools;
+    std::mt19937 rng;
+    std::string json;
+    int64_t now = 0;
+    int eventsLeft = 0;
+    int backendEvents = 0;
+
+    TraceFileGenerator(const TraceGeneratorSettings& settings_, const NamePools& pools_, int fileIndex)
+    : settings(settings_), pools(pools_), rng(fileIndex + 1)
+    {
+    }
+
+    void Advance(int maxUs)
+    {
+        now += 1 + rng() % maxUs;
+    }
+
+    const std::string& Pick(const std::vector<std::string>& pool)
+    {
+        return pool[rng() % pool.size()];
+    }
+
+    void Emit(const char* name, int64_t start, const std::string& detail)
+    {
+        char buf[200];
+        snprintf(buf, sizeof(buf), "{\"pid\":1,\"tid\":0,\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"name\":\"%s\"", (long long)start, (long long)(now - start), name);
+        json += buf;
+        if (!detail.empty())
+        {
+            json += ",\"args\":{\"detail\":\"";
+            json += detail;
+            json += "\"}";
+        }
+        json += "},";
+        --eventsLeft;
+    }
+
+    void Instantiate(int depth)
+    {
+        int64_t start = now;
+        Advance(20);
+        while (depth < settings.templateDepth && eventsLeft > backendEvents && rng() % 3 != 0)
+        {
+            Instantiate(depth + 1);
+            Advance(10);
+        }
+        Advance(50);
+        Emit(rng() % 2 ? "InstantiateClass" : "InstantiateFunction", start, Pick(pools.templates));
+    }
+
+    void Include(int depth)
+    {
+        int64_t start = now;
+        Advance(50);
+        while (eventsLeft > backendEvents && rng() % 4 != 0)
+        {
+            if (depth < 4 && rng() % 2 == 0)
+                Include(depth + 1);
+            else
+                Instantiate(0);
+            Advance(30);
+        }
+        Advance(200);
+        Emit("Source", start, Pick(pools.headers));
+    }
+
+    void Generate()
+    {
+        eventsLeft = settings.eventsPerFile;
+        backendEvents = eventsLeft / 5 + 4;
+        json = "{\"traceEvents\":[";
+
+        Advance(1000);
+        int64_t frontendStart = now;
+        while (eventsLeft > backendEvents)
+        {
+            if (rng() % 4 != 0)
+                Include(0);
+            else
+                Instantiate(0);
+            Advance(30);
+        }
+        Emit("Frontend", frontendStart, "");
+
+        Advance(100);
+        int64_t backendStart = now;
+        Advance(100);
+        int64_t moduleStart = now;
+        while (eventsLeft > 3)
+        {
+            int64_t start = now;
+            Advance(500);
+            Emit("OptFunction", start, Pick(pools.functions));
+            Advance(5);
+        }
+        Emit("OptModule", moduleStart, "bench.cpp");
+        Advance(100);
+        Emit("Backend", backendStart, "");
+        Advance(100);
+        Emit("ExecuteCompiler", 0, "");
+
+        json += "{\"cat\":\"\",\"pid\":1,\"tid\":0,\"ts\":0,\"ph\":\"M\",\"name\":\"process_name\",\"args\":{\"name\":\"clang\"}}],\"beginningOfTime\":0}\n";
+    }
+};
+
+size_t GenerateTraceFiles(const std::string& folder, const TraceGeneratorSettings& settings)
+{
+    NamePools pools;
+    MakeNamePools(settings, pools);
+
+    std::atomic<size_t> totalSize(0);
+    std::atomic<bool> failed(false);
+    parallel::ForEach(settings.fileCount, [&](size_t index)
+    {
+        TraceFileGenerator gen(settings, pools, (int)index);
+        gen.Generate();
+        char name[32];
+        snprintf(name, sizeof(name), "/bench%05i.json", (int)index);
+        std::string path = folder + name;
+        FILE* f = fopen(path.c_str(), "wb");
+        if (!f || fwrite(gen.json.data(), 1, gen.json.size(), f) != gen.json.size())
+            failed = true;
+        if (f && fclose(f) != 0)
+            failed = true;
+        totalSize += gen.json.size();
+    });
+    return failed ? 0 : totalSize.load();
+}
@@ -0,0 +1,21 @@
+// Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
+// SPDX-License-Identifier: Unlicense
+#pragma once
+#include <stddef.h>
+#include <string>
+
+// Synthetic -ftime-trace json files, for --bench. Each compiled file has nested
+// includes out of a shared set of headers, template instantiations nested up to the
+// given depth, and optimized functions in the backend. Generated data only depends
+// on the settings, so the same settings always give the same files.
+struct TraceGeneratorSettings
+{
+    int fileCount = 200;
+    int eventsPerFile = 5000;
+    int templateDepth = 6;
+    int nameLength = 60; // average length of template & function names
+};
+
+// Writes the files into a folder (that has to exist); returns total size of the
+// written files, or 0 on failure.
+size_t GenerateTraceFiles(const std::string& folder, const TraceGeneratorSettings& settings);
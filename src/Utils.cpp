@@ -7,6 +7,7 @@
 struct IUnknown; // workaround for old Win SDK header failures when using /permissive-
 #include <windows.h>
 #else
+#include <stdio.h>
 #include <unistd.h>
 #endif
 
@@ -16,6 +17,32 @@ static std::string s_Root = "./";
 inline char ToLower(char c) { return (c >= 'A' && c <= 'Z') ? (c + 'a' - 'A') : c; }
 inline char ToUpper(char c) { return (c >= 'a' && c <= 'z') ? (c - ('a' - 'A')) : c; }
 
+// Each byte lowercased, with backslash turned into forward slash; paths are
+// compared through this, so they don't have to be copied and normalized first.
+struct PathCharTable
+{
+    char chars[256];
+    PathCharTable()
+    {
+        for (int i = 0; i != 256; ++i)
+            chars[i] = ToLower(char(i));
+        chars[(unsigned char)'\\'] = '/';
+    }
+    char operator[](char c) const { return chars[(unsigned char)c]; }
+};
+static const PathCharTable s_PathChars;
+
+// whether path[start..] begins with an already forward-slashified prefix, ignoring case
+static bool PathBeginsWith(const char* path, size_t length, size_t start, const std::string& prefix)
+{
+    if (length - start < prefix.size())
+        return false;
+    for (size_t i = 0, n = prefix.size(); i != n; ++i)
+        if (s_PathChars[path[start + i]] != s_PathChars[prefix[i]])
+            return false;
+    return true;
+}
+
 #ifdef _MSC_VER
 std::string WideToUtf(const std::wstring& s)
 {
@@ -57,6 +84,24 @@ void utils::Lowercase(std::string& path)
 }
 
 
+unsigned utils::GetProcessId()
+{
+#ifdef _MSC_VER
+    return (unsigned)::GetCurrentProcessId();
+#else
+    return (unsigned)getpid();
+#endif
+}
+
+bool utils::MoveFileOver(const std::string& from, const std::string& to)
+{
+#ifdef _MSC_VER
+    return ::MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
 bool utils::BeginsWith(const std::string& str, const std::string& prefix)
 {
     if (str.size() < prefix.size())
@@ -137,17 +182,23 @@ std::string utils::GetNicePath(const char* path)
 }
 
 
-std::string utils::GetNicePath(const std::string& path)
+std::string utils::GetNicePath(const char* path, size_t length)
 {
-    std::string res = path;
+    size_t start = 0;
+    if (PathBeginsWith(path, length, start, s_CurrentDir))
+        start += s_CurrentDir.size();
+    if (PathBeginsWith(path, length, start, s_Root))
+        start += s_Root.size();
+    std::string res(path + start, length - start);
     ForwardSlashify(res);
-    if (BeginsWith(res, s_CurrentDir))
-        res = res.substr(s_CurrentDir.size(), res.size() - s_CurrentDir.size());
-    if (BeginsWith(res, s_Root))
-        res = res.substr(s_Root.size(), res.size() - s_Root.size());
     return res;
 }
 
+std::string utils::GetNicePath(const std::string& path)
+{
+    return GetNicePath(path.data(), path.size());
+}
+
 std::string utils::GetFilename(const std::string& path)
 {
     size_t dirIdx = path.rfind('/');
@@ -9,6 +9,8 @@ namespace utils
 
     std::string GetNicePath(const char* path);
     std::string GetNicePath(const std::string& path);
+    // same as above, without having to make a string first
+    std::string GetNicePath(const char* path, size_t length);
     std::string GetFilename(const std::string& path);
 
     bool IsHeader(const std::string& path);
@@ -16,6 +18,12 @@ namespace utils
     void Lowercase(std::string& path);
     void ForwardSlashify(std::string& path);
 
+    // id of this process, e.g. to make names of temporary files unique
+    unsigned GetProcessId();
+    // renames a file over an existing one (if any) as one step, so that others never see
+    // the target missing
+    bool MoveFileOver(const std::string& from, const std::string& to);
+
     bool BeginsWith(const std::string& str, const std::string& prefix);
     bool EndsWith(const std::string& str, const std::string& suffix);
 }
@@ -1,20 +1,41 @@
 // Clang Build Analyzer https://github.com/aras-p/ClangBuildAnalyzer
 // SPDX-License-Identifier: Unlicense
+#include "Allocator.h"
 #include "Analysis.h"
 #include "BuildEvents.h"
 #include "Colors.h"
+#include "Gzip.h"
+#include "MappedFile.h"
+#include "Parallel.h"
+#include "Timing.h"
+#include "TraceGenerator.h"
 #include "Utils.h"
 
+#include <ctype.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string>
 #include <time.h>
-#include <map>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #ifdef _MSC_VER
 struct IUnknown; // workaround for old Win SDK header failures when using /permissive-
 #define ftello64 _ftelli64
-#elif defined(__APPLE__)
+#include <direct.h>
+#include <io.h>
+#include <sys/utime.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+#if defined(__APPLE__)
 #define ftello64 ftello
 #endif
 
@@ -22,6 +43,7 @@ struct IUnknown; // workaround for old Win SDK header failures when using /permi
 #include "external/sokol_time.h"
 #define CUTE_FILES_IMPLEMENTATION
 #include "external/cute_files.h"
+#include "external/inih/cpp/INIReader.h"
 
 static std::string ReadFileToString(const std::string& path)
 {
@@ -63,28 +85,102 @@ static void PrintUsage()
     printf("%sUSAGE%s: one of\n", col::kBold, col::kReset);
     printf("  ClangBuildAnalyzer %s--start <artifactsdir>%s\n", col::kBold, col::kReset);
     printf("  ClangBuildAnalyzer %s--stop <artifactsdir> <filename>%s\n", col::kBold, col::kReset);
+    printf("  ClangBuildAnalyzer %s--watch <artifactsdir> <filename>%s\n", col::kBold, col::kReset);
     printf("  ClangBuildAnalyzer %s--analyze <filename>%s\n", col::kBold, col::kReset);
+    printf("  ClangBuildAnalyzer %s--diff <oldfile> <newfile>%s\n", col::kBold, col::kReset);
+    printf("  ClangBuildAnalyzer %s--analyze-shard <filename> <index> <count> <partfile>%s\n", col::kBold, col::kReset);
+    printf("  ClangBuildAnalyzer %s--merge <partfile> [<partfile> ...]%s\n", col::kBold, col::kReset);
+    printf("  ClangBuildAnalyzer %s--convert <filename> <binaryfile>%s\n", col::kBold, col::kReset);
+    printf("  ClangBuildAnalyzer %s--serve <filename>%s\n", col::kBold, col::kReset);
+    printf("  ClangBuildAnalyzer %s--bench <folder> [files] [eventsperfile] [templatedepth] [namelength]%s\n", col::kBold, col::kReset);
+    printf("%sOPTIONS%s:\n", col::kBold, col::kReset);
+    printf("  %s--memstats%s: print peak memory usage when done\n", col::kBold, col::kReset);
+    printf("  %s--timings%s: print time spent in each processing phase, and counts of processed things when done\n", col::kBold, col::kReset);
+    printf("  %s--timings-trace <filename>%s: write processing phases as a Chrome trace json file when done\n", col::kBold, col::kReset);
+    printf("  %s--format text|json|csv%s: report format of --analyze and --merge; with json or csv, all other messages go to stderr\n", col::kBold, col::kReset);
+    printf("  %s--cache <dir>%s: keep parsed events of each compiled file in this folder, and reuse them for unchanged files on later runs\n", col::kBold, col::kReset);
+    printf("  %s--filter-events <list>%s: only keep these events when parsing json traces, e.g. 'Source,InstantiateClass'\n", col::kBold, col::kReset);
+    printf("  %s--filter-min-times <list>%s: only keep events at least this long (in ms) when parsing, e.g. 'OptFunction:1,Source:0.5'\n", col::kBold, col::kReset);
+    printf("  %s--filter-include <globs>%s, %s--filter-exclude <globs>%s: only parse compiled files whose names match (or do not match) one of the comma separated globs\n", col::kBold, col::kReset, col::kBold, col::kReset);
 }
 
-static int RunStart(int argc, const char* argv[])
+// folder of the parsed events cache (--cache option), or empty when not caching
+static std::string s_CacheDir;
+
+// --filter-* options; each one replaces the same setting from the [filters] section
+// of ClangBuildAnalyzer.ini
+struct FilterOptions
 {
-    if (argc < 3)
+    const char* events = nullptr;
+    const char* minTimes = nullptr;
+    const char* include = nullptr;
+    const char* exclude = nullptr;
+};
+
+// whether the command parses json traces; only those read the filters, so that e.g.
+// --start and --stop work with any [filters] settings
+static bool CommandParsesTraces(const char* command)
+{
+    const char* kCommands[] = { "--watch", "--analyze", "--analyze-shard", "--diff", "--convert", "--serve", "--test", "--bench" };
+    for (const char* name : kCommands)
+        if (strcmp(command, name) == 0)
+            return true;
+    return false;
+}
+
+static bool ReadParseFilters(const FilterOptions& options)
+{
+    INIReader ini(GetConfigFile());
+    std::string events = options.events ? options.events : ini.Get("filters", "events", "");
+    std::string minTimes = options.minTimes ? options.minTimes : ini.Get("filters", "minTimes", "");
+    std::string include = options.include ? options.include : ini.Get("filters", "includeFiles", "");
+    std::string exclude = options.exclude ? options.exclude : ini.Get("filters", "excludeFiles", "");
+
+    ParseFilters filters;
+    if (!filters.SetEnabledTypes(events) || !filters.SetMinTimes(minTimes))
+        return false;
+    filters.includeFiles = ParseFilters::SplitList(include);
+    filters.excludeFiles = ParseFilters::SplitList(exclude);
+    SetParseFilters(filters);
+    return true;
+}
+
+// --format option of --analyze
+static ReportFormat s_ReportFormat = ReportFormat::kText;
+
+// creates the folder if it does not exist yet
+static bool CreateFolder(const std::string& path)
+{
+#ifdef _MSC_VER
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0777);
+#endif
+    cf_dir_t dir;
+    if (!cf_dir_open(&dir, path.c_str()))
     {
-        printf("%sERROR: --start requires <artifactsdir> to be passed.%s\n", col::kRed, col::kReset);
-        return 1;
+        printf("%sERROR: failed to create folder '%s'.%s\n", col::kRed, path.c_str(), col::kReset);
+        return false;
     }
+    cf_dir_close(&dir);
+    return true;
+}
 
-    std::string artifactsDir = argv[2];
+static bool CreateCacheDir()
+{
+    return s_CacheDir.empty() || CreateFolder(s_CacheDir);
+}
+
+// save start timestamp into the session file
+static bool WriteSessionFile(const std::string& artifactsDir, time_t now)
+{
     std::string fname = artifactsDir+"/ClangBuildAnalyzerSession.txt";
     FILE* fsession = fopen(fname.c_str(), "wt");
     if (!fsession)
     {
         printf("%sERROR: failed to create session file at '%s'.%s\n", col::kRed, fname.c_str(), col::kReset);
-        return 1;
+        return false;
     }
-
-    // save start timestamp into the session file
-    time_t now = time(NULL);
     static_assert(sizeof(time_t)==8, "expected that time_t is a 64-bit number");
 #if _MSC_VER
     fprintf(fsession, "%llu\n", now);
@@ -92,6 +188,20 @@ static int RunStart(int argc, const char* argv[])
     fprintf(fsession, "%lu\n", now);
 #endif
     fclose(fsession);
+    return true;
+}
+
+static int RunStart(int argc, const char* argv[])
+{
+    if (argc < 3)
+    {
+        printf("%sERROR: --start requires <artifactsdir> to be passed.%s\n", col::kRed, col::kReset);
+        return 1;
+    }
+
+    std::string artifactsDir = argv[2];
+    if (!WriteSessionFile(artifactsDir, time(NULL)))
+        return 1;
 
     printf("%sBuild tracing started. Do some Clang builds with '-ftime-trace', then run 'ClangBuildAnalyzer --stop %s <filename>' to stop tracing and save session to a file.%s\n", col::kYellow, artifactsDir.c_str(), col::kReset);
 
@@ -106,69 +216,370 @@ static time_t FiletimeToTime(const FILETIME& ft)
     ull.HighPart = ft.dwHighDateTime;
     return ull.QuadPart / 10000000ULL - 11644473600ULL;
 }
+
+static int64_t FiletimeToMicroseconds(const FILETIME& ft)
+{
+    ULARGE_INTEGER ull;
+    ull.LowPart = ft.dwLowDateTime;
+    ull.HighPart = ft.dwHighDateTime;
+    return int64_t(ull.QuadPart / 10ULL) - 11644473600LL * 1000000LL;
+}
 #endif
 
 struct JsonFileFinder
 {
     time_t startTime;
     time_t endTime;
-    std::map<std::string, std::string> files; // have it sorted by path
 
-    void OnFile(cf_file_t* f)
+    struct Candidate
+    {
+        std::string path; // as found on disk
+        std::string name; // with forward slashes, as written into result
+        time_t modTime;
+        int64_t modTimeUs; // same, in microseconds since the Unix epoch
+        bool compressed; // .json.gz file; name does not have the .gz
+    };
+    std::vector<Candidate> files;
+
+    bool IsCandidate(cf_file_t* f, time_t& outModTime, int64_t& outModTimeUs, bool& outCompressed) const
     {
-        // extension has to be json
+        // extension has to be json, or json.gz
         const char* ext = cf_get_ext(f);
-        if (ext == NULL || strcmp(ext, ".json") != 0)
-            return;
+        if (ext == NULL)
+            return false;
+        size_t nameLen = strlen(f->name);
+        outCompressed = strcmp(ext, ".gz") == 0 && nameLen > 8 && strcmp(f->name + nameLen - 8, ".json.gz") == 0;
+        if (strcmp(ext, ".json") != 0 && !outCompressed)
+            return false;
 
         // modification time between our session start & end
-        cf_time_t mtime;
-        if (!cf_get_file_time(f->path, &mtime))
-            return;
         time_t fileModTime;
 #ifdef _MSC_VER
+        cf_time_t mtime;
+        if (!cf_get_file_time(f->path, &mtime))
+            return false;
         fileModTime = FiletimeToTime(mtime.time);
+        outModTimeUs = FiletimeToMicroseconds(mtime.time);
 #else
-        fileModTime = mtime.time;
+        fileModTime = f->info.st_mtime; // already there from reading the directory
+#ifdef __APPLE__
+        outModTimeUs = int64_t(f->info.st_mtimespec.tv_sec) * 1000000 + f->info.st_mtimespec.tv_nsec / 1000;
+#else
+        outModTimeUs = int64_t(f->info.st_mtim.tv_sec) * 1000000 + f->info.st_mtim.tv_nsec / 1000;
+#endif
 #endif
+        outModTime = fileModTime;
+        return fileModTime >= startTime && fileModTime <= endTime;
+    }
 
-        if (fileModTime < startTime || fileModTime > endTime)
-            return;
+    // Walks the directory tree one level at a time; directories of each level are
+    // read on several threads.
+    void Traverse(const std::string& root)
+    {
+        std::vector<std::string> dirs(1, root);
+        while (!dirs.empty())
+        {
+            std::vector<std::vector<std::string>> subdirs(dirs.size());
+            std::vector<std::vector<Candidate>> found(dirs.size());
+            parallel::ForEach(dirs.size(), [&](size_t index)
+            {
+                cf_dir_t dir;
+                if (!cf_dir_open(&dir, dirs[index].c_str()))
+                    return;
+                while (dir.has_next)
+                {
+                    cf_file_t f;
+                    if (cf_read_file(&dir, &f))
+                    {
+                        if (f.is_dir && f.name[0] != '.')
+                            subdirs[index].emplace_back(f.path);
+                        Candidate c;
+                        if (f.is_reg && IsCandidate(&f, c.modTime, c.modTimeUs, c.compressed))
+                        {
+                            // replace backslash with forward slash to avoid json errors on Windows
+                            c.path = f.path;
+                            c.name = c.path;
+                            std::replace(c.name.begin(), c.name.end(), '\\', '/');
+                            if (c.compressed)
+                                c.name.resize(c.name.size() - 3);
+                            found[index].emplace_back(c);
+                        }
+                    }
+                    cf_dir_next(&dir);
+                }
+                cf_dir_close(&dir);
+            });
+
+            std::vector<std::string> next;
+            for (size_t i = 0; i != dirs.size(); ++i)
+            {
+                files.insert(files.end(), found[i].begin(), found[i].end());
+                next.insert(next.end(), subdirs[i].begin(), subdirs[i].end());
+            }
+            dirs.swap(next);
+        }
+    }
+
+    // have them sorted by path
+    void Sort()
+    {
+        std::stable_sort(files.begin(), files.end(), [](const Candidate& a, const Candidate& b) { return a.name < b.name; });
+        files.erase(std::unique(files.begin(), files.end(), [](const Candidate& a, const Candidate& b) { return a.name == b.name; }), files.end());
+    }
+};
+
+// Finds needle in data that is not necessarily zero terminated.
+static const char* FindString(const char* data, size_t size, const char* needle)
+{
+    size_t needleLen = strlen(needle);
+    if (needleLen == 0 || size < needleLen)
+        return NULL;
+    const char* last = data + size - needleLen;
+    for (const char* p = data; p <= last; ++p)
+    {
+        p = (const char*)memchr(p, needle[0], last - p + 1);
+        if (p == NULL)
+            return NULL;
+        if (memcmp(p, needle, needleLen) == 0)
+            return p;
+    }
+    return NULL;
+}
+
+// Whether a file starting with these bytes can be a clang trace: it is a json object,
+// and not our own merged json file (which starts with the marker). Needs only the first
+// block of a compressed file, so that others are not decompressed whole.
+static bool CanBeTraceStart(const char* data, size_t size)
+{
+    const char* analyzerMarker = "{\"ClangBuildAnalyzerMarker\":\"BigJsonFile\",";
+    const size_t analyzerMarkerLen = strlen(analyzerMarker);
+    if (size >= analyzerMarkerLen && memcmp(data, analyzerMarker, analyzerMarkerLen) == 0)
+        return false;
+    size_t pos = 0;
+    while (pos != size && isspace((unsigned char)data[pos]))
+        ++pos;
+    return pos == size || data[pos] == '{';
+}
+
+static bool IsValidTrace(const JsonFileFinder::Candidate& file, const char* data, size_t size)
+{
+    if (size == 0)
+    {
+        printf("%s  WARN: could not read file '%s'.%s\n", col::kYellow, file.path.c_str(), col::kReset);
+        return false;
+    }
+
+    // do not grab our own merged json file, or things that are not json objects
+    if (!CanBeTraceStart(data, size))
+        return false;
+
+    // there might be non-clang time trace json files around; the clang ones have
+    // this metadata event after all the trace events, followed by at most a few more
+    // metadata events. Only the end of the file is looked at, so that big non-clang
+    // files are rejected without reading all of them in.
+    const char* clangMarker = "{\"cat\":\"\",\"pid\":1,\"tid\":0,\"ts\":0,\"ph\":\"M\",\"name\":\"process_name\",\"args\":{\"name\":\"clang\"}}";
+    const size_t kTailSize = 64 * 1024;
+    size_t tailSize = std::min(size, kTailSize);
+    if (FindString(data + size - tailSize, tailSize, clangMarker) == NULL)
+        return false;
+
+    return true;
+}
 
-        // read the file
-        std::string str = ReadFileToString(f->path);
-        if (str.empty())
+// Contents of a found trace file: mapped (copy-on-write if it is going to be parsed in
+// place), or decompressed into memory for .json.gz files.
+class TraceFileData
+{
+public:
+    // returns false (with a warning) only when a compressed file could not be decompressed.
+    // A compressed file whose first bytes show it is not a trace is only decompressed up to
+    // there; IsValidTrace rejects what is there the same way.
+    bool Open(const JsonFileFinder::Candidate& file, bool copyOnWrite = false)
+    {
+        m_Mapped.Open(file.path.c_str(), copyOnWrite);
+        if (!file.compressed)
+            return true;
+        m_Compressed = true;
+        if (m_Mapped.GetSize() == 0)
+            return true;
+        GzipReader reader(m_Mapped.GetData(), m_Mapped.GetSize());
+        bool more = IsGzipData(m_Mapped.GetData(), m_Mapped.GetSize());
+        while (more && m_Decompressed.empty())
+            more = reader.Read(m_Decompressed);
+        if (more && !CanBeTraceStart(m_Decompressed.data(), m_Decompressed.size()))
+            return true;
+        while (more)
+            more = reader.Read(m_Decompressed);
+        if (!IsGzipData(m_Mapped.GetData(), m_Mapped.GetSize()) || reader.Failed())
         {
-            printf("%s  WARN: could not read file '%s'.%s\n", col::kYellow, f->path, col::kReset);
-            return;
+            printf("%s  WARN: could not decompress file '%s'.%s\n", col::kYellow, file.path.c_str(), col::kReset);
+            return false;
         }
+        return true;
+    }
 
-        // there might be non-clang time trace json files around;
-        // the clang ones should have this inside them
-        const char* clangMarker = "{\"cat\":\"\",\"pid\":1,\"tid\":0,\"ts\":0,\"ph\":\"M\",\"name\":\"process_name\",\"args\":{\"name\":\"clang\"}}";
-        if (strstr(str.c_str(), clangMarker) == NULL)
-            return;
+    const char* GetData() const { return m_Compressed ? m_Decompressed.data() : m_Mapped.GetData(); }
+    char* GetWritableData() { return m_Compressed ? m_Decompressed.data() : m_Mapped.GetWritableData(); }
+    size_t GetSize() const { return m_Compressed ? m_Decompressed.size() : m_Mapped.GetSize(); }
+
+private:
+    MappedFile m_Mapped;
+    std::vector<char> m_Decompressed;
+    bool m_Compressed = false;
+};
+
+// Reads & validates found json files on worker threads, and writes them
+// into the result file strictly in sorted order as soon as each one is ready.
+// Files are memory mapped, and at most one file per thread is mapped at any time.
+struct JsonFileWriter
+{
+    FILE* fout;
+    GzipWriter* gzip; // compresses the output when not null
+    const std::vector<JsonFileFinder::Candidate>& files;
+    std::mutex mutex;
+    std::condition_variable writeDone;
+    size_t nextToWrite = 0;
+    size_t writtenCount = 0;
+    size_t writtenBytes = 0;
+    bool writeError = false;
+    // modification times of written files, i.e. when each compile finished
+    bool withFileTimes;
+    std::vector<const JsonFileFinder::Candidate*> writtenFiles;
+
+    JsonFileWriter(FILE* fout_, GzipWriter* gzip_, const std::vector<JsonFileFinder::Candidate>& files_, bool withFileTimes_)
+    : fout(fout_), gzip(gzip_), files(files_), withFileTimes(withFileTimes_)
+    {
+    }
 
-        // do not grab our own merged json file!
-        const char* analyzerMarker = "{\"ClangBuildAnalyzerMarker\":\"BigJsonFile\",";
-        if (strstr(str.c_str(), analyzerMarker) != NULL)
+    void Write(const char* data, size_t size)
+    {
+        if (writeError)
+            return;
+        if (gzip)
+        {
+            if (!gzip->Write(data, size))
+                writeError = true;
+            else
+                writtenBytes += size;
             return;
+        }
+        size_t written = fwrite(data, 1, size, fout);
+        writtenBytes += written;
+        if (written != size)
+            writeError = true;
+    }
+    void Write(const char* str) { Write(str, strlen(str)); }
+
+    void ProcessFile(size_t index)
+    {
+        const auto& file = files[index];
+        TraceFileData str;
+        bool valid;
+        {
+            timing::Scope timingScope(timing::kReadFiles);
+            valid = str.Open(file) && IsValidTrace(file, str.GetData(), str.GetSize());
+        }
+        timing::Count(timing::kFilesRead);
+        if (valid)
+            timing::Count(timing::kBytesRead, str.GetSize());
 
-        // replace backslash with forward slash to avoid json errors on Windows
-        std::string path = f->path;
-        std::replace(path.begin(), path.end(), '\\', '/');
-        files.insert(std::make_pair(path, str));
-        //printf("    debug: reading %s\n", f->path);
+        std::unique_lock<std::mutex> lock(mutex);
+        writeDone.wait(lock, [&]() { return nextToWrite == index; });
+        if (valid)
+        {
+            if (writtenCount != 0)
+                Write(",\n");
+            Write("\"");
+            Write(file.name.c_str());
+            Write("\":\n");
+            Write(str.GetData(), str.GetSize());
+            ++writtenCount;
+            writtenFiles.push_back(&file);
+        }
+        ++nextToWrite;
+        lock.unlock();
+        writeDone.notify_all();
     }
 
-    static void Callback(cf_file_t* f, void* userData)
+    void Run()
     {
-        JsonFileFinder* self = (JsonFileFinder*)userData;
-        self->OnFile(f);
+        Write("{\"ClangBuildAnalyzerMarker\":\"BigJsonFile\",\n");
+        Write("\"files\":{\n");
+        parallel::ForEach(files.size(), [&](size_t index) { ProcessFile(index); });
+        if (writtenCount != 0)
+            Write("\n");
+        Write("\n}");
+        if (withFileTimes)
+        {
+            Write(",\n\"traceFileTimes\":{\n");
+            char buf[32];
+            for (size_t i = 0; i != writtenFiles.size(); ++i)
+            {
+                if (i != 0)
+                    Write(",\n");
+                Write("\"");
+                Write(writtenFiles[i]->name.c_str());
+                snprintf(buf, sizeof(buf), "\":%lld", (long long)writtenFiles[i]->modTimeUs);
+                Write(buf);
+            }
+            Write("\n}");
+        }
+        Write("}\n");
     }
 };
 
-static int RunStop(int argc, const char* argv[])
+// Writes the big json capture out of the given trace files, gzip compressed
+// when the name ends with .gz; files that are not valid traces are left out.
+static bool WriteCapture(const std::string& outFile, const std::vector<JsonFileFinder::Candidate>& files, bool withFileTimes, const std::string& artifactsDir)
+{
+    // create a big json file out of all the found ones; write into a temporary
+    // file first (not a .json, so it won't be picked up as a trace while we're at it)
+    std::string tmpFile = outFile + ".tmp";
+    FILE* fout = fopen(tmpFile.c_str(), "wb");
+    if (!fout)
+    {
+        printf("%sERROR: failed to write result file '%s'.%s\n", col::kRed, outFile.c_str(), col::kReset);
+        return false;
+    }
+    // capture named *.gz is compressed
+    bool compress = outFile.size() > 3 && outFile.compare(outFile.size() - 3, 3, ".gz") == 0;
+    GzipWriter gzip(fout);
+    JsonFileWriter writer(fout, compress ? &gzip : nullptr, files, withFileTimes);
+    {
+        timing::Scope timingScope(timing::kWriteCapture);
+        writer.Run();
+        if (compress && !gzip.Finish())
+            writer.writeError = true;
+        if (fclose(fout) != 0)
+            writer.writeError = true;
+    }
+
+    if (writer.writeError)
+    {
+        printf("%sERROR: failed to write result file '%s', %zu bytes written.%s\n",
+            col::kRed, outFile.c_str(), writer.writtenBytes, col::kReset);
+        remove(tmpFile.c_str());
+        return false;
+    }
+    if (writer.writtenCount == 0)
+    {
+        printf("%sERROR: no clang -ftime-trace .json files found under '%s'.%s\n", col::kRed, artifactsDir.c_str(), col::kReset);
+        remove(tmpFile.c_str());
+        return false;
+    }
+    remove(outFile.c_str());
+    if (rename(tmpFile.c_str(), outFile.c_str()) != 0)
+    {
+        printf("%sERROR: failed to write result file '%s'.%s\n", col::kRed, outFile.c_str(), col::kReset);
+        remove(tmpFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+// withFileTimes: also write when each trace file was written, so that the
+// analysis can put the compiles on one timeline
+static int RunStop(int argc, const char* argv[], bool withFileTimes = true)
 {
     if (argc < 4)
     {
@@ -202,7 +613,11 @@ static int RunStop(int argc, const char* argv[])
     JsonFileFinder jsonFiles;
     jsonFiles.startTime = startTime;
     jsonFiles.endTime = stopTime;
-    cf_traverse(artifactsDir.c_str(), JsonFileFinder::Callback, &jsonFiles);
+    {
+        timing::Scope timingScope(timing::kScanFiles);
+        jsonFiles.Traverse(artifactsDir);
+        jsonFiles.Sort();
+    }
 
     if (jsonFiles.files.empty())
     {
@@ -210,40 +625,8 @@ static int RunStop(int argc, const char* argv[])
         return 1;
     }
 
-    // create a big json file out of all the found ones
-    std::string bigJson;
-    bigJson.reserve(4*1024*1024);
-    bigJson += "{\"ClangBuildAnalyzerMarker\":\"BigJsonFile\",\n";
-    bigJson += "\"files\":{\n";
-    size_t jsonIndex = 0;
-    for (const auto& kvp : jsonFiles.files)
-    {
-        bigJson += "\"";
-        bigJson += kvp.first;
-        bigJson += "\":\n";
-        bigJson += kvp.second;
-        if (jsonIndex != jsonFiles.files.size()-1)
-            bigJson += ",";
-        bigJson += "\n";
-        ++jsonIndex;
-    }
-    bigJson += "\n}}\n";
-
-    FILE* fout = fopen(outFile.c_str(), "wb");
-    if (!fout)
-    {
-        printf("%sERROR: failed to write result file '%s'.%s\n", col::kRed, outFile.c_str(), col::kReset);
+    if (!WriteCapture(outFile, jsonFiles.files, withFileTimes, artifactsDir))
         return 1;
-    }
-    const size_t numBytesWritten = fwrite(bigJson.data(), 1, bigJson.size(), fout);
-    if (numBytesWritten != bigJson.size())
-    {
-        printf("%sERROR: failed to write result file '%s', %zu of %zu bytes written.%s\n",
-            col::kRed, outFile.c_str(), numBytesWritten, bigJson.size(), col::kReset);
-        fclose(fout);
-        return 1;
-    }
-    fclose(fout);
 
     double tDuration = stm_sec(stm_since(tStart));
     printf("%s  done in %.1fs. Run 'ClangBuildAnalyzer --analyze %s' to analyze it.%s\n", col::kYellow, tDuration, outFile.c_str(), col::kReset);
@@ -251,133 +634,817 @@ static int RunStop(int argc, const char* argv[])
     return 0;
 }
 
+// Set from the signal handler when --watch should finish.
+static volatile sig_atomic_t s_WatchStopRequested = 0;
 
-static int RunAnalyze(int argc, const char* argv[], FILE* out)
+static void OnWatchStopSignal(int)
 {
-    if (argc < 3)
+    s_WatchStopRequested = 1;
+}
+
+// Trace file seen by --watch; it is parsed as soon as the file is done being written.
+// Only the analysis part of it is kept (the same aggregates --analyze-shard writes),
+// not all of its events, so that memory use does not grow with the size of the build.
+struct WatchedTrace
+{
+    JsonFileFinder::Candidate file;
+    bool parsed = false; // not a clang trace (or failed to parse) otherwise
+    bool failed = false;
+    std::string part;
+};
+
+static bool IsJsonCaptureName(const std::string& name)
+{
+    return utils::EndsWith(name, ".json") || utils::EndsWith(name, ".json.gz");
+}
+
+// Polls artifactsDir for trace files until s_WatchStopRequested is set, then saves
+// the capture of them into outFile like --stop does, and writes the analysis into out.
+static int WatchTraces(const std::string& artifactsDir, const std::string& outFile, time_t startTime, FILE* out)
+{
+    // keyed by name, i.e. in the same order as --stop would write them
+    std::map<std::string, WatchedTrace> traces;
+    std::vector<std::string> present;
+    const int kPollIntervalMs = 1000;
+    while (true)
     {
-        printf("%sERROR: --analyze requires <filename> to be passed.%s\n", col::kRed, col::kReset);
-        return 1;
+        // the scan after a stop request is the last one
+        bool stopping = s_WatchStopRequested != 0;
+        time_t now = time(NULL);
+        JsonFileFinder finder;
+        finder.startTime = startTime;
+        finder.endTime = now;
+        finder.Traverse(artifactsDir);
+        finder.Sort();
+
+        // new & changed files are picked up once they have not been modified for a couple
+        // of seconds, i.e. clang is done writing them; all of them when stopping
+        std::vector<std::pair<const JsonFileFinder::Candidate*, WatchedTrace*>> ready;
+        present.clear();
+        for (const auto& file : finder.files)
+        {
+            present.push_back(file.name);
+            auto it = traces.find(file.name);
+            if (it != traces.end() && it->second.file.modTimeUs == file.modTimeUs)
+                continue;
+            if (!stopping && file.modTime + 1 >= now)
+                continue;
+            ready.emplace_back(&file, &traces[file.name]);
+        }
+        parallel::ForEach(ready.size(), [&](size_t index)
+        {
+            const JsonFileFinder::Candidate& file = *ready[index].first;
+            WatchedTrace& trace = *ready[index].second;
+            trace.file = file;
+            trace.parsed = trace.failed = false;
+            trace.part.clear();
+            TraceFileData mapped;
+            if (!mapped.Open(file, true) || !IsValidTrace(file, mapped.GetData(), mapped.GetSize()))
+                return;
+            timing::Count(timing::kFilesRead);
+            timing::Count(timing::kBytesRead, mapped.GetSize());
+            BuildEvents fileEvents, events;
+            BuildNames fileNames, names;
+            trace.failed = !ParseTraceFile(file.name, mapped.GetWritableData(), mapped.GetSize(), fileEvents, fileNames);
+            if (trace.failed)
+                return;
+            // on the timeline of the whole build, like the file times of a --stop capture do
+            AppendBuildEvents(fileEvents, fileNames, events, names, file.modTimeUs);
+            MakeAnalysisPart(events, names, trace.part);
+            trace.parsed = true;
+        });
+        if (!ready.empty())
+        {
+            size_t parsedCount = 0;
+            for (const auto& kv : traces)
+                parsedCount += kv.second.parsed ? 1 : 0;
+            printf("%s  %zu trace files parsed so far.%s\n", col::kYellow, parsedCount, col::kReset);
+        }
+        if (stopping)
+            break;
+        for (int i = 0; i < kPollIntervalMs / 100 && !s_WatchStopRequested; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
 
     uint64_t tStart = stm_now();
+    printf("%sStopping build tracing and saving to '%s'...%s\n", col::kYellow, outFile.c_str(), col::kReset);
 
-    std::string inFile = argv[2];
-    printf("%sAnalyzing build trace from '%s'...%s\n", col::kYellow, inFile.c_str(), col::kReset);
-
-    // read file
-    std::string inFileStr = ReadFileToString(inFile);
-    if (inFileStr.empty())
+    // files that are gone by now are not part of the result, just like with --stop; ones
+    // that failed to parse are left out, so that the rest of the session is still saved
+    std::vector<JsonFileFinder::Candidate> files;
+    std::vector<std::string> parts;
+    for (const auto& name : present)
     {
-        printf("%sERROR: failed to open file '%s'.%s\n", col::kRed, inFile.c_str(), col::kReset);
-        return 1;
+        WatchedTrace& trace = traces[name];
+        if (trace.failed)
+            printf("%sWARN: skipping trace file '%s' that failed to parse.%s\n", col::kYellow, name.c_str(), col::kReset);
+        if (!trace.parsed)
+            continue;
+        files.push_back(trace.file);
+        parts.push_back(std::move(trace.part));
     }
-
-    BuildEvents events;
-    BuildNames names;
-    events.reserve(2048);
-    names.reserve(2048);
-    ParseBuildEvents(inFileStr, events, names);
-    if (events.empty())
+    if (files.empty())
     {
-        printf("%s  no trace events found.%s\n", col::kYellow, col::kReset);
+        printf("%sERROR: no clang -ftime-trace .json files found under '%s'.%s\n", col::kRed, artifactsDir.c_str(), col::kReset);
         return 1;
     }
+    if (!WriteCapture(outFile, files, true, artifactsDir))
+        return 1;
 
-    DoAnalysis(events, names, out);
+    if (!DoMergedAnalysisOfParts(parts, out))
+        return 1;
 
     double tDuration = stm_sec(stm_since(tStart));
-    printf("%s  done in %.1fs.%s\n", col::kYellow, tDuration, col::kReset);
+    printf("%s  done in %.1fs. Run 'ClangBuildAnalyzer --analyze %s' to analyze it again.%s\n", col::kYellow, tDuration, outFile.c_str(), col::kReset);
 
     return 0;
 }
 
-static int RunOneTest(const std::string& folder)
+static int RunWatch(int argc, const char* argv[])
 {
-    printf("%sRunning test '%s'...%s\n", col::kYellow, folder.c_str(), col::kReset);
-    std::string traceFile = folder + "/_TraceOutput.json";
-    std::string traceExpFile = folder + "/_TraceOutputExpected.json";
-    const char* kStopArgs[] =
+    if (argc < 4)
     {
-        "",
-        "--stop",
-        folder.c_str(),
-        traceFile.c_str()
-    };
-    if (RunStop(4, kStopArgs) != 0)
-        return false;
+        printf("%sERROR: --watch requires <artifactsdir> <filename> to be passed.%s\n", col::kRed, col::kReset);
+        return 1;
+    }
 
-    std::string gotTrace = ReadFileToString(traceFile);
-    std::string expTrace = ReadFileToString(traceExpFile);
-    if (!CompareIgnoreNewlines(gotTrace, expTrace))
+    std::string artifactsDir = argv[2];
+    std::string outFile = argv[3];
+    if (!IsJsonCaptureName(outFile))
     {
-        printf("%sTrace json file (%s) and expected json file (%s) do not match%s\n", col::kRed, traceFile.c_str(), traceExpFile.c_str(), col::kReset);
-        return false;
+        printf("%sERROR: --watch saves a json capture, so '%s' has to end with .json or .json.gz; use --convert on it afterwards for a binary one.%s\n", col::kRed, outFile.c_str(), col::kReset);
+        return 1;
     }
+    time_t startTime = time(NULL);
+    if (!WriteSessionFile(artifactsDir, startTime))
+        return 1;
+    printf("%sWatching '%s' for build traces. Do some Clang builds with '-ftime-trace', then press Ctrl+C (or send SIGTERM) to save them to '%s' and analyze.%s\n", col::kYellow, artifactsDir.c_str(), outFile.c_str(), col::kReset);
 
-    std::string analyzeFile = folder + "/_AnalysisOutput.txt";
-    std::string analyzeExpFile = folder + "/_AnalysisOutputExpected.txt";
-    const char* kAnalyzeArgs[] =
-    {
-        "",
-        "--analyze",
-        traceFile.c_str()
-    };
-    FILE* out = fopen(analyzeFile.c_str(), "wb");
-    if (!out)
+    signal(SIGINT, OnWatchStopSignal);
+    signal(SIGTERM, OnWatchStopSignal);
+
+    return WatchTraces(artifactsDir, outFile, startTime, stdout);
+}
+
+
+// Loads a capture: either json one from --stop (mapped copy-on-write, since json parsing
+// modifies it in place), or binary one from --convert (copied out of it, no parsing needed). The mapping
+// has to stay around while the events are used. Compressed json captures are parsed
+// as they are being decompressed.
+static bool LoadCapture(const std::string& inFile, MappedFile& mapped, BuildEvents& events, BuildNames& names, std::vector<std::string>* outUsedCacheEntries = nullptr)
+{
+    if (!mapped.Open(inFile.c_str(), true) || mapped.GetSize() == 0)
     {
-        printf("%sFailed to create analysis output file '%s'%s\n", col::kRed, analyzeFile.c_str(), col::kReset);
+        printf("%sERROR: failed to open file '%s'.%s\n", col::kRed, inFile.c_str(), col::kReset);
         return false;
     }
-    col::Initialize(true);
-    int analysisResult = RunAnalyze(3, kAnalyzeArgs, out);
-    col::Initialize();
-    fclose(out);
-    if (analysisResult != 0)
-        return false;
-
-    std::string gotAnalysis = ReadFileToString(analyzeFile);
-    std::string expAnalysis = ReadFileToString(analyzeExpFile);
-    if (!CompareIgnoreNewlines(gotAnalysis, expAnalysis))
+    timing::Count(timing::kFilesRead);
+    timing::Count(timing::kBytesRead, mapped.GetSize());
+    if (IsBuildEventsBinary(mapped.GetData(), mapped.GetSize()))
+    {
+        if (!LoadBuildEventsBinary(mapped.GetData(), mapped.GetSize(), events, names))
+            return false;
+    }
+    else if (IsGzipData(mapped.GetData(), mapped.GetSize()))
     {
-        printf("%sAnalysis output (%s) and expected output (%s) do not match%s\n", col::kRed, analyzeFile.c_str(), analyzeExpFile.c_str(), col::kReset);
-        printf("--- Got:\n%s\n", gotAnalysis.c_str());
-        printf("--- Expected:\n%s\n", expAnalysis.c_str());
+        events.reserve(2048);
+        names.reserve(2048);
+        if (!CreateCacheDir())
+            return false;
+        GzipReader reader(mapped.GetData(), mapped.GetSize());
+        auto readMore = [&](std::vector<char>& buffer)
+        {
+            if (reader.Read(buffer))
+                return true;
+            if (reader.Failed())
+                printf("%sERROR: failed to decompress file '%s'.%s\n", col::kRed, inFile.c_str(), col::kReset);
+            return false;
+        };
+        ParseBuildEventsStream(readMore, events, names, s_CacheDir, outUsedCacheEntries);
+    }
+    else
+    {
+        events.reserve(2048);
+        names.reserve(2048);
+        if (!CreateCacheDir())
+            return false;
+        ParseBuildEvents(mapped.GetWritableData(), mapped.GetSize(), events, names, s_CacheDir, outUsedCacheEntries);
+    }
+    if (events.empty())
+    {
+        printf("%s  no trace events found.%s\n", col::kYellow, col::kReset);
         return false;
     }
-
     return true;
 }
 
-static int RunTests(int argc, const char* argv[])
+static int RunConvert(int argc, const char* argv[])
 {
-    if (argc < 3)
+    if (argc < 4)
     {
-        printf("%sERROR: --test requires <test_folder> to be passed.%s\n", col::kRed, col::kReset);
+        printf("%sERROR: --convert requires <filename> <binaryfile> to be passed.%s\n", col::kRed, col::kReset);
         return 1;
     }
 
     uint64_t tStart = stm_now();
 
-    std::string testsFolder = argv[2];
-    printf("%sRunning tests under '%s'...%s\n", col::kYellow, testsFolder.c_str(), col::kReset);
+    std::string inFile = argv[2];
+    std::string outFile = argv[3];
+    printf("%sConverting build trace from '%s' into '%s'...%s\n", col::kYellow, inFile.c_str(), outFile.c_str(), col::kReset);
+
+    BuildEvents events;
+    BuildNames names;
+    MappedFile mapped;
+    if (!LoadCapture(inFile, mapped, events, names))
+        return 1;
+
+    if (!SaveBuildEventsBinary(outFile, events, names))
+    {
+        printf("%sERROR: failed to write result file '%s'.%s\n", col::kRed, outFile.c_str(), col::kReset);
+        return 1;
+    }
+
+    double tDuration = stm_sec(stm_since(tStart));
+    printf("%s  done in %.1fs. Run 'ClangBuildAnalyzer --analyze %s' to analyze it.%s\n", col::kYellow, tDuration, outFile.c_str(), col::kReset);
+
+    return 0;
+}
+
+static int RunAnalyze(int argc, const char* argv[], FILE* out, ReportFormat format = ReportFormat::kText)
+{
+    if (argc < 3)
+    {
+        printf("%sERROR: --analyze requires <filename> to be passed.%s\n", col::kRed, col::kReset);
+        return 1;
+    }
+
+    uint64_t tStart = stm_now();
+
+    std::string inFile = argv[2];
+    printf("%sAnalyzing build trace from '%s'...%s\n", col::kYellow, inFile.c_str(), col::kReset);
+
+    BuildEvents events;
+    BuildNames names;
+    MappedFile mapped;
+    if (!LoadCapture(inFile, mapped, events, names))
+        return 1;
+
+    DoAnalysis(events, names, out, format);
+
+    double tDuration = stm_sec(stm_since(tStart));
+    printf("%s  done in %.1fs.%s\n", col::kYellow, tDuration, col::kReset);
+
+    return 0;
+}
+
+// Aggregates one part of the files of a json capture into a partial analysis file, for
+// captures too big to analyze in one go; --merge of all the parts prints the report.
+static int RunAnalyzeShard(int argc, const char* argv[])
+{
+    if (argc < 6)
+    {
+        printf("%sERROR: --analyze-shard requires <filename> <index> <count> <partfile> to be passed.%s\n", col::kRed, col::kReset);
+        return 1;
+    }
+    int shardIndex = atoi(argv[3]);
+    int shardCount = atoi(argv[4]);
+    if (shardCount < 1 || shardIndex < 0 || shardIndex >= shardCount)
+    {
+        printf("%sERROR: --analyze-shard <index> should be from 0 to <count>-1.%s\n", col::kRed, col::kReset);
+        return 1;
+    }
+
+    uint64_t tStart = stm_now();
+
+    std::string inFile = argv[2];
+    std::string outFile = argv[5];
+    printf("%sAnalyzing part %i of %i of build trace from '%s' into '%s'...%s\n", col::kYellow, shardIndex + 1, shardCount, inFile.c_str(), outFile.c_str(), col::kReset);
+
+    MappedFile mapped;
+    if (!mapped.Open(inFile.c_str(), true) || mapped.GetSize() == 0)
+    {
+        printf("%sERROR: failed to open file '%s'.%s\n", col::kRed, inFile.c_str(), col::kReset);
+        return 1;
+    }
+    timing::Count(timing::kFilesRead);
+    timing::Count(timing::kBytesRead, mapped.GetSize());
+    if (IsBuildEventsBinary(mapped.GetData(), mapped.GetSize()) || IsGzipData(mapped.GetData(), mapped.GetSize()))
+    {
+        printf("%sERROR: --analyze-shard needs an uncompressed json capture from --stop.%s\n", col::kRed, col::kReset);
+        return 1;
+    }
+
+    // the cache folder can be shared by all the shards, so entries of files that are not
+    // in this one are kept
+    BuildEvents events;
+    BuildNames names;
+    std::vector<std::string> usedCacheEntries;
+    if (!CreateCacheDir())
+        return 1;
+    if (!ParseBuildEventsShard(mapped.GetWritableData(), mapped.GetSize(), shardIndex, shardCount, events, names, s_CacheDir, &usedCacheEntries))
+        return 1;
+    if (!SaveAnalysisPart(events, names, outFile))
+    {
+        printf("%sERROR: failed to write result file '%s'.%s\n", col::kRed, outFile.c_str(), col::kReset);
+        return 1;
+    }
+
+    double tDuration = stm_sec(stm_since(tStart));
+    printf("%s  done in %.1fs.%s\n", col::kYellow, tDuration, col::kReset);
+
+    return 0;
+}
+
+static int RunMerge(int argc, const char* argv[], FILE* out, ReportFormat format = ReportFormat::kText)
+{
+    if (argc < 3)
+    {
+        printf("%sERROR: --merge requires <partfile> to be passed.%s\n", col::kRed, col::kReset);
+        return 1;
+    }
+
+    uint64_t tStart = stm_now();
+
+    std::vector<std::string> partFiles(argv + 2, argv + argc);
+    printf("%sMerging %zu analysis parts...%s\n", col::kYellow, partFiles.size(), col::kReset);
+    if (!DoMergedAnalysis(partFiles, out, format))
+        return 1;
+
+    double tDuration = stm_sec(stm_since(tStart));
+    printf("%s  done in %.1fs.%s\n", col::kYellow, tDuration, col::kReset);
+
+    return 0;
+}
+
+// Makes stdout go into stderr, and returns a file that writes into the original stdout.
+static FILE* RedirectStdoutToStderr()
+{
+    fflush(stdout);
+#ifdef _MSC_VER
+    int fd = _dup(_fileno(stdout));
+    _dup2(_fileno(stderr), _fileno(stdout));
+    return _fdopen(fd, "wb");
+#else
+    int fd = dup(fileno(stdout));
+    dup2(fileno(stderr), fileno(stdout));
+    return fdopen(fd, "wb");
+#endif
+}
+
+static int RunDiff(int argc, const char* argv[], FILE* out)
+{
+    if (argc < 4)
+    {
+        printf("%sERROR: --diff requires <oldfile> <newfile> to be passed.%s\n", col::kRed, col::kReset);
+        return 1;
+    }
+
+    uint64_t tStart = stm_now();
+
+    std::string inFiles[2] = { argv[2], argv[3] };
+    printf("%sComparing build trace '%s' to '%s'...%s\n", col::kYellow, inFiles[1].c_str(), inFiles[0].c_str(), col::kReset);
+
+    // both captures are loaded at the same time; with a cache, entries used by either
+    // one are kept
+    BuildEvents events[2];
+    BuildNames names[2];
+    MappedFile mapped[2];
+    bool loaded[2];
+    std::vector<std::string> usedCacheEntries[2];
+    parallel::ForEach(2, [&](size_t i)
+    {
+        loaded[i] = LoadCapture(inFiles[i], mapped[i], events[i], names[i], &usedCacheEntries[i]);
+    });
+    if (!loaded[0] || !loaded[1])
+        return 1;
+    if (!s_CacheDir.empty())
+    {
+        usedCacheEntries[0].insert(usedCacheEntries[0].end(), usedCacheEntries[1].begin(), usedCacheEntries[1].end());
+        RemoveUnusedCacheEntries(s_CacheDir, usedCacheEntries[0]);
+    }
+
+    DoDiffAnalysis(events[0], names[0], events[1], names[1], out);
+
+    double tDuration = stm_sec(stm_since(tStart));
+    printf("%s  done in %.1fs.%s\n", col::kYellow, tDuration, col::kReset);
+
+    return 0;
+}
+
+// Loads a capture once, and answers queries about it that come in from in, until it is
+// closed; replies go to out.
+static int RunServe(int argc, const char* argv[], FILE* in, FILE* out)
+{
+    if (argc < 3)
+    {
+        printf("%sERROR: --serve requires <filename> to be passed.%s\n", col::kRed, col::kReset);
+        return 1;
+    }
+
+    uint64_t tStart = stm_now();
+
+    std::string inFile = argv[2];
+    printf("%sLoading build trace from '%s'...%s\n", col::kYellow, inFile.c_str(), col::kReset);
+
+    BuildEvents events;
+    BuildNames names;
+    MappedFile mapped;
+    if (!LoadCapture(inFile, mapped, events, names))
+        return 1;
+    printf("%s  loaded in %.1fs.%s\n", col::kYellow, stm_sec(stm_since(tStart)), col::kReset);
+
+    DoServe(events, names, in, out);
+    return 0;
+}
+
+// output that run(FILE*) writes into outFile should match the expected file
+template<typename Run>
+static bool RunOneTestOutput(const std::string& outFile, const std::string& expFile, Run run)
+{
+    FILE* out = fopen(outFile.c_str(), "wb");
+    if (!out)
+    {
+        printf("%sFailed to create test output file '%s'%s\n", col::kRed, outFile.c_str(), col::kReset);
+        return false;
+    }
+    col::Initialize(true);
+    int result = run(out);
+    col::Initialize();
+    fclose(out);
+    if (result != 0)
+        return false;
+
+    std::string gotOutput = ReadFileToString(outFile);
+    std::string expOutput = ReadFileToString(expFile);
+    if (!CompareIgnoreNewlines(gotOutput, expOutput))
+    {
+        printf("%sOutput (%s) and expected output (%s) do not match%s\n", col::kRed, outFile.c_str(), expFile.c_str(), col::kReset);
+        printf("--- Got:\n%s\n", gotOutput.c_str());
+        printf("--- Expected:\n%s\n", expOutput.c_str());
+        return false;
+    }
+    return true;
+}
+
+// --analyze of the trace file (or --merge of analysis part files) should produce the expected output
+static bool RunOneTestAnalysis(const std::vector<std::string>& inFiles, const std::string& analyzeFile, const std::string& analyzeExpFile, bool merge = false, ReportFormat format = ReportFormat::kText)
+{
+    std::vector<const char*> args = { "", merge ? "--merge" : "--analyze" };
+    for (const auto& file : inFiles)
+        args.push_back(file.c_str());
+    return RunOneTestOutput(analyzeFile, analyzeExpFile, [&](FILE* out)
+    {
+        return (merge ? RunMerge : RunAnalyze)((int)args.size(), args.data(), out, format);
+    });
+}
+
+// Writes a copy of a file, gzip compressed or not.
+static bool WriteFileCopy(const std::string& from, const std::string& to, bool compress)
+{
+    std::string data = ReadFileToString(from);
+    FILE* out = fopen(to.c_str(), "wb");
+    if (!out)
+    {
+        printf("%sFailed to create test file '%s'%s\n", col::kRed, to.c_str(), col::kReset);
+        return false;
+    }
+    bool ok;
+    if (compress)
+    {
+        GzipWriter gzip(out);
+        ok = gzip.Write(data.data(), data.size()) && gzip.Finish();
+    }
+    else
+        ok = fwrite(data.data(), 1, data.size(), out) == data.size();
+    ok &= fclose(out) == 0;
+    return ok;
+}
+
+// Sets modification times of the trace files under folder to one second apart, in
+// the order of their names, so that a capture with file times comes out the same in
+// every checkout.
+static bool SetTestTraceFileTimes(const std::string& folder)
+{
+    const time_t kBaseTime = 1600000000;
+    JsonFileFinder jsonFiles;
+    jsonFiles.startTime = 0;
+    jsonFiles.endTime = time(NULL);
+    jsonFiles.Traverse(folder);
+    jsonFiles.Sort();
+    for (size_t i = 0; i != jsonFiles.files.size(); ++i)
+    {
+        time_t modTime = kBaseTime + time_t(i);
+#ifdef _MSC_VER
+        struct _utimbuf times = { modTime, modTime };
+        int res = _utime(jsonFiles.files[i].path.c_str(), &times);
+#else
+        struct utimbuf times = { modTime, modTime };
+        int res = utime(jsonFiles.files[i].path.c_str(), &times);
+#endif
+        if (res != 0)
+        {
+            printf("%sFailed to set modification time of '%s'%s\n", col::kRed, jsonFiles.files[i].path.c_str(), col::kReset);
+            return false;
+        }
+    }
+    return true;
+}
+
+static int RunOneTest(const std::string& folder)
+{
+    printf("%sRunning test '%s'...%s\n", col::kYellow, folder.c_str(), col::kReset);
+    std::string traceFile = folder + "/_TraceOutput.json";
+    std::string traceExpFile = folder + "/_TraceOutputExpected.json";
+    const char* kStopArgs[] =
+    {
+        "",
+        "--stop",
+        folder.c_str(),
+        traceFile.c_str()
+    };
+    // trace file times depend on when the test data was checked out
+    if (RunStop(4, kStopArgs, false) != 0)
+        return false;
+
+    std::string gotTrace = ReadFileToString(traceFile);
+    std::string expTrace = ReadFileToString(traceExpFile);
+    if (!CompareIgnoreNewlines(gotTrace, expTrace))
+    {
+        printf("%sTrace json file (%s) and expected json file (%s) do not match%s\n", col::kRed, traceFile.c_str(), traceExpFile.c_str(), col::kReset);
+        return false;
+    }
+
+    // gzip compressed copies of the traces should give the same capture, except for the
+    // folder; they go to a folder outside of this one, so that other captures of it
+    // don't pick them up
+    size_t slash = folder.find_last_of("/\\");
+    std::string gzipParent = (slash == std::string::npos ? std::string(".") : folder.substr(0, slash)) + "/_GzipTraces";
+    std::string gzipFolder = gzipParent + "/" + folder.substr(slash + 1);
+    if (!CreateFolder(gzipParent) || !CreateFolder(gzipFolder) || !WriteFileCopy(folder + "/ClangBuildAnalyzerSession.txt", gzipFolder + "/ClangBuildAnalyzerSession.txt", false))
+        return false;
+    {
+        JsonFileFinder jsonFiles;
+        jsonFiles.startTime = 0;
+        jsonFiles.endTime = time(NULL);
+        jsonFiles.Traverse(folder);
+        for (const auto& file : jsonFiles.files)
+        {
+            std::string name = utils::GetFilename(file.path);
+            if (name[0] != '_' && !file.compressed && !WriteFileCopy(file.path, gzipFolder + "/" + name + ".gz", true))
+                return false;
+        }
+    }
+    std::string gzipInputTraceFile = gzipFolder + "/_TraceOutput.json";
+    const char* kGzipInputStopArgs[] =
+    {
+        "",
+        "--stop",
+        gzipFolder.c_str(),
+        gzipInputTraceFile.c_str()
+    };
+    if (RunStop(4, kGzipInputStopArgs, false) != 0)
+        return false;
+    std::string gotGzipTrace = ReadFileToString(gzipInputTraceFile);
+    for (size_t pos = 0; (pos = gotGzipTrace.find(gzipFolder + "/", pos)) != std::string::npos; pos += folder.size() + 1)
+        gotGzipTrace.replace(pos, gzipFolder.size() + 1, folder + "/");
+    if (!CompareIgnoreNewlines(gotGzipTrace, expTrace))
+    {
+        printf("%sTrace json file of gzip traces (%s) and expected json file (%s) do not match%s\n", col::kRed, gzipInputTraceFile.c_str(), traceExpFile.c_str(), col::kReset);
+        return false;
+    }
+
+    std::string analyzeFile = folder + "/_AnalysisOutput.txt";
+    std::string analyzeExpFile = folder + "/_AnalysisOutputExpected.txt";
+    if (!RunOneTestAnalysis({ traceFile }, analyzeFile, analyzeExpFile))
+        return false;
+    // --format json/csv: quoting of names (templates have commas & quotes in them) and layout of the sections
+    if (!RunOneTestAnalysis({ traceFile }, folder + "/_AnalysisOutput.json", folder + "/_AnalysisOutputExpected.json", false, ReportFormat::kJson))
+        return false;
+    if (!RunOneTestAnalysis({ traceFile }, folder + "/_AnalysisOutput.csv", folder + "/_AnalysisOutputExpected.csv", false, ReportFormat::kCsv))
+        return false;
+
+    // compressed capture should produce the same analysis
+    std::string gzipTraceFile = folder + "/_TraceOutput.json.gz";
+    const char* kGzipStopArgs[] =
+    {
+        "",
+        "--stop",
+        folder.c_str(),
+        gzipTraceFile.c_str()
+    };
+    if (RunStop(4, kGzipStopArgs, false) != 0)
+        return false;
+    if (!RunOneTestAnalysis({ gzipTraceFile }, analyzeFile, analyzeExpFile))
+        return false;
+
+    // with a cache, the first analysis parses all the files and writes their entries, and
+    // the second one loads all of them from there instead; both should be the same
+    const std::string prevCacheDir = s_CacheDir;
+    s_CacheDir = folder + "/_Cache";
+    std::vector<std::string> noEntries;
+    bool cacheOk = CreateCacheDir();
+    if (cacheOk)
+        RemoveUnusedCacheEntries(s_CacheDir, noEntries);
+    for (int run = 0; run != 2 && cacheOk; ++run)
+    {
+        uint64_t parsedBefore = timing::GetCount(timing::kFilesParsed);
+        cacheOk = RunOneTestAnalysis({ traceFile }, analyzeFile, analyzeExpFile);
+        int parsed = int(timing::GetCount(timing::kFilesParsed) - parsedBefore);
+        if (cacheOk && (parsed != 0) != (run == 0))
+        {
+            printf("%sAnalysis with a cache parsed %i files on run %i, expected %s%s\n", col::kRed, parsed, run + 1, run == 0 ? "all of them" : "none", col::kReset);
+            cacheOk = false;
+        }
+    }
+    s_CacheDir = prevCacheDir;
+    if (!cacheOk)
+        return false;
+
+    // binary form of the same trace should produce exactly the same analysis
+    std::string binaryFile = folder + "/_TraceOutput.bin";
+    const char* kConvertArgs[] =
+    {
+        "",
+        "--convert",
+        traceFile.c_str(),
+        binaryFile.c_str()
+    };
+    if (RunConvert(4, kConvertArgs) != 0)
+        return false;
+    if (!RunOneTestAnalysis({ binaryFile }, analyzeFile, analyzeExpFile))
+        return false;
+
+    // so should merging analysis parts of it
+    std::vector<std::string> partFiles;
+    const int kShardCount = 2;
+    for (int shard = 0; shard != kShardCount; ++shard)
+    {
+        partFiles.push_back(folder + "/_TraceOutput" + std::to_string(shard) + ".part");
+        std::string index = std::to_string(shard), count = std::to_string(kShardCount);
+        const char* kShardArgs[] = { "", "--analyze-shard", traceFile.c_str(), index.c_str(), count.c_str(), partFiles.back().c_str() };
+        if (RunAnalyzeShard(6, kShardArgs) != 0)
+            return false;
+    }
+    if (!RunOneTestAnalysis(partFiles, analyzeFile, analyzeExpFile, true))
+        return false;
+
+    // with the [filters] of the folder's config file, only the events and files that
+    // those let through are parsed
+    const ParseFilters prevFilters = GetParseFilters();
+    const std::string prevConfigFile = GetConfigFile();
+    SetConfigFile(folder + "/_FilteredConfig.ini");
+    bool filteredOk = ReadParseFilters(FilterOptions()) && RunOneTestAnalysis({ traceFile }, folder + "/_AnalysisOutputFiltered.txt", folder + "/_AnalysisOutputFilteredExpected.txt");
+    SetConfigFile(prevConfigFile);
+    SetParseFilters(prevFilters);
+    if (!filteredOk)
+        return false;
+
+    // with the folder's directory report settings, the analysis (and a merge of its
+    // parts) also has the directory tree
+    std::string directoriesFile = folder + "/_AnalysisOutputDirectories.txt";
+    std::string directoriesExpFile = folder + "/_AnalysisOutputDirectoriesExpected.txt";
+    SetConfigFile(folder + "/_DirectoriesConfig.ini");
+    bool directoriesOk = RunOneTestAnalysis({ traceFile }, directoriesFile, directoriesExpFile) &&
+        RunOneTestAnalysis(partFiles, directoriesFile, directoriesExpFile, true);
+    SetConfigFile(prevConfigFile);
+    if (!directoriesOk)
+        return false;
+
+    // replies of --serve to a fixed set of queries
+    std::string queriesFile = folder + "/_ServeQueries.txt";
+    FILE* queries = fopen(queriesFile.c_str(), "rb");
+    if (!queries)
+    {
+        printf("%sFailed to open serve queries file '%s'%s\n", col::kRed, queriesFile.c_str(), col::kReset);
+        return false;
+    }
+    const char* kServeArgs[] = { "", "--serve", traceFile.c_str() };
+    bool served = RunOneTestOutput(folder + "/_ServeOutput.txt", folder + "/_ServeOutputExpected.txt", [&](FILE* out) { return RunServe(3, kServeArgs, queries, out); });
+    fclose(queries);
+    if (!served)
+        return false;
+
+    // with the trace file times in the capture, the analysis also has the build schedule
+    std::string timedTraceFile = folder + "/_TraceOutputTimes.json";
+    const char* kTimedStopArgs[] =
+    {
+        "",
+        "--stop",
+        folder.c_str(),
+        timedTraceFile.c_str()
+    };
+    if (!SetTestTraceFileTimes(folder) || RunStop(4, kTimedStopArgs) != 0)
+        return false;
+    if (!RunOneTestAnalysis({ timedTraceFile }, folder + "/_AnalysisOutputTimes.txt", folder + "/_AnalysisOutputTimesExpected.txt"))
+        return false;
+
+    // one poll of --watch that is asked to stop right away: same capture as the --stop
+    // above, and the analysis merged out of its per-file parts is the same too
+    std::string watchTraceFile = folder + "/_WatchTraceOutput.json";
+    s_WatchStopRequested = 1;
+    bool watched = RunOneTestOutput(folder + "/_WatchAnalysisOutput.txt", folder + "/_AnalysisOutputTimesExpected.txt", [&](FILE* out) { return WatchTraces(folder, watchTraceFile, 0, out); });
+    s_WatchStopRequested = 0;
+    if (!watched)
+        return false;
+    if (!CompareIgnoreNewlines(ReadFileToString(watchTraceFile), ReadFileToString(timedTraceFile)))
+    {
+        printf("%sTrace json file of --watch (%s) and of --stop (%s) do not match%s\n", col::kRed, watchTraceFile.c_str(), timedTraceFile.c_str(), col::kReset);
+        return false;
+    }
+
+    return true;
+}
+
+// Writes a binary copy of a capture where the compiles took longer or shorter: durations
+// of all events of every third compiled file are 3/2 of what they were, and of the files
+// after those 2/3, so that a --diff of the two has changes of things that are in both.
+static bool WriteChangedCapture(const std::string& inFile, const std::string& outFile)
+{
+    BuildEvents events;
+    BuildNames names;
+    MappedFile mapped;
+    if (!LoadCapture(inFile, mapped, events, names))
+        return false;
+    std::map<int, int> rootOrder; // root event index -> order of it among the roots
+    for (int i = 0, n = (int)events.size(); i != n; ++i)
+        if (events.parents[EventIndex(i)].idx < 0)
+            rootOrder[i] = (int)rootOrder.size();
+    for (int i = 0, n = (int)events.size(); i != n; ++i)
+    {
+        EventIndex root(i);
+        while (events.parents[root].idx >= 0)
+            root = events.parents[root];
+        int64_t& dur = events.durs[EventIndex(i)];
+        switch (rootOrder[root.idx] % 3)
+        {
+        case 0: dur = dur * 3 / 2; break;
+        case 1: dur = dur * 2 / 3; break;
+        }
+    }
+    return SaveBuildEventsBinary(outFile, events, names);
+}
+
+static int RunBench(int argc, const char* argv[]);
+
+static int RunTests(int argc, const char* argv[])
+{
+    if (argc < 3)
+    {
+        printf("%sERROR: --test requires <test_folder> to be passed.%s\n", col::kRed, col::kReset);
+        return 1;
+    }
+
+    uint64_t tStart = stm_now();
+
+    std::string testsFolder = argv[2];
+    printf("%sRunning tests under '%s'...%s\n", col::kYellow, testsFolder.c_str(), col::kReset);
 
     int failures = 0;
+    std::vector<std::string> folders;
     cf_dir_t dir;
     cf_dir_open(&dir, testsFolder.c_str());
     while (dir.has_next)
     {
         cf_file_t entry;
         cf_read_file(&dir, &entry);
-        if (entry.is_dir && entry.name[0] != '.')
+        // folders starting with an underscore are written by the tests
+        if (entry.is_dir && entry.name[0] != '.' && entry.name[0] != '_')
         {
             if (!RunOneTest(entry.path))
                 ++failures;
+            folders.push_back(entry.path);
         }
         cf_dir_next(&dir);
     }
     cf_dir_close(&dir);
 
+    // --diff of the first test capture and a copy of it with changed durations
+    std::sort(folders.begin(), folders.end());
+    if (!folders.empty())
+    {
+        std::string oldTrace = folders[0] + "/_TraceOutput.json";
+        std::string newTrace = testsFolder + "/_DiffTraceOutput.bin";
+        const char* kDiffArgs[] = { "", "--diff", oldTrace.c_str(), newTrace.c_str() };
+        printf("%sRunning diff test of '%s'...%s\n", col::kYellow, oldTrace.c_str(), col::kReset);
+        if (!WriteChangedCapture(oldTrace, newTrace) ||
+            !RunOneTestOutput(testsFolder + "/_DiffOutput.txt", testsFolder + "/_DiffOutputExpected.txt", [&](FILE* out) { return RunDiff(4, kDiffArgs, out); }))
+            ++failures;
+    }
+
+    // small --bench run: generated traces go through the whole pipeline, and the analysis is written
+    {
+        std::string benchFolder = testsFolder + "/_Bench";
+        std::string benchAnalysisFile = benchFolder + "/_BenchAnalysis.txt";
+        const char* kBenchArgs[] = { "", "--bench", benchFolder.c_str(), "2", "50", "2", "8" };
+        printf("%sRunning bench test in '%s'...%s\n", col::kYellow, benchFolder.c_str(), col::kReset);
+        remove(benchAnalysisFile.c_str());
+        if (RunBench(7, kBenchArgs) != 0 || ReadFileToString(benchAnalysisFile).empty())
+        {
+            printf("%sBench test did not write analysis file '%s'%s\n", col::kRed, benchAnalysisFile.c_str(), col::kReset);
+            ++failures;
+        }
+    }
+
     double tDuration = stm_sec(stm_since(tStart));
     printf("%s  tests done in %.1fs.%s\n", col::kYellow, tDuration, col::kReset);
     if (failures != 0)
@@ -387,16 +1454,136 @@ static int RunTests(int argc, const char* argv[])
 }
 
 
+// Generates a synthetic build of the given size, and runs it through the same steps
+// as --stop and --analyze do, timing each processing phase.
+static int RunBench(int argc, const char* argv[])
+{
+    if (argc < 3)
+    {
+        printf("%sERROR: --bench requires <folder> to be passed.%s\n", col::kRed, col::kReset);
+        return 1;
+    }
+    TraceGeneratorSettings settings;
+    if (argc > 3)
+        settings.fileCount = atoi(argv[3]);
+    if (argc > 4)
+        settings.eventsPerFile = atoi(argv[4]);
+    if (argc > 5)
+        settings.templateDepth = atoi(argv[5]);
+    if (argc > 6)
+        settings.nameLength = atoi(argv[6]);
+    if (settings.fileCount <= 0 || settings.eventsPerFile <= 0 || settings.templateDepth < 0 || settings.nameLength <= 0)
+    {
+        printf("%sERROR: --bench settings should be positive numbers.%s\n", col::kRed, col::kReset);
+        return 1;
+    }
+
+    std::string folder = argv[2];
+    printf("%sGenerating %i trace files with %i events each into '%s'...%s\n", col::kYellow, settings.fileCount, settings.eventsPerFile, folder.c_str(), col::kReset);
+    if (!CreateFolder(folder) || !WriteSessionFile(folder, time(NULL) - 1))
+        return 1;
+    size_t traceSize = GenerateTraceFiles(folder, settings);
+    if (traceSize == 0)
+    {
+        printf("%sERROR: failed to write trace files into '%s'.%s\n", col::kRed, folder.c_str(), col::kReset);
+        return 1;
+    }
+
+    timing::Reset();
+    uint64_t tStart = stm_now();
+
+    std::string captureFile = folder + "/_BenchCapture.json";
+    const char* kStopArgs[] = { "", "--stop", folder.c_str(), captureFile.c_str() };
+    if (RunStop(4, kStopArgs) != 0)
+        return 1;
+
+    MappedFile mapped;
+    if (!mapped.Open(captureFile.c_str(), true) || mapped.GetSize() == 0)
+    {
+        printf("%sERROR: failed to open file '%s'.%s\n", col::kRed, captureFile.c_str(), col::kReset);
+        return 1;
+    }
+    timing::Count(timing::kFilesRead);
+    timing::Count(timing::kBytesRead, mapped.GetSize());
+    const size_t captureSize = mapped.GetSize();
+    BuildEvents events;
+    BuildNames names;
+    events.reserve(2048);
+    names.reserve(2048);
+    ParseBuildEvents(mapped.GetWritableData(), captureSize, events, names);
+    if (events.empty())
+    {
+        printf("%s  no trace events found.%s\n", col::kYellow, col::kReset);
+        return 1;
+    }
+
+    // the analysis itself goes into a file, to not flood the benchmark results
+    std::string analysisFile = folder + "/_BenchAnalysis.txt";
+    FILE* out = fopen(analysisFile.c_str(), "wb");
+    if (!out)
+    {
+        printf("%sERROR: failed to write result file '%s'.%s\n", col::kRed, analysisFile.c_str(), col::kReset);
+        return 1;
+    }
+    DoAnalysis(events, names, out);
+    fclose(out);
+
+    double tDuration = stm_sec(stm_since(tStart));
+    const double kMB = 1024.0 * 1024.0;
+    double parseSeconds = timing::GetSeconds(timing::kParse);
+    double aggregateSeconds = timing::GetSeconds(timing::kAggregate);
+    printf("%sBenchmark of %i files, %zu events, %.1f MB capture:%s\n", col::kYellow, settings.fileCount, events.size(), captureSize / kMB, col::kReset);
+    timing::Print();
+    printf("%sThroughput:%s\n", col::kYellow, col::kReset);
+    // tiny runs can take less time than the timer resolution
+    auto perSecond = [](double amount, double seconds) { return seconds > 0.0 ? amount / seconds : 0.0; };
+    printf("  %-16s %s%9.1f%s MB/s, %s%.2f%s M events/s\n", "Parse", col::kBold, perSecond(captureSize / kMB, parseSeconds), col::kReset, col::kBold, perSecond(events.size() / 1.0e6, parseSeconds), col::kReset);
+    printf("  %-16s %s%9.2f%s M events/s\n", "Aggregate", col::kBold, perSecond(events.size() / 1.0e6, aggregateSeconds), col::kReset);
+    printf("  %-16s %s%9.1f%s ms\n", "Total", col::kBold, tDuration * 1000.0, col::kReset);
+    memstats::Print();
+
+    return 0;
+}
+
 static int ProcessCommands(int argc, const char* argv[])
 {
     if (strcmp(argv[1], "--start") == 0)
         return RunStart(argc, argv);
     if (strcmp(argv[1], "--stop") == 0)
         return RunStop(argc, argv);
-    if (strcmp(argv[1], "--analyze") == 0)
-        return RunAnalyze(argc, argv, stdout);
+    if (strcmp(argv[1], "--watch") == 0)
+        return RunWatch(argc, argv);
+    if (strcmp(argv[1], "--analyze") == 0 || strcmp(argv[1], "--merge") == 0)
+    {
+        auto run = strcmp(argv[1], "--analyze") == 0 ? RunAnalyze : RunMerge;
+        if (s_ReportFormat == ReportFormat::kText)
+            return run(argc, argv, stdout, ReportFormat::kText);
+        // machine readable report is the only thing in stdout, other messages go to stderr
+        FILE* out = RedirectStdoutToStderr();
+        int res = run(argc, argv, out ? out : stdout, s_ReportFormat);
+        if (out)
+            fclose(out);
+        return res;
+    }
+    if (strcmp(argv[1], "--analyze-shard") == 0)
+        return RunAnalyzeShard(argc, argv);
+    if (strcmp(argv[1], "--diff") == 0)
+        return RunDiff(argc, argv, stdout);
+    if (strcmp(argv[1], "--convert") == 0)
+        return RunConvert(argc, argv);
+    if (strcmp(argv[1], "--serve") == 0)
+    {
+        // replies are the only thing in stdout
+        FILE* out = RedirectStdoutToStderr();
+        int res = RunServe(argc, argv, stdin, out ? out : stdout);
+        if (out)
+            fclose(out);
+        return res;
+    }
     if (strcmp(argv[1], "--test") == 0)
         return RunTests(argc, argv);
+    if (strcmp(argv[1], "--bench") == 0)
+        return RunBench(argc, argv);
 
     printf("%sUnsupported command line arguments%s\n", col::kRed, col::kReset);
     PrintUsage();
@@ -409,13 +1596,92 @@ int main(int argc, const char* argv[])
     utils::Initialize();
     stm_setup();
 
-    if (argc < 2)
+    // options that can go anywhere in the command line
+    bool memStats = false;
+    bool timings = false;
+    const char* timingsTrace = nullptr;
+    FilterOptions filterOptions;
+    std::vector<const char*> args;
+    for (int i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--memstats") == 0)
+            memStats = true;
+        else if (strcmp(argv[i], "--timings") == 0)
+            timings = true;
+        else if (strcmp(argv[i], "--timings-trace") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                printf("%sERROR: --timings-trace requires <filename> to be passed.%s\n", col::kRed, col::kReset);
+                return 1;
+            }
+            timingsTrace = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                printf("%sERROR: --cache requires <dir> to be passed.%s\n", col::kRed, col::kReset);
+                return 1;
+            }
+            s_CacheDir = argv[++i];
+        }
+        else if (strncmp(argv[i], "--filter-", 9) == 0)
+        {
+            const char* option = argv[i] + 9;
+            const char** value = strcmp(option, "events") == 0 ? &filterOptions.events
+                : strcmp(option, "min-times") == 0 ? &filterOptions.minTimes
+                : strcmp(option, "include") == 0 ? &filterOptions.include
+                : strcmp(option, "exclude") == 0 ? &filterOptions.exclude
+                : nullptr;
+            if (!value || i + 1 >= argc)
+            {
+                printf("%sERROR: %s requires <list> to be passed, and should be one of --filter-events, --filter-min-times, --filter-include or --filter-exclude.%s\n", col::kRed, argv[i], col::kReset);
+                return 1;
+            }
+            *value = argv[++i];
+        }
+        else if (strcmp(argv[i], "--format") == 0)
+        {
+            const char* format = i + 1 < argc ? argv[++i] : "";
+            if (strcmp(format, "text") == 0)
+                s_ReportFormat = ReportFormat::kText;
+            else if (strcmp(format, "json") == 0)
+                s_ReportFormat = ReportFormat::kJson;
+            else if (strcmp(format, "csv") == 0)
+                s_ReportFormat = ReportFormat::kCsv;
+            else
+            {
+                printf("%sERROR: --format requires one of text, json or csv to be passed.%s\n", col::kRed, col::kReset);
+                return 1;
+            }
+        }
+        else
+            args.push_back(argv[i]);
+    }
+
+    if (args.size() < 2)
     {
         PrintUsage();
         return 1;
     }
 
-    int retCode = ProcessCommands(argc, argv);
+    if (CommandParsesTraces(args[1]) && !ReadParseFilters(filterOptions))
+        return 1;
+    if (timingsTrace)
+        timing::StartTrace();
+
+    int retCode = ProcessCommands((int)args.size(), args.data());
+
+    if (memStats)
+        memstats::Print();
+    if (timings)
+        timing::Print();
+    if (timingsTrace && !timing::WriteTrace(timingsTrace))
+    {
+        printf("%sERROR: failed to write timings trace file '%s'.%s\n", col::kRed, timingsTrace, col::kReset);
+        retCode = 1;
+    }
 
     return retCode;
 }